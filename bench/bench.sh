@@ -0,0 +1,95 @@
+#!/bin/bash
+# Runs the corpus of bench/corpus/list.txt with benchRun and writes JSON,
+# see "Тестирование производительности" in README.
+# Every program is run as C built by gcc -O2 and as ELF of binTranslate, and
+# on CPU of the language if VM_CMD is set. Output of each one is compared with
+# the output of C. A missing input of a variant that runs is an error.
+#
+# RUNS, WARMUP and CPU go to benchRun, OUT is the JSON file,
+# VM_CMD is how CPU of the language runs a program, {} is its file,
+# e.g. VM_CMD="./language/CPU {}".
+
+cd "$(dirname "$0")/.." || exit 1
+
+RUNS=${RUNS:-200}
+WARMUP=${WARMUP:-20}
+CPU=${CPU:-0}
+OUT=${OUT:-bench/results.json}
+VM_CMD=${VM_CMD:-}
+
+BUILD=bench/build
+CORPUS=bench/corpus
+mkdir -p "$BUILD"
+
+results=()
+failed=0
+
+need ()
+{
+    if [ ! -f "$1" ]
+    then
+        echo "bench: $1 is missing" >&2
+        exit 1
+    fi
+}
+
+if [ -n "$VM_CMD" ] && [ ! -x "${VM_CMD%% *}" ]
+then
+    echo "bench: CPU of the language ${VM_CMD%% *} is not there, build it or unset VM_CMD" >&2
+    exit 1
+fi
+
+bench ()
+{
+    local name=$1 runner=$2
+    shift 2
+
+    local result
+    result=$(./bench/benchRun --runs "$RUNS" --warmup "$WARMUP" --cpu "$CPU" \
+             --input "$BUILD/$name.in" --expect "$BUILD/$name.expected" "$name" "$runner" "$@") || failed=1
+    results+=("$result")
+    echo "$result" >&2
+}
+
+while read -r name kind input
+do
+    [[ -z "$name" || "$name" == \#* ]] && continue
+
+    eval "$input" > "$BUILD/$name.in"
+
+    need "$CORPUS/$name.c"
+    need "$CORPUS/$name.tree"
+    [ -n "$VM_CMD" ] && need "$CORPUS/$name.vm"
+
+    gcc -O2 -o "$BUILD/$name.c.out" "$CORPUS/$name.c" || exit 1
+    "$BUILD/$name.c.out" < "$BUILD/$name.in" > "$BUILD/$name.expected"
+    bench "$name" gcc-O2 "$BUILD/$name.c.out"
+
+    ./binTranslate "$CORPUS/$name.tree" "$BUILD/$name.bt.out" > /dev/null || exit 1
+    bench "$name" binTranslate "$BUILD/$name.bt.out"
+
+    if [ -n "$VM_CMD" ]
+    then
+        read -r -a vmArgs <<< "${VM_CMD//\{\}/$CORPUS/$name.vm}"
+        bench "$name" vm "${vmArgs[@]}"
+    fi
+done < "$CORPUS/list.txt"
+
+{
+    echo "{"
+    echo "  \"commit\": \"$(git rev-parse --short HEAD 2>/dev/null)\","
+    echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+    echo "  \"cpu_model\": \"$(grep -m1 'model name' /proc/cpuinfo | cut -d: -f2 | sed 's/^ *//')\","
+    echo "  \"results\": ["
+    for i in "${!results[@]}"
+    do
+        [ "$i" -gt 0 ] && echo ","
+        echo -n "    ${results[$i]}"
+    done
+    echo ""
+    echo "  ]"
+    echo "}"
+} > "$OUT"
+
+echo "Results are in $OUT" >&2
+exit $failed
@@ -0,0 +1,19 @@
+#include <stdio.h>
+
+// Loop of ADD, SUB, MUL and DIV by numbers and vars, as the language has no other operations
+int main ()
+{
+    int n = 0;
+    scanf ("%d", &n);
+
+    int acc = 1;
+    int i   = 0;
+    while (n - i)
+    {
+        acc = acc / 3 + i * 7 - i / 5 + (acc - i) / (i / 9 + 1);
+        i   = i + 1;
+    }
+
+    printf ("%d\n", acc);
+    return 0;
+}
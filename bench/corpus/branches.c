@@ -0,0 +1,29 @@
+#include <stdio.h>
+
+// Branches that are hard to predict: total steps of Collatz sequences
+int main ()
+{
+    int n = 0;
+    scanf ("%d", &n);
+
+    int steps = 0;
+    int k     = 1;
+    while (n - k)
+    {
+        int x = k;
+        while (x - 1)
+        {
+            if (x - x / 2 * 2)
+                x = 3 * x + 1;
+            else
+                x = x / 2;
+
+            steps = steps + 1;
+        }
+
+        k = k + 1;
+    }
+
+    printf ("%d\n", steps);
+    return 0;
+}
@@ -0,0 +1,5 @@
+// Start and exit of a process, the floor for wall time of the others
+int main ()
+{
+    return 0;
+}
@@ -0,0 +1,21 @@
+#include <stdio.h>
+
+// IN and OUT: reads n numbers and prints every prefix sum
+int main ()
+{
+    int n = 0;
+    scanf ("%d", &n);
+
+    int sum = 0;
+    while (n)
+    {
+        int x = 0;
+        scanf ("%d", &x);
+
+        sum = sum + x;
+        printf ("%d\n", sum);
+        n = n - 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,21 @@
+#include <stdio.h>
+
+// Calls: naive Fibonacci, two calls per level. The language has no
+// comparisons, n > 1 is n != 0 and n - 1 != 0 for n >= 0
+static int fib (int n)
+{
+    if (n)
+        if (n - 1)
+            return fib (n - 1) + fib (n - 2);
+
+    return n;
+}
+
+int main ()
+{
+    int n = 0;
+    scanf ("%d", &n);
+    printf ("%d\n", fib (n));
+
+    return 0;
+}
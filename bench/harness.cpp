@@ -0,0 +1,350 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+// Runs one program many times and prints JSON line with its times and
+// counters, see bench.sh. The harness and the program are pinned to one CPU.
+// Child is forked and waits on a pipe while counters are attached to it.
+// Counters start at exec and count only user space of the program, so
+// fork and exec are not in instructions and cycles. Wall time is from
+// the release of the child to waitpid, it has exec and exit in it, that
+// is why the corpus has an empty program to compare with.
+
+struct Options_bench
+{
+    size_t      runs;
+    size_t      warmup;
+    size_t      cpu;
+    const char* input;      // stdin of the program, /dev/null if NULL
+    const char* expect;     // stdout of the first run is compared with it
+    const char* name;
+    const char* runner;
+    char**      argv;       // program and its args
+};
+
+struct Sample_bench
+{
+    uint64_t nanoseconds;
+    uint64_t instructions;
+    uint64_t cycles;
+};
+
+enum COUNTERS
+{
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CYCLES,
+
+    COUNTERS_COUNT,
+};
+
+static const uint64_t CounterConfigs[COUNTERS_COUNT] = {PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES};
+
+// Counters
+//----------------------------------------
+static int openCounter (pid_t pid, uint64_t config)
+{
+    perf_event_attr attr = {};
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof (attr);
+    attr.config         = config;
+    attr.disabled       = 1;
+    attr.enable_on_exec = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.inherit        = 1;
+
+    return (int) syscall (SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+static uint64_t readCounter (int fd)
+{
+    uint64_t value = 0;
+    if (fd < 0 || read (fd, &value, sizeof (value)) != sizeof (value))
+        return 0;
+
+    return value;
+}
+//----------------------------------------
+
+// Runs
+//----------------------------------------
+static uint64_t nowNanoseconds ()
+{
+    timespec now = {};
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+static void redirect (const char* fileName, int flags, int target)
+{
+    int fd = open (fileName, flags, 0644);
+    if (fd < 0)
+    {
+        perror (fileName);
+        _exit (127);
+    }
+
+    dup2 (fd, target);
+    close (fd);
+}
+
+// Child waits for a byte, so counters are attached before exec
+static pid_t startChild (const Options_bench* options, const char* output, int* goFd)
+{
+    int pipeFds[2] = {};
+    int error = pipe (pipeFds);
+    assert (error == 0);
+
+    pid_t pid = fork ();
+    assert (pid >= 0);
+
+    if (pid == 0)
+    {
+        close (pipeFds[1]);
+        redirect (options->input ? options->input : "/dev/null", O_RDONLY, STDIN_FILENO);
+        redirect (output, O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO);
+
+        char go = 0;
+        if (read (pipeFds[0], &go, sizeof (go)) != sizeof (go))
+            _exit (127);
+
+        close (pipeFds[0]);
+        execvp (options->argv[0], options->argv);
+        perror (options->argv[0]);
+        _exit (127);
+    }
+
+    close (pipeFds[0]);
+    *goFd = pipeFds[1];
+    return pid;
+}
+
+// false if the program failed
+static bool runOnce (const Options_bench* options, const char* output, Sample_bench* sample, bool* counted)
+{
+    int   goFd = -1;
+    pid_t pid  = startChild (options, output, &goFd);
+
+    int counters[COUNTERS_COUNT] = {};
+    for (size_t i = 0; i < COUNTERS_COUNT; i++)
+        counters[i] = openCounter (pid, CounterConfigs[i]);
+
+    *counted = counters[COUNTER_INSTRUCTIONS] >= 0 && counters[COUNTER_CYCLES] >= 0;
+
+    uint64_t start = nowNanoseconds ();
+    char     go    = 1;
+    ssize_t  sent  = write (goFd, &go, sizeof (go));
+    close (goFd);
+
+    int status = 0;
+    waitpid (pid, &status, 0);
+    uint64_t end = nowNanoseconds ();
+
+    sample->nanoseconds  = end - start;
+    sample->instructions = readCounter (counters[COUNTER_INSTRUCTIONS]);
+    sample->cycles       = readCounter (counters[COUNTER_CYCLES]);
+
+    for (size_t i = 0; i < COUNTERS_COUNT; i++)
+    {
+        if (counters[i] >= 0)
+            close (counters[i]);
+    }
+
+    return sent == sizeof (go) && WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+static bool sameFiles (const char* first, const char* second)
+{
+    FILE* firstFile  = fopen (first, "rb");
+    FILE* secondFile = fopen (second, "rb");
+    bool  same       = firstFile != NULL && secondFile != NULL;
+
+    while (same)
+    {
+        int a = fgetc (firstFile);
+        int b = fgetc (secondFile);
+
+        same = a == b;
+        if (a == EOF)
+            break;
+    }
+
+    if (firstFile)
+        fclose (firstFile);
+    if (secondFile)
+        fclose (secondFile);
+
+    return same;
+}
+//----------------------------------------
+
+// Statistics
+//----------------------------------------
+static int compareU64 (const void* first, const void* second)
+{
+    uint64_t a = *(const uint64_t*) first;
+    uint64_t b = *(const uint64_t*) second;
+
+    return (a > b) - (a < b);
+}
+
+// Nearest rank, values are sorted
+static uint64_t percentile (const uint64_t* values, size_t size, size_t percent)
+{
+    size_t rank = (size * percent + 99) / 100;
+    return values[(rank > 0) ? rank - 1 : 0];
+}
+
+static void printStats (const char* name, uint64_t* values, size_t size)
+{
+    qsort (values, size, sizeof (*values), compareU64);
+
+    printf ("\"%s\": {\"min\": %lu, \"median\": %lu, \"p99\": %lu}", name,
+            values[0], percentile (values, size, 50), percentile (values, size, 99));
+}
+
+static void printJsonString (const char* str)
+{
+    putchar ('"');
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+            putchar ('\\');
+
+        putchar (*str);
+    }
+    putchar ('"');
+}
+//----------------------------------------
+
+static void printHelp ()
+{
+    printf ("Usage: ./benchRun [--runs <N>] [--warmup <N>] [--cpu <K>] [--input <file>] [--expect <file>] <name> <runner> <program> [args...]\n");
+    printf ("       prints JSON with min, median and p99 of wall time in ns, instructions and cycles of the program\n");
+}
+
+static bool parseOptions (int argc, char* argv[], Options_bench* options)
+{
+    *options = {200, 20, 0, NULL, NULL, NULL, NULL, NULL};
+
+    int i = 1;
+    for (; i + 1 < argc && strncmp (argv[i], "--", 2) == 0; i += 2)
+    {
+        if (strcmp (argv[i], "--runs") == 0)
+            options->runs = strtoul (argv[i + 1], NULL, 10);
+        else if (strcmp (argv[i], "--warmup") == 0)
+            options->warmup = strtoul (argv[i + 1], NULL, 10);
+        else if (strcmp (argv[i], "--cpu") == 0)
+            options->cpu = strtoul (argv[i + 1], NULL, 10);
+        else if (strcmp (argv[i], "--input") == 0)
+            options->input = argv[i + 1];
+        else if (strcmp (argv[i], "--expect") == 0)
+            options->expect = argv[i + 1];
+        else
+            return false;
+    }
+
+    if (argc - i < 3 || options->runs == 0)
+        return false;
+
+    options->name   = argv[i];
+    options->runner = argv[i + 1];
+    options->argv   = argv + i + 2;
+    return true;
+}
+
+int main (int argc, char* argv[])
+{
+    Options_bench options = {};
+    if (!parseOptions (argc, argv, &options))
+    {
+        printHelp ();
+        return 1;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO (&cpus);
+    CPU_SET (options.cpu, &cpus);
+    if (sched_setaffinity (0, sizeof (cpus), &cpus) != 0)
+        perror ("sched_setaffinity");
+
+    char output[] = "/tmp/benchRunXXXXXX";
+    int  outputFd = mkstemp (output);
+    assert (outputFd >= 0);
+    close (outputFd);
+
+    uint64_t* times        = (uint64_t*) calloc (options.runs, sizeof (*times));
+    uint64_t* instructions = (uint64_t*) calloc (options.runs, sizeof (*instructions));
+    uint64_t* cycles       = (uint64_t*) calloc (options.runs, sizeof (*cycles));
+    assert (times != NULL && instructions != NULL && cycles != NULL);
+
+    bool ok       = true;
+    bool counted  = true;
+    bool outputOk = true;
+
+    for (size_t i = 0; ok && i < options.warmup + options.runs; i++)
+    {
+        Sample_bench sample     = {};
+        bool         runCounted = false;
+
+        ok = runOnce (&options, (i == 0) ? output : "/dev/null", &sample, &runCounted);
+
+        if (i == 0 && options.expect)
+            outputOk = sameFiles (output, options.expect);
+
+        if (i < options.warmup)
+            continue;
+
+        counted = counted && runCounted;
+        times       [i - options.warmup] = sample.nanoseconds;
+        instructions[i - options.warmup] = sample.instructions;
+        cycles      [i - options.warmup] = sample.cycles;
+    }
+
+    remove (output);
+
+    printf ("{\"name\": ");
+    printJsonString (options.name);
+    printf (", \"runner\": ");
+    printJsonString (options.runner);
+    printf (", \"runs\": %lu, \"warmup\": %lu, \"cpu\": %lu, \"ok\": %s", options.runs, options.warmup, options.cpu,
+            ok ? "true" : "false");
+
+    if (options.expect)
+        printf (", \"output_ok\": %s", outputOk ? "true" : "false");
+
+    if (ok)
+    {
+        printf (", ");
+        printStats ("time_ns", times, options.runs);
+
+        if (counted)
+        {
+            printf (", ");
+            printStats ("instructions", instructions, options.runs);
+            printf (", ");
+            printStats ("cycles", cycles, options.runs);
+        }
+        else
+            printf (", \"instructions\": null, \"cycles\": null");
+    }
+
+    printf ("}\n");
+
+    free (times);
+    free (instructions);
+    free (cycles);
+
+    return (ok && outputOk) ? 0 : 1;
+}
@@ -6,15 +6,40 @@
 #include <cstdint>
 
 #include "../language/common.h"
+#include "./symTable.h"
+#include "./arena.h"
+#include "./threadPool.h"
+#include "./timeReport.h"
 
 struct Block_bt;
 struct Op_bt;  // operator type
 
 enum Location
 {
-    Register = 1,
-    Memory   = 2,
-    Stack    = 3,
+    Register  = 1,
+    Memory    = 2,
+    Stack     = 3,
+    Allocated = 4,  // lives in Var_bt::reg, see regAlloc.cpp
+};
+
+enum REG_NUM
+{
+    RAX = 0x00,
+    RCX = 0x01,
+    RDX = 0x02,
+    RBX = 0x03,
+    RSP = 0x04,
+    RBP = 0x05,
+    RSI = 0x06,
+    RDI = 0x07,
+    R8  = 0x08,
+    R9  = 0x09,
+    R10 = 0x0A,
+    R11 = 0x0B,
+    R12 = 0x0C,
+    R13 = 0x0D,
+    R14 = 0x0E,
+    R15 = 0x0F,
 };
 
 struct OpCode_bt
@@ -23,70 +48,188 @@ struct OpCode_bt
     unsigned int imm:1;
     unsigned int reg:1;
     unsigned int mem:1;
+    unsigned int tail:1;    // CALL whose result goes right to RET, see markTailCalls
 };
 
 struct Var_bt
 {
-    char*    name;
+    const char* name;       // interned, NULL for temps
     Location location;
     int offset;
+    REG_NUM  reg;
+};
+
+union Value_bt
+{
+    int      num;
+    uint32_t var;           // index in varArray of the function
+    uint32_t block;         // index in blockArray of the function
+    uint32_t func;          // index in funcArray, callee of CALL
+};
+
+// Operands are stored right in Cmd_bt, Unknown type means there is no operand.
+// Pointer_t is a block, Func_t is a function
+struct Op_bt  // operator type
+{
+    Type type;
+    Value_bt value;
 };
 
 struct Cmd_bt
 {
     OpCode_bt opCode;
-    Op_bt*   operator1;
-    Op_bt*   operator2;
-    Op_bt*   dest;
+    Op_bt    operator1;
+    Op_bt    operator2;
+    Op_bt    dest;
+    uint32_t liveRegs; // mask of allocated regs to keep alive over CALL, OUT and IN
 };
 
+// Commands of the block are cmdArray[cmdStart, cmdStart + cmdArraySize) of its function
 struct Block_bt
 {
-    char name[15];
-    Cmd_bt* cmdArray;
+    const char* name;       // interned
+    size_t  cmdStart;
     size_t  cmdArraySize;
     size_t  cmdArrayCapacity;
-    size_t  codeOffset;
+    size_t  codeOffset;     // position in x86_array, set when block is emitted, moved by linkFunctions
 };
 
-union Value_bt
+// rel32 in x86_array that is known only when all code is emitted
+enum FIXUP_KIND
 {
-    int num;
-    Var_bt* var;
+    FIXUP_BLOCK   = 1,  // jmp, jcc or call to Block_bt::codeOffset
+    FIXUP_RUNTIME = 2,  // call to runtime, runtimeOffset is from the end of code
+};
+
+struct Fixup_bt
+{
+    FIXUP_KIND kind;
+    size_t    pos;
     Block_bt* block;
+    size_t    runtimeOffset;
 };
 
-struct Op_bt  // operator type
+// Rules of peephole.cpp, hits are counted per last dumpIRToAsm
+enum PEEPHOLE_RULES
 {
-    Type type;
-    Value_bt value;
+    PH_PUSH_POP,        // push x; pop y
+    PH_SAVE_RESTORE,    // push x ... pop x around code that keeps x
+    PH_STORE_LOAD,      // mov [rbp - n], x; mov y, [rbp - n]
+    PH_CMP_ZERO,        // mov rbx, 0; cmp rax, rbx
+    PH_ALU_IMM,         // mov rbx, imm; add/sub/cmp rax, rbx
+    PH_MOV_FOLD,        // mov rax, x; mov y, rax
+
+    PH_RULES_COUNT,
+};
+
+// Machine code with fixups in it. Every function is emitted into its own
+// buffer and linkFunctions copies them into the one of the program
+struct CodeBuf_bt
+{
+    size_t   BT_ip;
+    size_t x86_arraySize;
+    size_t x86_arrayCapacity;
+    unsigned char* x86_array;
+    Fixup_bt* fixups;
+    size_t    fixupsSize;
+    size_t    fixupsCapacity;
+    size_t peepholeHits[PH_RULES_COUNT];
+};
+
+// What is owned by one function, so functions are compiled in parallel, see threadPool.cpp
+struct FuncCtx_bt
+{
+    Arena_bt arena;         // IR of the function, released by IRdtor
+    Node*    node;          // FUNC node of the tree
+    int      numberOfIf;    // for names of blocks
+    int      numberOfWhile;
+    CodeBuf_bt code;        // between emission and linkFunctions
+    char*    asmText;       // the same for DebugAsm.s
+    size_t   asmTextSize;
+    uint64_t cacheKey;      // name of the code in --cache directory, see codeCache.cpp
+    bool     cached;        // code is taken from the cache, nothing after inlining is done
 };
 
 struct Func_bt
 {
-    char    name[15];
+    const char* name;       // interned
     Var_bt* varArray;
+    SymMap_bt varMap;       // names to varArray, only while function is parsed
+    Cmd_bt* cmdArray;       // commands of all blocks in block order
+    size_t  cmdArraySize;
+    size_t  cmdArrayCapacity;
     Block_bt* blockArray;
     size_t varArraySize;
     size_t varArrayCapacity;
     size_t numberOfTempVar;
+    size_t numberOfParams;  // PAROUT in the entry block, see numOfParams
     size_t blockArraySize;
     size_t blockArrayCapacity;
+    size_t frameSize;
+    size_t saveAreaOffset;
     int aliveFlag;
+    FuncCtx_bt ctx;
+};
+
+// Places in x86_array that depend on the address program is loaded at
+struct StartPatch_bt
+{
+    size_t printfOutPos;    // r12
+    size_t scanfBufPos;     // r14
+    size_t stackPos;        // rsp, in process run the whole mov is skipped
+    size_t exitPos;         // exit syscall after call main
+};
+
+// Layout of bin/BinPrintf and bin/BinScanf, see src/printInt.s and src/scanInt.s
+enum RUNTIME_LAYOUT
+{
+    PRINTF_FLUSH_OFFSET = 0x7f,         // entry that writes buffer to stdout
+    PRINTF_BUF_SIZE     = 8 + 4096,     // used bytes counter and buffer itself, goes right after runtime
+    SCANF_BUF_SIZE      = 16 + 4096,    // read position, bytes in buffer and buffer, after printf one
+    DEFAULT_STACK_SIZE  = 16 << 20,     // machine stack after buffers, --stack-size changes it
+};
+
+// Diagnostic output, --dump turns it on, nothing is dumped by default
+enum DUMP_FLAGS
+{
+    DUMP_TREE = 1 << 0,     // treeDump of the tree
+    DUMP_IR   = 1 << 1,     // Dump.txt
+    DUMP_ASM  = 1 << 2,     // DebugAsm.s
+    DUMP_CODE = 1 << 3,     // asm.txt and hex of the code to stdout
+};
+
+// Sizes of a subtree, see collectTreeStats
+struct TreeStats_bt
+{
+    size_t numOfCmd;
+    size_t numOfVars;
+    size_t numOfBlocks;
+    size_t numOfFunc;
 };
 
 // Elements with nullptr in name are needed in the end of array
 struct BinaryTranslator
 {
+    Arena_bt arena;         // names, funcArray and tree stats, IR is in FuncCtx_bt
     Func_bt* funcArray;
     size_t   funcArraySize;
     Var_bt*  globalVars;
-    size_t   BT_ip;
-    size_t x86_arraySize;
-    NameTable nameTable;
-    unsigned char* x86_array;
+    SymTable_bt symbols;
+    SymMap_bt   funcMap;    // names to funcArray
+    TreeStats_bt* treeStats;            // of functions and IF bodies, while tree is parsed
+    size_t        treeStatsSize;
+    size_t        treeStatsCapacity;
+    SymMap_bt     treeStatsMap;         // Node* to treeStats
+    CodeBuf_bt code;        // of the whole program
     unsigned char x86Mem_array[512];
+    StartPatch_bt startPatch;
+    ThreadPool_bt pool;
     Node* tree;
+    bool  verbose;
+    size_t stackSize;       // bytes of machine stack the program gets
+    const char* cacheDir;   // --cache, NULL if code is not cached
+    unsigned dumps;         // DUMP_FLAGS
+    TimeReport_bt timeReport;
 };
 
 struct x86_cmd
@@ -95,15 +238,6 @@ struct x86_cmd
     uint64_t size;
 };
 
-enum REG_NUM
-{
-    RAX = 0x00,
-    RCX = 0x01,
-    RDX = 0x02,
-    RBX = 0x03,
-    RDI = 0x07,
-};
-
 enum OPCODES_x86 : uint64_t // everything reversed
 {
 
@@ -112,67 +246,112 @@ enum OPCODES_x86 : uint64_t // everything reversed
 
     SUB_RAX_RBX = 0xD82948,
     ADD_RAX_RBX = 0xD80148,
-    MUL_RBX     = 0xE3F748,
-    DIV_RBX     = 0xF3F748,
-
-    // mov [r9 + %d], %d
-    // A number after
-    MOV_MEM_IMM   = 0xFF41C749,
-    //                ^ -offset
-    //                mov [r9 + offset], rax
-    MOV_MEM_REG   = 0xFF008949,
-    //                ^ (ff - offset) to make [r9 - offset]
-
-    MOV_REG_MEM   = 0xFF008B49,
-    MOV_REG_IMM   = 0xB8,
+    ADD_RAX_RDX = 0xD00148,
+    SUB_RAX_RDX = 0xD02948,
+
+    // Multiplication and division, see translateBaseMath
+    IMUL_RAX_RBX   = 0xC3AF0F48,
+    IMUL_RAX_RDX   = 0xC2AF0F48,
+    IMUL_RAX_IMM8  = 0xC06B48,  // imul rax, rax, imm8
+    IMUL_RAX_IMM32 = 0xC06948,  // imul rax, rax, imm32
+    LEA_RAX_SCALED = 0x048D48,  // lea rax, [rax + rax * scale]
+    //                 ^ SIB byte goes after
+    SHL_RAX_IMM    = 0xE0C148,  // imm8 goes after
+    SAR_RAX_IMM    = 0xF8C148,
+    SHR_RDX_IMM    = 0xEAC148,
+    MOVSXD_RAX_EAX = 0xC06348,
+    MOVSXD_RBX_EBX = 0xDB6348,
+    CQO            = 0x9948,
+    IDIV_RBX       = 0xFBF748,
+    NEG_RAX        = 0xD8F748,
+
+    // Variables are [rbp - offset], params are [rbp + 16 + 8 * index]
+    // mov qword [rbp + disp], imm32
+    // ModRM with displacement and a number after
+    MOV_MEM_IMM   = 0xC748,
+    //                mov [rbp + disp], reg
+    MOV_MEM_REG   = 0x8948,
+    //                mov reg, [rbp + disp]
+    MOV_REG_MEM   = 0x8B48,
+    //                lea reg, [rbp + disp]
+    LEA_REG_MEM   = 0x8D48,
+    //                ^ add REX_R_MASK for r8-r15
+    MOV_REG_IMM   = 0xB8,       // mov r32, imm32, zero extends
+    MOV_REG_IMM32 = 0xC0C748,   // mov r/m64, imm32, sign extends
+    //                ^ reg, add REX_B_MASK for r8-r15
+
+    // mov r/m64, r64
+    MOV_REG_REG   = 0xC08948,
+    //                ^ dest | src << 3
 
     PUSH_REG = 0x50, //    push/pop r?x
     POP_REG = 0x58,  //              ^--- add 0, 1, 2, 3 to get rax, rcx, rdx or rbx
 		     //
 // Constant expressions, no need for bit masks
 
-    MOV_R9_IMM64  = 0xB949,
-    MOV_R11_IMM64 = 0xBB49,
+    MOV_RSP_IMM64 = 0xBC48,
     MOV_R12_IMM64 = 0xBC49,
     MOV_R14_IMM64 = 0xBE49,
 
     CALL_OP = 0xE8,     // call <32b ptr>
     RET_OP = 0xC3,      // ret
+    RET_IMM16 = 0xC2,   // ret <16b number of bytes to pop>
 
     JMP_OP = 0xE9,      // jmp <32b ptr>
     COND_JMP = 0x000F,
 
     PUSH_32b = 0x68,
 
-    CMP_RAX_RBX = 0xD83948,
+    // test r/m32, r32, numbers are 32 bit and the high half of a register is not trusted
+    TEST_REG_REG = 0xC085,
+    //             ^ reg | reg << 3, REX_R_MASK | REX_B_MASK prefix for r8-r15
 
     MOV_RDI_RAX = 0xC78948,
     MOV_RCX_RAX = 0xC88948,
     MOV_RCX_RBX = 0xCB8948,
 
     PUSH_R10 = 0x5241,
-    PUSH_R9  = 0x5141,
-    POP_R9   = 0x5941,
     POP_R10  = 0x5a41,
     PUSH_RBP = 0x55,
     PUSH_RSP = 0x54,
     POP_RBP = 0x5D,
     POP_RSP = 0x5C,
 
-    ADD_R9_IMM = 0xC18149,
-    SUB_R9_IMM = 0xE98149,
-    MOV_RDI_R9 = 0xCF894C,
+    // Frame, see dumpFunctionToAsm and translateEpilogue
+    MOV_RBP_RSP = 0xE58948,
+    MOV_RSP_RBP = 0xEC8948,
+    SUB_RSP_IMM = 0xEC8148,
+    ADD_RSP_IMM = 0xC48148,
 };
 
 enum OPCODE_SIZES
 {
     SIZE_ARITHM   = 3,
 
-    SIZE_CMP_RAX_RBX = 3,
+    SIZE_IMUL_RAX_RBX   = 4,
+    SIZE_IMUL_RAX_RDX   = 4,
+    SIZE_IMUL_RAX_IMM8  = 3,    // without imm
+    SIZE_IMUL_RAX_IMM32 = 3,
+    SIZE_LEA_RAX_SCALED = 3,    // without SIB
+    SIZE_SHIFT_IMM      = 3,    // without imm
+    SIZE_MOVSXD_RAX_EAX = 3,
+    SIZE_MOVSXD_RBX_EBX = 3,
+    SIZE_CQO            = 2,
+    SIZE_IDIV_RBX       = 3,
+    SIZE_NEG_RAX        = 3,
+    SIZE_ADD_RAX_RDX    = 3,
+    SIZE_SUB_RAX_RDX    = 3,
+
+    SIZE_TEST_REG_REG = 2,
     SIZE_PUSH_32b = 1,
 
-    SIZE_MOV_MEM_IMM = 4,
+    SIZE_MOV_MEM_IMM = 2,   // without ModRM and displacement
+    SIZE_MOV_MEM_REG = 2,
+    SIZE_MOV_REG_MEM = 2,
+    SIZE_LEA_REG_MEM = 2,
     SIZE_MOV_REG_IMM = 1,
+    SIZE_MOV_REG_IMM32 = 3, // without imm
+    SIZE_REX_PREFIX  = 1,
 
     SIZE_PUSH_REG    = 1,
     SIZE_POP_REG     = 1,
@@ -183,11 +362,10 @@ enum OPCODE_SIZES
 
     SIZE_JMP_OP     = 1,
     SIZE_COND_JMP   = 2,
-    SIZE_PUSH_R9    = 2,
-    SIZE_POP_R9    = 2,
     SIZE_PUSH_R10   = 2,
     SIZE_POP_R10    = 2,
     SIZE_RET_OP     = 1,
+    SIZE_RET_IMM16  = 1,    // without imm
     SIZE_CALL_OP    = 1,
 
     SIZE_PUSH_RBP = 1,
@@ -196,13 +374,13 @@ enum OPCODE_SIZES
     SIZE_POP_RSP = 1,
 
     SIZE_MOV_RDI_RAX = 3,
-    SIZE_ADD_R9_IMM = 3,
-    SIZE_SUB_R9_IMM = 3,
-    SIZE_MOV_R9_IMM64 = 2,
-    SIZE_MOV_R11_IMM64 = 2,
+    SIZE_MOV_RBP_RSP = 3,
+    SIZE_MOV_RSP_RBP = 3,
+    SIZE_SUB_RSP_IMM = 3,
+    SIZE_ADD_RSP_IMM = 3,
+    SIZE_MOV_RSP_IMM64 = 2,
     SIZE_MOV_R12_IMM64 = 2,
     SIZE_MOV_R14_IMM64 = 2,
-    SIZE_MOV_RDI_R9   = 3,
 };
 
 
@@ -211,6 +389,11 @@ enum OPCODE_MASKS : uint64_t
     MOV_RAX_MASK = 0x41,
     MOV_RBX_MASK = 0x59,
     MOV_RCX_MASK = 0x49,
+    RBP_DISP8_MASK  = 0x45, // ModRM for [rbp + disp8]
+    RBP_DISP32_MASK = 0x85, // ModRM for [rbp + disp32]
+    REX_B_MASK = 0x01,
+    REX_R_MASK = 0x04,
+    REX_B      = 0x41,
     XMM0_MASK = 0x44,   // masks for work with xmm registers
     XMM1_MASK = 0x4c,
 
@@ -229,8 +412,6 @@ enum OPCODE_MASKS : uint64_t
 void parseTreeToIR (const char* fileName, BinaryTranslator* binTranslator);
 void dumpIR (const char* fileName, const BinaryTranslator* binTranslator);
 void dumpIRToAsm (const char* fileName, BinaryTranslator* binTranslator);
-void firstIteration (BinaryTranslator* binTranslator);
-void dumpBTtable (NameTable nametable);
 void startProg (BinaryTranslator* binTranslator);
 void binTranslatorDtor (BinaryTranslator* binTranslator);
 void IRdtor (BinaryTranslator* binTranslator);
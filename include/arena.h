@@ -0,0 +1,34 @@
+#ifndef ARENA
+#define ARENA
+
+#include <cstddef>
+#include <stdio.h>
+
+// Bump allocator for everything that lives as long as the IR, see arena.cpp.
+// Nothing is freed one by one, arenaDtor releases whole arena at once.
+
+struct ArenaChunk_bt;
+
+struct Arena_bt
+{
+    ArenaChunk_bt* chunk;       // current one, older are linked through prev
+    size_t numOfAllocs;
+    size_t bytesAllocated;      // asked by arenaAlloc
+    size_t bytesReserved;       // taken from malloc
+    size_t numOfChunks;
+    size_t startSize;           // of the first chunk, 0 for ArenaStartSize
+};
+
+// Zeroed arena is ready too, it starts with a chunk of default size
+void  arenaCtor    (Arena_bt* arena, size_t startSize);
+
+// Memory is zeroed, as from calloc
+void* arenaAlloc   (Arena_bt* arena, size_t size);
+void* arenaRealloc (Arena_bt* arena, void* ptr, size_t oldSize, size_t newSize);
+char* arenaStrdup  (Arena_bt* arena, const char* str);
+void  arenaDtor    (Arena_bt* arena);
+
+void arenaAddStats  (Arena_bt* total, const Arena_bt* arena);
+void dumpArenaStats (FILE* fileptr, const char* name, const Arena_bt* arena);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef CODECACHE
+#define CODECACHE
+
+#include "./BinaryTranslator.h"
+
+// Machine code of functions kept between runs in --cache directory, see codeCache.cpp
+void loadCachedFunctions (BinaryTranslator* binTranslator);
+void linkCachedCalls (BinaryTranslator* binTranslator, Func_bt* function);
+void storeCachedFunction (BinaryTranslator* binTranslator, const Func_bt* function);
+
+#endif
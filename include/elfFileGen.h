@@ -4,6 +4,7 @@
 #pragma once
 #include "BinaryTranslator.h"
 
-void makeElfFile (char* fileName, BinaryTranslator* binTranslator);
+void makeElfFile (const char* fileName, BinaryTranslator* binTranslator);
+unsigned char* loadRuntime (size_t* runtimeSize);
 
 #endif
@@ -0,0 +1,8 @@
+#ifndef IROPT
+#define IROPT
+
+#include "./BinaryTranslator.h"
+
+void optimizeIR (BinaryTranslator* binTranslator);
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef IRUTILS
+#define IRUTILS
+
+#include "./BinaryTranslator.h"
+
+static const size_t NoVar   = (size_t) -1;
+static const size_t NoBlock = (size_t) -1;
+
+// Operands
+//----------------------------------------
+static const Op_bt NoOp = {};
+
+static inline bool hasOp (Op_bt op)
+{
+    return op.type != Unknown;
+}
+
+static inline Op_bt numOp (int num)
+{
+    Op_bt op = {Num_t, {}};
+    op.value.num = num;
+    return op;
+}
+
+static inline Op_bt varOp (size_t index)
+{
+    Op_bt op = {Var_t, {}};
+    op.value.var = (uint32_t) index;
+    return op;
+}
+
+static inline Op_bt blockOp (size_t index)
+{
+    Op_bt op = {Pointer_t, {}};
+    op.value.block = (uint32_t) index;
+    return op;
+}
+
+static inline Op_bt funcOp (size_t index)
+{
+    Op_bt op = {Func_t, {}};
+    op.value.func = (uint32_t) index;
+    return op;
+}
+
+static inline Var_bt* opVar (const Func_bt* function, Op_bt op)
+{
+    return &function->varArray[op.value.var];
+}
+
+static inline Block_bt* opBlock (const Func_bt* function, Op_bt op)
+{
+    return &function->blockArray[op.value.block];
+}
+
+static inline Cmd_bt* blockCmds (const Func_bt* function, const Block_bt* block)
+{
+    return function->cmdArray + block->cmdStart;
+}
+//----------------------------------------
+
+struct Liveness_ir
+{
+    size_t numOfBlocks;
+    size_t numOfVars;
+    size_t* blockStart;
+    size_t* blockEnd;
+    size_t* blockLength;    // commands up to the first terminator
+    bool*  use;
+    bool*  def;
+    bool*  liveIn;
+    bool*  liveOut;
+};
+
+// Blocks that can't be reached from block 0 have no idom and are not in order
+struct Dominators_ir
+{
+    size_t numOfBlocks;
+    size_t* idom;           // block 0 is its own idom
+    size_t* order;          // reachable blocks in reverse postorder
+    size_t  numOfOrdered;
+    size_t* predStart;      // predecessors of b are preds[predStart[b], predStart[b + 1])
+    size_t* preds;
+};
+
+size_t opVarIndex (Op_bt op);
+void   cmdUsesAndDef (const Cmd_bt* cmd, size_t uses[2], size_t* def);
+size_t blockIndex (Op_bt op);
+size_t blockLength (const Func_bt* function, const Block_bt* block);
+size_t blockSuccessors (const Func_bt* function, size_t index, size_t length, size_t succ[2]);
+size_t numOfParams (const Func_bt* function);
+void   packCmds (Func_bt* function);
+
+void dominatorsCtor (Dominators_ir* dom, const Func_bt* function);
+void dominatorsDtor (Dominators_ir* dom);
+bool dominates (const Dominators_ir* dom, size_t first, size_t second);
+
+void livenessCtor (Liveness_ir* live, const Func_bt* function);
+void livenessDtor (Liveness_ir* live);
+void computeLiveness (Liveness_ir* live, const Func_bt* function);
+
+#endif
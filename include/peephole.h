@@ -0,0 +1,9 @@
+#ifndef PEEPHOLE
+#define PEEPHOLE
+
+#include "./BinaryTranslator.h"
+
+void peepholeBlock (CodeBuf_bt* buf, size_t blockStart);
+void dumpPeepholeStats (FILE* fileptr, const CodeBuf_bt* buf);
+
+#endif
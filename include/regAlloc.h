@@ -0,0 +1,9 @@
+#ifndef REGALLOC
+#define REGALLOC
+
+#include "./BinaryTranslator.h"
+
+void allocateRegisters (BinaryTranslator* binTranslator);
+size_t regSaveOffset (const Func_bt* function, REG_NUM reg);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef SYMTABLE
+#define SYMTABLE
+
+#include <cstddef>
+#include <pthread.h>
+
+#include "./arena.h"
+
+// Interned names and hash maps keyed by them, see symTable.cpp
+
+typedef size_t Sym_bt;
+
+static const Sym_bt NoSym    = (Sym_bt) -1;
+static const size_t NotFound = (size_t) -1;
+
+// Every distinct name is stored once, equal names get equal Sym_bt.
+// Functions are parsed in parallel, so the table is locked
+struct SymTable_bt
+{
+    pthread_mutex_t lock;
+    Arena_bt* arena;        // names are copied here
+    char**  names;          // by Sym_bt
+    size_t  namesSize;
+    size_t  namesCapacity;
+    Sym_bt* slots;          // open addressing over names, NoSym is empty
+    size_t  slotsCapacity;
+};
+
+// Sym_bt to index in some array
+struct SymMap_bt
+{
+    Sym_bt* keys;           // NoSym is empty
+    size_t* values;
+    size_t  size;
+    size_t  capacity;
+};
+
+void   symTableCtor (SymTable_bt* table, Arena_bt* arena);
+Sym_bt internName (SymTable_bt* table, const char* name);
+const char* symName (SymTable_bt* table, Sym_bt sym);
+void symTableDtor (SymTable_bt* table);
+
+void   symMapAdd  (SymMap_bt* map, Sym_bt key, size_t value);
+size_t symMapFind (const SymMap_bt* map, Sym_bt key);
+void   symMapDtor (SymMap_bt* map);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef THREADPOOL
+#define THREADPOOL
+
+#include <cstddef>
+#include <pthread.h>
+
+// Runs a batch of independent jobs on all threads, see threadPool.cpp
+
+typedef void (*Job_bt) (void* arg, size_t index);
+
+// Indices of jobs, owner takes them from the tail and others steal from the head
+struct TaskQueue_bt
+{
+    pthread_mutex_t lock;
+    size_t* tasks;
+    size_t  head;
+    size_t  tail;
+    size_t  capacity;
+};
+
+struct Worker_bt
+{
+    struct ThreadPool_bt* pool;
+    size_t    index;
+    pthread_t thread;       // not used by worker 0, it is the calling thread
+    TaskQueue_bt queue;
+};
+
+struct ThreadPool_bt
+{
+    Worker_bt* workers;
+    size_t     numOfWorkers;
+    pthread_mutex_t lock;   // guards the batch below
+    pthread_cond_t  start;
+    pthread_cond_t  done;
+    Job_bt job;
+    void*  arg;
+    size_t batch;           // number of the current batch, workers wait for the next one
+    size_t numOfBusy;       // threads that are still in the batch
+    bool   stop;
+};
+
+// 0 threads means one per online CPU
+void threadPoolCtor (ThreadPool_bt* pool, size_t numOfThreads);
+void threadPoolRun  (ThreadPool_bt* pool, Job_bt job, void* arg, size_t numOfJobs);
+void threadPoolDtor (ThreadPool_bt* pool);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef TIMEREPORT
+#define TIMEREPORT
+
+#include <cstddef>
+#include <stdio.h>
+#include <time.h>
+
+// What phases of one run took, for --time-report, see timeReport.cpp
+
+struct BinaryTranslator;
+
+struct Phase_bt
+{
+    const char* name;
+    double seconds;         // wall time
+    size_t numOfAllocs;     // in arenas of IR
+    size_t bytesAllocated;
+    size_t outBytes;        // code or file the phase made
+};
+
+struct TimeReport_bt
+{
+    bool      enabled;
+    Phase_bt* phases;
+    size_t    phasesSize;
+    size_t    phasesCapacity;
+    timespec  lapStart;     // end of the last phase
+    size_t    lapAllocs;    // arena counters at lapStart
+    size_t    lapBytes;
+};
+
+void timeReportCtor (BinaryTranslator* binTranslator, bool enabled);
+void timePhase      (BinaryTranslator* binTranslator, const char* name, size_t outBytes);
+void dumpTimeReport (FILE* fileptr, const TimeReport_bt* report);
+void timeReportDtor (TimeReport_bt* report);
+
+#endif
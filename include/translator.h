@@ -3,14 +3,15 @@
 
 #include "./BinaryTranslator.h"
 
-#define Dumpx86Buf(binTranslator, start, end) \
+#define Dumpx86Buf(buf, start, end) \
     printf ("Called from %s\n", __PRETTY_FUNCTION__);\
-    dumpx86Buf(binTranslator, start, end);
+    dumpx86Buf(buf, start, end);
 
-#define SimpleCMD(name) writeCmdIntoArray( binTranslator, {.code = name, .size = SIZE_##name});
+#define SimpleCMD(name) writeCmdIntoArray( buf, {.code = name, .size = SIZE_##name});
 
 #define BYTE(offset) offset * 8
 
-void dumpx86Buf (BinaryTranslator* binTranslator, size_t start, size_t end);
+void dumpx86Buf (CodeBuf_bt* buf, size_t start, size_t end);
+void translateDivByNum (FILE* fileptr, CodeBuf_bt* buf, int number);
 
 #endif
@@ -0,0 +1,14 @@
+#ifndef TREETEXT
+#define TREETEXT
+
+#include <stdio.h>
+
+// Tree in brackets, one node per pair, see treeText.cpp. Trees of bench/corpus
+// are written this way, everything else comes from the frontend of the language
+
+struct Node;
+
+bool  isTreeText   (FILE* fileptr);
+Node* readTreeText (const char* fileName);
+
+#endif
@@ -1,49 +1,234 @@
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+
 #include "./include/BinaryTranslator.h"
 #include "./include/translator.h"
 #include "language/common.h"
 #include "./include/elfFileGen.h"
+#include "./include/regAlloc.h"
+#include "./include/peephole.h"
+#include "./include/irOpt.h"
+#include "./include/threadPool.h"
+#include "./include/codeCache.h"
+#include "./include/timeReport.h"
 
 Configuration Config =
 {
-    .sizeOfScanf  = 174 + 16,
-    .sizeOfPrintf   = 127 + 5*2,
+    .sizeOfScanf  = 134,
+    .sizeOfPrintf   = 175,
 };
 
 static void translateIRtoBin (BinaryTranslator* binTranslator)
 {
-    firstIteration (binTranslator);
-    dumpIRToAsm("asm.txt", binTranslator);
-    binTranslator->BT_ip = 0;
+    if (binTranslator->cacheDir)
+        loadCachedFunctions (binTranslator);
 
-    dumpBTtable(binTranslator->nameTable);
+    optimizeIR (binTranslator);
+    allocateRegisters (binTranslator);
 
     dumpIRToAsm ("asm.txt", binTranslator);
+
+    if (binTranslator->verbose)
+    {
+        dumpPeepholeStats (stderr, &binTranslator->code);
+        dumpArenaStats (stderr, "names arena", &binTranslator->arena);
+
+        Arena_bt funcArenas = {};
+        for (size_t i = 0; i < binTranslator->funcArraySize; i++)
+            arenaAddStats (&funcArenas, &binTranslator->funcArray[i].ctx.arena);
+
+        dumpArenaStats (stderr, "IR arenas of functions", &funcArenas);
+    }
+}
+
+struct DumpName
+{
+    const char* name;
+    unsigned    flags;
+};
+
+static const DumpName DumpNames[] =
+{
+    {"tree", DUMP_TREE},
+    {"ir",   DUMP_IR},
+    {"asm",  DUMP_ASM},
+    {"code", DUMP_CODE},
+    {"all",  DUMP_TREE | DUMP_IR | DUMP_ASM | DUMP_CODE},
+};
+
+// Comma separated names of DumpNames, 0 if one of them is unknown
+static unsigned parseDumps (const char* list)
+{
+    unsigned dumps = 0;
+
+    while (*list != '\0')
+    {
+        size_t   length = strcspn (list, ",");
+        unsigned flags  = 0;
+
+        for (size_t i = 0; i < sizeof (DumpNames) / sizeof (*DumpNames); i++)
+        {
+            if (strlen (DumpNames[i].name) == length && strncmp (list, DumpNames[i].name, length) == 0)
+                flags = DumpNames[i].flags;
+        }
+
+        if (flags == 0)
+            return 0;
+
+        dumps |= flags;
+        list  += length;
+        if (*list == ',')
+            list += 1;
+    }
+
+    return dumps;
+}
+
+static void printHelp (FILE* fileptr)
+{
+    fprintf (fileptr, "Programm usage: ./<programm name> [options] <fileWithTree> <outFileName>\n");
+    fprintf (fileptr, "                ./<programm name> [options] --run <fileWithTree>    runs program in process, without ELF file\n");
+    fprintf (fileptr, "                options go in any order, before or after file names:\n");
+    fprintf (fileptr, "                -v prints IR memory usage, peephole hits and functions reused from --cache to stderr\n");
+    fprintf (fileptr, "                --time-report prints time, IR allocations and output bytes of every phase to stderr\n");
+    fprintf (fileptr, "                --dump <list> writes diagnostics, list is comma separated: tree, ir (Dump.txt), asm (DebugAsm.s), code (asm.txt and hex to stdout) or all\n");
+    fprintf (fileptr, "                --stack-size <MiB> sets machine stack of program, %d MiB by default\n", DEFAULT_STACK_SIZE >> 20);
+    fprintf (fileptr, "                --jobs <N> sets number of threads functions are compiled on, one per CPU by default\n");
+    fprintf (fileptr, "                --cache <dir> keeps code of functions in dir and reuses it for functions that did not change\n");
+    fprintf (fileptr, "                -h, --help prints this text\n");
 }
 
-static void printHelp ()
+struct Options
 {
-    printf ("Programm usage: ./<programm name> <fileWithTree> <outFileName>\n");
+    bool        help;
+    bool        verbose;
+    bool        timeReport;
+    bool        runInProcess;
+    unsigned    dumps;
+    size_t      stackSize;
+    size_t      numOfJobs;      // 0 is one thread per CPU
+    const char* cacheDir;
+    const char* files[2];       // tree and ELF file, only tree with --run
+    size_t      numOfFiles;
+};
+
+// Positive decimal number, nothing after it
+static bool parseCount (const char* str, size_t* count)
+{
+    char*  end    = NULL;
+    size_t number = strtoul (str, &end, 10);
+
+    if (str[0] < '0' || str[0] > '9' || *end != '\0' || number == 0)
+        return false;
+
+    *count = number;
+    return true;
+}
+
+// Returns false on usage error
+static bool parseOptions (int argc, char* argv[], Options* options)
+{
+    *options = {};
+    options->stackSize = DEFAULT_STACK_SIZE;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+
+        if (strcmp (arg, "-h") == 0 || strcmp (arg, "--help") == 0)
+            options->help = true;
+        else if (strcmp (arg, "-v") == 0)
+            options->verbose = true;
+        else if (strcmp (arg, "--time-report") == 0)
+            options->timeReport = true;
+        else if (strcmp (arg, "--run") == 0)
+            options->runInProcess = true;
+        else if (arg[0] != '-')
+        {
+            if (options->numOfFiles == sizeof (options->files) / sizeof (*options->files))
+                return false;
+
+            options->files[options->numOfFiles++] = arg;
+        }
+        // The rest have a value
+        else if (i + 1 == argc)
+            return false;
+        else
+        {
+            const char* value = argv[++i];
+
+            if (strcmp (arg, "--dump") == 0)
+            {
+                options->dumps = parseDumps (value);
+                if (options->dumps == 0)
+                    return false;
+            }
+            else if (strcmp (arg, "--stack-size") == 0)
+            {
+                size_t mebibytes = 0;
+                if (!parseCount (value, &mebibytes) || mebibytes > (SIZE_MAX >> 20))
+                    return false;
+
+                options->stackSize = mebibytes << 20;
+            }
+            else if (strcmp (arg, "--jobs") == 0)
+            {
+                if (!parseCount (value, &options->numOfJobs))
+                    return false;
+            }
+            else if (strcmp (arg, "--cache") == 0)
+                options->cacheDir = value;
+            else
+                return false;
+        }
+    }
+
+    return options->help || options->numOfFiles == (options->runInProcess ? 1u : 2u);
 }
 
 int main (int argc, char* argv[])
 {
-    if (argc != 3)
+    Options options = {};
+    if (!parseOptions (argc, argv, &options))
     {
-        printHelp ();
+        printHelp (stderr);
+        return 1;
     }
-    else
+
+    if (options.help)
     {
+        printHelp (stdout);
+        return 0;
+    }
+
     BinaryTranslator binTranslator = {};
+    binTranslator.verbose   = options.verbose;
+    binTranslator.stackSize = options.stackSize;
+    binTranslator.cacheDir  = options.cacheDir;
+    binTranslator.dumps     = options.dumps;
+    threadPoolCtor (&binTranslator.pool, options.numOfJobs);
+    timeReportCtor (&binTranslator, options.timeReport);
 
-    parseTreeToIR(argv[1], &binTranslator);
+    parseTreeToIR(options.files[0], &binTranslator);
 
     translateIRtoBin(&binTranslator);
 
-    makeElfFile(argv[2], &binTranslator);
+    if (options.runInProcess)
+    {
+        startProg(&binTranslator);
+        timePhase (&binTranslator, "run", 0);
+    }
+    else
+        makeElfFile(options.files[1], &binTranslator);
+
+    if (options.timeReport)
+        dumpTimeReport (stderr, &binTranslator.timeReport);
 
+    timeReportDtor (&binTranslator.timeReport);
     IRdtor(&binTranslator);
+    threadPoolDtor(&binTranslator.pool);
     binTranslatorDtor(&binTranslator);
-    }
 
     return 0;
 }
@@ -1,6 +1,7 @@
 #pragma GCC diagnostic ignored "-Wswitch-enum"
 
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cassert>
 #include <cstdlib>
@@ -8,46 +9,59 @@
 #include <sys/mman.h>
 
 #include "../include/BinaryTranslator.h"
+#include "../include/symTable.h"
 #include "../language/common.h"
 #include "../language/readerLib/functions.h"
 #include "../include/translator.h"
+#include "../include/elfFileGen.h"
+#include "../include/irUtils.h"
+#include "../include/treeText.h"
 
 extern const char* FullOpArray[];
 
 static void parseStToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* function);
-static Op_bt* parseCallToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* function);
+static Op_bt parseCallToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* function);
 void NodeDtor(Node* node);
 
-static size_t NumberOfTempVars = 0;
+static const size_t StartCmdCapacity = 64;
+
+// Longest name of IF and WHILE blocks, MERGE and WHILE with any int
+static const size_t BlockNameSize = sizeof ("MERGE-2147483648");
 
 
 void binTranslatorDtor (BinaryTranslator* binTranslator)
 {
     NodeDtor(binTranslator->tree);
-    free (binTranslator->x86_array);
-    free (binTranslator->funcArray);
+    free (binTranslator->code.x86_array);
     free (binTranslator->globalVars);
-    free (binTranslator->nameTable.data);
+    free (binTranslator->code.fixups);
+    symMapDtor (&binTranslator->funcMap);
+    symTableDtor (&binTranslator->symbols);
 }
 // DUMPS
 //----------------------------------------
 
-static void printOperand (FILE* fileptr, const Op_bt* op)
+static void printOperand (FILE* fileptr, const BinaryTranslator* binTranslator, const Func_bt* function, Op_bt op)
 {
-    assert (op != NULL);
-
-    switch (op->type)
+    switch (op.type)
     {
         case Num_t:
-            fprintf(fileptr, "%-10d", op->value.num);
+            fprintf(fileptr, "%-10d", op.value.num);
             break;
 
         case Var_t:
-            fprintf(fileptr, "%-10s", op->value.var->name);
+            if (opVar (function, op)->name)
+                fprintf(fileptr, "%-10s", opVar (function, op)->name);
+            else
+                fprintf(fileptr, "temp%-6u", op.value.var);
             break;
 
         case Pointer_t:
-            fprintf(fileptr, "%-10s", op->value.block->name);
+            fprintf(fileptr, "%-10s", opBlock (function, op)->name);
+            break;
+
+        case Func_t:
+            fprintf(fileptr, "%-10s", binTranslator->funcArray[op.value.func].name);
             break;
 
         default:
@@ -55,34 +69,34 @@ static void printOperand (FILE* fileptr, const Op_bt* op)
     }
 }
 
-static void dumpIRBlock (FILE* fileptr, const Block_bt block)
+static void dumpIRBlock (FILE* fileptr, const BinaryTranslator* binTranslator, const Func_bt* function, const Block_bt block)
 {
-    fprintf(stderr, "%s\n", __PRETTY_FUNCTION__);
+    const Cmd_bt* cmds = blockCmds (function, &block);
 
-    fprintf (fileptr, "cmdArrayCapacity = %lu, cmdArraySize = %lu\n", block.cmdArrayCapacity, block.cmdArraySize);
+    fprintf (fileptr, "cmdStart = %lu, cmdArraySize = %lu\n", block.cmdStart, block.cmdArraySize);
     fprintf (fileptr, "%12s: CMD        op1        op2        dest\n\t{\n", block.name);
     for (size_t i = 0; i < block.cmdArraySize; i++)
     {
-        fprintf (fileptr, "\t\t\t\t  %-10s ", FullOpArray[block.cmdArray[i].opCode.operation]);
+        fprintf (fileptr, "\t\t\t\t  %-10s ", FullOpArray[cmds[i].opCode.operation]);
 
-        if (block.cmdArray[i].operator1)
+        if (hasOp (cmds[i].operator1))
         {
-            printOperand(fileptr, block.cmdArray[i].operator1);
+            printOperand(fileptr, binTranslator, function, cmds[i].operator1);
             fprintf (fileptr, " ");
         }
         else
             fprintf(fileptr, "%11c", ' ');
 
-        if (block.cmdArray[i].operator2)
+        if (hasOp (cmds[i].operator2))
         {
-            printOperand(fileptr, block.cmdArray[i].operator2);
+            printOperand(fileptr, binTranslator, function, cmds[i].operator2);
             fprintf (fileptr, " ");
         }
         else
             fprintf(fileptr, "%11c", ' ');
-        if (block.cmdArray[i].dest)
+        if (hasOp (cmds[i].dest))
         {
-            printOperand(fileptr, block.cmdArray[i].dest);
+            printOperand(fileptr, binTranslator, function, cmds[i].dest);
             fprintf (fileptr, " ");
         }
         else
@@ -93,7 +107,7 @@ static void dumpIRBlock (FILE* fileptr, const Block_bt block)
     fprintf(fileptr, "\t}\n\n");
 }
 
-static void dumpIRFuncion (FILE* fileptr, const Func_bt function)
+static void dumpIRFuncion (FILE* fileptr, const BinaryTranslator* binTranslator, const Func_bt function)
 {
     assert (fileptr != NULL);
     assert (function.blockArray != NULL);
@@ -102,10 +116,14 @@ static void dumpIRFuncion (FILE* fileptr, const Func_bt function)
 
     fprintf (fileptr, "%s\n", function.name);
 
+    fprintf (fileptr, "varArraySize = %lu, varArrayCapacity = %lu\n", function.varArraySize, function.varArrayCapacity);
     fprintf (fileptr, "Variables:\n{\n");
-    for (size_t i = 0; function.varArray[i].name != NULL; i++)
+    for (size_t i = 0; i < function.varArraySize; i++)
     {
-        fprintf(fileptr, "\t%s\n", function.varArray[i].name);
+        if (function.varArray[i].name)
+            fprintf(fileptr, "\t%s\n", function.varArray[i].name);
+        else
+            fprintf(fileptr, "\ttemp%lu\n", i);
     }
     fprintf (fileptr, "}\n");
 
@@ -114,7 +132,7 @@ static void dumpIRFuncion (FILE* fileptr, const Func_bt function)
     for (size_t i = 0; i < function.blockArraySize; i++)
     {
         fprintf (fileptr, "\t");
-        dumpIRBlock(fileptr, function.blockArray[i]);
+        dumpIRBlock(fileptr, binTranslator, &function, function.blockArray[i]);
     }
     fprintf(fileptr, "}\n\n");
 }
@@ -127,8 +145,6 @@ void dumpIR (const char* fileName, const BinaryTranslator* binTranslator)
     FILE* fileptr = fopen (fileName, "w");
     assert (fileptr != NULL);
 
-    setvbuf(fileptr, NULL, _IONBF, 0);
-
     if (binTranslator->globalVars != NULL)
     {
         fprintf (fileptr, "Variables:\n");
@@ -143,132 +159,149 @@ void dumpIR (const char* fileName, const BinaryTranslator* binTranslator)
     for (size_t i = 0; i < binTranslator->funcArraySize; i++)
     {
         fprintf (fileptr, "--------------------------------------------------------------------------------\n");
-        dumpIRFuncion(fileptr, binTranslator->funcArray[i]);
+        dumpIRFuncion(fileptr, binTranslator, binTranslator->funcArray[i]);
         fprintf (fileptr, "--------------------------------------------------------------------------------\n");
     }
+
+    fclose (fileptr);
 }
 //----------------------------------------
 
 // Counters
 //----------------------------------------
-static size_t countNumberOfBlocks (Node* node, size_t numOfBlocks)
+// Sizes of every function, IF body and WHILE parts are collected by one bottom-up
+// pass before parsing, so nested statements are not recounted for each level.
+// Stats are kept only for nodes the parser asks about, keyed by Node pointer
+static void recordTreeStats (BinaryTranslator* binTranslator, Node* node, TreeStats_bt stats)
 {
-    assert (node != NULL);
-
-    if (node->type == Key_t)
+    if (binTranslator->treeStatsSize >= binTranslator->treeStatsCapacity)
     {
-        if (strcmp ("IF", node->Name) == 0)
-            numOfBlocks += 2;
-        if (strcmp("ELSE", node->Name) == 0)
-            numOfBlocks += 1;
+        size_t oldCapacity = binTranslator->treeStatsCapacity;
+        binTranslator->treeStatsCapacity = oldCapacity ? oldCapacity * 2 : 64;
+        binTranslator->treeStats = (TreeStats_bt*) arenaRealloc (&binTranslator->arena, binTranslator->treeStats,
+                                                                 oldCapacity * sizeof (TreeStats_bt),
+                                                                 binTranslator->treeStatsCapacity * sizeof (TreeStats_bt));
     }
 
-    if (node->left)
-        numOfBlocks += countNumberOfBlocks(node->left, 0);
-
-    if (node->right)
-        numOfBlocks += countNumberOfBlocks(node->right, 0);
-
-    return numOfBlocks;
-};
+    symMapAdd (&binTranslator->treeStatsMap, (Sym_bt) node, binTranslator->treeStatsSize);
+    binTranslator->treeStats[binTranslator->treeStatsSize++] = stats;
+}
 
-static size_t countNumberOfCmdInFunc (Node* node, size_t numOfCmd)
+static TreeStats_bt collectTreeStats (BinaryTranslator* binTranslator, Node* node)
 {
     assert (node != NULL);
 
+    TreeStats_bt stats = {};
+
     if (node->type == OP_t)
-        numOfCmd += 1;
+    {
+        stats.numOfCmd  += 1;
+        stats.numOfVars += 1;
+    }
 
     if (node->type == Key_t)
-        numOfCmd += 1;
-
-    if (node->left)
-        numOfCmd += countNumberOfCmdInFunc(node->left, 0);
-
-    if (node->right)
-        numOfCmd += countNumberOfCmdInFunc(node->right, 0);
+    {
+        stats.numOfCmd  += 1;
+        stats.numOfVars += 1;
 
-    return numOfCmd;
-}
+        if (strcmp ("IF", node->Name) == 0)
+            stats.numOfBlocks += 2;
+        if (strcmp ("ELSE", node->Name) == 0)
+            stats.numOfBlocks += 1;
+        if (strcmp ("WHILE", node->Name) == 0)
+            stats.numOfBlocks += 3;
+    }
 
-static size_t countNumberOfVarsInFunc (Node* node, size_t numOfVars)
-{
-    assert (node != NULL);
+    if (node->type == Var_t)
+        stats.numOfVars += 1;
 
-    if (node->type == Key_t)
-        numOfVars += 1;
+    if (node->type == Func_t && strcmp ("FUNC", node->Name) == 0)
+        stats.numOfFunc += 1;
 
-    if (node->type == OP_t)
-        numOfVars += 1;
+    Node* children[2] = {node->left, node->right};
+    for (int i = 0; i < 2; i++)
+    {
+        if (!children[i])
+            continue;
+
+        TreeStats_bt child = collectTreeStats (binTranslator, children[i]);
+        stats.numOfCmd    += child.numOfCmd;
+        stats.numOfVars   += child.numOfVars;
+        stats.numOfBlocks += child.numOfBlocks;
+        stats.numOfFunc   += child.numOfFunc;
+
+        if (i == 1 && node->type == Key_t && strcmp ("IF", node->Name) == 0)
+            recordTreeStats (binTranslator, children[i], child);
+        if (node->type == Key_t && strcmp ("WHILE", node->Name) == 0)
+            recordTreeStats (binTranslator, children[i], child);
+    }
 
-    if (node->type == Var_t)
-        numOfVars += 1;
+    if (node->type == Func_t && strcmp ("FUNC", node->Name) == 0)
+        recordTreeStats (binTranslator, node, stats);
 
-    if (node->left)
-        numOfVars += countNumberOfVarsInFunc(node->left, 0);
+    return stats;
+}
 
-    if (node->right)
-        numOfVars += countNumberOfVarsInFunc(node->right, 0);
+static TreeStats_bt treeStats (BinaryTranslator* binTranslator, Node* node)
+{
+    size_t index = symMapFind (&binTranslator->treeStatsMap, (Sym_bt) node);
+    assert (index != NotFound && "stats of node were not collected");
 
-    return numOfVars;
+    return binTranslator->treeStats[index];
 }
+//----------------------------------------
 
-static size_t countNumberOfFunc (Node* node, size_t numOfFunc)
+// Work with var
+//----------------------------------------
+static const char* internedName (BinaryTranslator* binTranslator, const char* name)
 {
-    assert (node != NULL);
+    return symName (&binTranslator->symbols, internName (&binTranslator->symbols, name));
+}
 
-    if (node->type == Func_t)
-        numOfFunc+= 1;
+static Var_bt* addVar (Func_bt* function, const char* name, Location location)
+{
+    assert (function != NULL);
+    assert (function->varArraySize + 1 < function->varArrayCapacity);
 
-    if (node->left)
-        numOfFunc += countNumberOfCmdInFunc(node->left, numOfFunc);
+    Var_bt* var = &function->varArray[function->varArraySize];
 
-    if (node->right)
-        numOfFunc += countNumberOfCmdInFunc(node->right, numOfFunc);
+    var->name     = name;
+    var->location = location;
+    var->offset   = (int) (function->varArraySize - function->numberOfTempVar + 1) * 8;
+    function->varArraySize += 1;
 
-    return numOfFunc;
+    function->varArray[function->varArraySize] = {};
+    return var;
 }
-//----------------------------------------
 
-// Work with var
-//----------------------------------------
-static Var_bt* addVar (Var_bt* varArray, size_t* varArraySize, char* name, Location location)
+static Var_bt* addNamedVar (BinaryTranslator* binTranslator, Func_bt* function, const char* name)
 {
-    assert (varArray != NULL);
-    assert (name     != NULL);
-
-    int i = 0;
-    for (; varArray[i].name != NULL; i++) {};
+    assert (name != NULL);
 
-    varArray[i].name = name;
-    varArray[i].location = location;
-    varArray[i].offset = (*varArraySize - NumberOfTempVars + 1) * 8 ;
-    *varArraySize += 1;
+    Sym_bt sym = internName (&binTranslator->symbols, name);
+    symMapAdd (&function->varMap, sym, function->varArraySize);
 
-    varArray[i + 1] = {};
-    return &varArray[i];
+    return addVar (function, symName (&binTranslator->symbols, sym), Memory);
 }
 
-static Var_bt* findVar (Var_bt* varArray, char* name)
+static Var_bt* findVar (BinaryTranslator* binTranslator, Func_bt* function, const char* name)
 {
-    assert (name != nullptr);
-    assert (varArray != nullptr);
+    assert (name     != nullptr);
+    assert (function != nullptr);
 
-    for (int i = 0; varArray[i].name != NULL; i++)
-    {
-        if (strcmp (varArray[i].name, name) == 0)
-            return &varArray[i];
-    }
-    return NULL;
+    size_t index = symMapFind (&function->varMap, internName (&binTranslator->symbols, name));
+    if (index == NotFound)
+        return NULL;
+
+    return &function->varArray[index];
 }
 
-static Var_bt* addTempVar (Var_bt* varArray, size_t* varArraySize, Location location)
+// Temps have no names, dumps call them by index
+static Var_bt* addTempVar (Func_bt* function, Location location)
 {
-    char* tempVarName = (char*) calloc (15, sizeof (char));
-    sprintf(tempVarName, "temp%lu", NumberOfTempVars);
-    NumberOfTempVars += 1;
+    function->numberOfTempVar += 1;
 
-    return addVar(varArray, varArraySize, tempVarName, location);
+    return addVar (function, NULL, location);
 };
 
 static Var_bt* parseVarToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* function)
@@ -277,108 +310,120 @@ static Var_bt* parseVarToIR (Node* node, BinaryTranslator* binTranslator, Func_b
     assert (binTranslator != NULL);
     assert (function      != NULL);
 
-    Var_bt* var = findVar(function->varArray, node->var.varName);
+    Var_bt* var = findVar (binTranslator, function, node->var.varName);
 
     if (var == NULL)
-        return addVar(function->varArray, &(function->varArraySize), node->var.varName, Memory);
+        return addNamedVar (binTranslator, function, node->var.varName);
 
     return var;
 }
 //----------------------------------------
 
 //----------------------------------------
-static Op_bt* createOpBt (Type type, Value_bt value)
+static inline Op_bt varToOp (const Func_bt* function, const Var_bt* var)
 {
-    Op_bt* opPointer = (Op_bt*) calloc (1, sizeof (*opPointer));
+    assert (var != NULL);
 
-    opPointer->type = type;
-    opPointer->value = value;
+    return varOp ((size_t) (var - function->varArray));
+}
 
-    return opPointer;
+static inline Op_bt blockToOp (const Func_bt* function, const Block_bt* block)
+{
+    return blockOp ((size_t) (block - function->blockArray));
 }
-#define NumOP(num) createOpBt (Num_t, num)
 
-static Cmd_bt* addCmd (Block_bt* block, OpCode_bt opCode, Op_bt* op1, Op_bt* op2, Op_bt* dest)
+static void reserveCmds (Func_bt* function, size_t numOfCmd)
 {
-    assert (block->cmdArray != NULL);
-    assert (block->cmdArrayCapacity != 0);
+    size_t capacity = function->cmdArrayCapacity ? function->cmdArrayCapacity : StartCmdCapacity;
+    while (function->cmdArraySize + numOfCmd > capacity)
+        capacity *= 2;
+
+    if (capacity == function->cmdArrayCapacity)
+        return;
+
+    function->cmdArray = (Cmd_bt*) arenaRealloc (&function->ctx.arena, function->cmdArray, function->cmdArrayCapacity * sizeof (Cmd_bt),
+                                                 capacity * sizeof (Cmd_bt));
+    function->cmdArrayCapacity = capacity;
+}
+
+// While function is parsed its blocks own ranges of cmdArray in the order they
+// were added and cmdArraySize is the end of the last range. Full block gets
+// twice more room and ranges of later blocks move. packCmds removes the spare room
+static void growBlock (Func_bt* function, Block_bt* block)
+{
+    size_t extra = block->cmdArrayCapacity ? block->cmdArrayCapacity : 1;
+    reserveCmds (function, extra);
+
+    size_t end = block->cmdStart + block->cmdArrayCapacity;
+    memmove (function->cmdArray + end + extra, function->cmdArray + end, (function->cmdArraySize - end) * sizeof (Cmd_bt));
+
+    for (size_t b = (size_t) (block - function->blockArray) + 1; b < function->blockArraySize; b++)
+        function->blockArray[b].cmdStart += extra;
+
+    block->cmdArrayCapacity += extra;
+    function->cmdArraySize  += extra;
+}
+
+static void addCmd (Func_bt* function, Block_bt* block, OpCode_bt opCode, Op_bt op1, Op_bt op2, Op_bt dest)
+{
+    assert (function != NULL);
+    assert (block    != NULL);
 
     if (block->cmdArraySize >= block->cmdArrayCapacity)
-    {
-        block->cmdArray = (Cmd_bt*) realloc(block->cmdArray, block->cmdArrayCapacity * 2 * sizeof (*block->cmdArray));
-        assert (block->cmdArray != NULL);
-        block->cmdArrayCapacity *= 2;
-    }
+        growBlock (function, block);
 
-    block->cmdArray[block->cmdArraySize] = {opCode, op1, op2, dest};
+    blockCmds (function, block)[block->cmdArraySize] = {opCode, op1, op2, dest, 0};
     block->cmdArraySize += 1;
-
-    return &(block->cmdArray[block->cmdArraySize - 1]);
 }
 
-static Block_bt* addBlock (Func_bt* function, size_t numOfCmd, char* name)
+static Block_bt* addBlock (Func_bt* function, size_t numOfCmd, const char* name)
 {
     assert (function != NULL);
     assert (name     != NULL);
 
-    if (function->blockArraySize >= function->blockArrayCapacity)
-    {
-        Block_bt* blockArray = (Block_bt*) calloc (function->blockArrayCapacity * 2, sizeof(*blockArray));
-        assert (blockArray != NULL);
-        function->varArrayCapacity *= 2;
-        function->blockArray = blockArray;
-    }
+    // Jumps keep indices of blocks, but parseIfToIR holds pointers. Capacity is counted from the tree
+    assert (function->blockArraySize < function->blockArrayCapacity);
 
-    Cmd_bt* cmdArray = (Cmd_bt*) calloc (numOfCmd, sizeof(*cmdArray));
-    assert (cmdArray != NULL);
+    reserveCmds (function, numOfCmd);
 
-    function->blockArray[function->blockArraySize] = {"\0", cmdArray, 0, numOfCmd};
-    strcpy (function->blockArray[function->blockArraySize].name, name);
+    function->blockArray[function->blockArraySize] = {name, function->cmdArraySize, 0, numOfCmd, 0};
     function->blockArraySize += 1;
+    function->cmdArraySize   += numOfCmd;
 
     return &function->blockArray[function->blockArraySize - 1];
 };
 
-static Block_bt* findFunctionBlock (BinaryTranslator* binTranslator, char* name)
+static size_t findFunction (BinaryTranslator* binTranslator, const char* name)
 {
     assert (binTranslator != NULL);
     assert (name          != NULL);
 
-    for (size_t i = 0; i < binTranslator->funcArraySize; i++)
-    {
-        if (strcmp (name, binTranslator->funcArray[i].name) == 0)
-        {
-            return binTranslator->funcArray[i].blockArray;
-        }
-    }
+    size_t index = symMapFind (&binTranslator->funcMap, internName (&binTranslator->symbols, name));
+    assert (index != NotFound && "call of undeclared function");
 
-    assert (0);
+    return index;
 }
 //----------------------------------------
 // Work with functions
 //----------------------------------------
 
-static Func_bt* initFunction (size_t numOfVars, size_t numOfBlocks)
+// Arena starts with room for arrays of the function and twice its commands,
+// since cmdArray grows by copying. Passes that add commands take new chunks
+static void initFunction (Func_bt* function, Node* node, size_t numOfVars, size_t numOfBlocks, size_t numOfCmd)
 {
-    Func_bt* function = (Func_bt*) calloc (1, sizeof (*function));
     assert (function != NULL);
 
-    Var_bt* varArray = (Var_bt*) calloc (numOfVars, sizeof (*varArray));
-    assert (varArray != NULL);
+    *function = {};
+    function->ctx.node = node;
+    arenaCtor (&function->ctx.arena, numOfVars * sizeof (Var_bt) + numOfBlocks * sizeof (Block_bt) + 2 * numOfCmd * sizeof (Cmd_bt));
 
-    Block_bt* blockArray = (Block_bt*) calloc (numOfBlocks, sizeof (*blockArray));
-    assert (blockArray != NULL);
+    Var_bt*   varArray   = (Var_bt*)   arenaAlloc (&function->ctx.arena, numOfVars   * sizeof (*varArray));
+    Block_bt* blockArray = (Block_bt*) arenaAlloc (&function->ctx.arena, numOfBlocks * sizeof (*blockArray));
 
     function->varArray           = varArray;
     function->blockArray         = blockArray;
-    function->blockArraySize     = 0;
-    function->varArraySize       = 0;
     function->varArrayCapacity   = numOfVars;
     function->blockArrayCapacity = numOfBlocks;
-    printf("%lu\n", numOfVars);
-    printf("%lu\n", numOfBlocks);
-
-    return function;
 }
 
 static void parseFuncParams (Node* node, BinaryTranslator* binTranslator, Func_bt* function)
@@ -389,8 +434,9 @@ static void parseFuncParams (Node* node, BinaryTranslator* binTranslator, Func_b
 
     if (node->type == Key_t && strcmp (node->Name, "PARAM") == 0)
     {
-        Var_bt* var = addVar (function->varArray, &(function->varArraySize), node->left->left->var.varName, Memory);
-        addCmd (&function->blockArray[0], {.operation = OP_PAROUT}, NULL, NULL, createOpBt(Var_t, {.var = var}));
+        Var_bt* var = addNamedVar (binTranslator, function, node->left->left->var.varName);
+        addCmd (function, &function->blockArray[0], {.operation = OP_PAROUT}, NoOp, NoOp, varToOp (function, var));
+        function->numberOfParams += 1;
     }
 
     if (node->right)
@@ -408,8 +454,8 @@ static void parseFuncHead (Node* node, BinaryTranslator* binTranslator, Func_bt*
 
     if (node->type == Func_t)
     {
-         strcpy (function->name, leftNode->Name);
-         addBlock(function, countNumberOfCmdInFunc(node, 0), function->name);
+         function->name = internedName (binTranslator, leftNode->Name);
+         addBlock (function, treeStats (binTranslator, node).numOfCmd, function->name);
     }
 
     if (leftNode->left)
@@ -418,43 +464,56 @@ static void parseFuncHead (Node* node, BinaryTranslator* binTranslator, Func_bt*
     }
 }
 
-static void parseFuncToIR (Node* node, BinaryTranslator* binTranslator)
+// All functions are declared before any body is parsed, so a call may come
+// before the callee
+static void declareFunc (Node* node, BinaryTranslator* binTranslator)
 {
     assert (node != NULL);
     assert (binTranslator != NULL);
 
-    Func_bt* function = initFunction(countNumberOfVarsInFunc(node, 0) + 1, countNumberOfBlocks(node, 0) + 1); // +1 for NULL element
-    NumberOfTempVars = 0;
-
-    if (node->left)
-    {
-        parseFuncHead (node, binTranslator, function);
-        binTranslator->funcArray[binTranslator->funcArraySize] = *function;
-        binTranslator->funcArraySize += 1;
-    }
-    else
+    if (!node->left)
         assert (0);
 
+    Func_bt* function = &binTranslator->funcArray[binTranslator->funcArraySize];
+    TreeStats_bt stats = treeStats (binTranslator, node);
+    initFunction(function, node, stats.numOfVars + 1, stats.numOfBlocks + 1, stats.numOfCmd); // +1 for NULL element
+
+    parseFuncHead (node, binTranslator, function);
+
+    Sym_bt name = internName (&binTranslator->symbols, function->name);
+    assert (symMapFind (&binTranslator->funcMap, name) == NotFound && "function is defined twice");
+    symMapAdd (&binTranslator->funcMap, name, binTranslator->funcArraySize);
+
+    binTranslator->funcArraySize += 1;
+}
+
+// Job of the pool, functions only read each other's heads here
+static void parseFuncToIR (void* arg, size_t index)
+{
+    BinaryTranslator* binTranslator = (BinaryTranslator*) arg;
+    Func_bt*          function      = &binTranslator->funcArray[index];
+    Node*             node          = function->ctx.node;
+
+    assert (node != NULL);
+
     if (node->right)
         parseStToIR   (node->right, binTranslator, function);
     else
         assert(0);
 
-    function->numberOfTempVar = NumberOfTempVars;
-    binTranslator->funcArray[binTranslator->funcArraySize - 1] = *function;
-    free (function);
+    function->frameSize       = (function->varArraySize - function->numberOfTempVar) * 8;
+    symMapDtor (&function->varMap);
+    packCmds (function);
 }
 //----------------------------------------
 
 //----------------------------------------
-#define CMD2op(opCode) addCmd(&function->blockArray[function->blockArraySize - 1], {(unsigned int) opCode, 0, 0, 0}, \
+#define CMD2op(opCode) addCmd (function, &function->blockArray[function->blockArraySize - 1], {(unsigned int) opCode, 0, 0, 0}, \
         parseExpToIR(node->left, binTranslator, function),                        \
         parseExpToIR(node->right, binTranslator, function),                       \
         tempOp);
-#define CMD1op(opCode, direction) addCmd (function, {(unsigned int) opCode, 0, 0, 0}, \
-        parseExpToIR (direction, binTranslator, function), NULL, tempOp, NULL);
 
-static Op_bt* parseExpToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* function)
+static Op_bt parseExpToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* function)
 {
     assert (node          != NULL);
     assert (binTranslator != NULL);
@@ -464,37 +523,33 @@ static Op_bt* parseExpToIR (Node* node, BinaryTranslator* binTranslator, Func_bt
     {
         case OP_t:
         {
-            Var_bt* tempVar = addTempVar (function->varArray, &function->varArraySize, Stack);
-            Value_bt value = {};
-            value.var = tempVar;
-            Op_bt*  tempOp  = createOpBt(Var_t, value);
+            Op_bt tempOp = varToOp (function, addTempVar (function, Stack));
 
             switch (node->opValue)
             {
                 case OP_ADD:
                     CMD2op(OP_ADD);
-                    return createOpBt(Var_t, value);
+                    return tempOp;
                     break;
 
                 case OP_SUB:
                     CMD2op(OP_SUB);
-                    return createOpBt(Var_t, value);
+                    return tempOp;
                     break;
 
                 case OP_MUL:
                     CMD2op(OP_MUL);
-                    return createOpBt(Var_t, value);
+                    return tempOp;
                     break;
 
                 case OP_DIV:
                     CMD2op(OP_DIV);
-                    return createOpBt(Var_t, value);
+                    return tempOp;
                     break;
 
                 case OP_EQ:
-                    addCmd (&function->blockArray[function->blockArraySize - 1], {(unsigned int) OP_EQ, 0, 0, 0},
-                        parseExpToIR (node->right, binTranslator, function), NULL, parseExpToIR(node->left, binTranslator, function));
-                    free (tempOp);
+                    addCmd (function, &function->blockArray[function->blockArraySize - 1], {(unsigned int) OP_EQ, 0, 0, 0},
+                        parseExpToIR (node->right, binTranslator, function), NoOp, parseExpToIR(node->left, binTranslator, function));
                     break;
 
                 default:
@@ -504,11 +559,11 @@ static Op_bt* parseExpToIR (Node* node, BinaryTranslator* binTranslator, Func_bt
         }
 
         case Var_t:
-            return createOpBt(Var_t, {.var = parseVarToIR(node, binTranslator, function)});
+            return varToOp (function, parseVarToIR(node, binTranslator, function));
             break;
 
         case Num_t:
-            return NumOP({.num = (int) node->numValue});
+            return numOp ((int) node->numValue);
             break;
 
         case Func_t:
@@ -521,7 +576,7 @@ static Op_bt* parseExpToIR (Node* node, BinaryTranslator* binTranslator, Func_bt
         default:
             assert (0);
     }
-    return NULL;
+    return NoOp;
 }
 #undef CMD
 
@@ -531,53 +586,93 @@ static void parseIfToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* f
     assert (function != NULL);
     assert (binTranslator != NULL);
 
-    static int numberOfIf = 0;
-    int curNumberOfIf = numberOfIf;
-    numberOfIf += 1;
+    int curNumberOfIf = function->ctx.numberOfIf;
+    function->ctx.numberOfIf += 1;
 
-    char buf[15] = "";
+    char buf[BlockNameSize] = "";
     Block_bt* ifBlock    = NULL;
     Block_bt* elseBlock  = NULL;
+    Block_bt* ifEnd      = NULL;   // nested IFs leave body in their MERGE blocks
+    Block_bt* elseEnd    = NULL;
     Block_bt* elderBlock = &function->blockArray[function->blockArraySize - 1];
 
-    Op_bt* condition = parseExpToIR(node->left, binTranslator, function);
+    Op_bt condition = parseExpToIR(node->left, binTranslator, function);
 
-    sprintf(buf, "IF%d", curNumberOfIf);
+    snprintf (buf, sizeof (buf), "IF%d", curNumberOfIf);
     if (node->right)
     {
+        size_t bodySize = treeStats (binTranslator, node->right).numOfCmd;
+
         if (strcmp (node->right->Name, "ELSE") == 0)
         {
-            ifBlock = addBlock (function, countNumberOfCmdInFunc (node->right, 0), buf);
+            ifBlock = addBlock (function, bodySize, internedName (binTranslator, buf));
             parseStToIR (node->right->left, binTranslator, function);
+            ifEnd = &function->blockArray[function->blockArraySize - 1];
 
-            sprintf(buf, "ELSE%d", curNumberOfIf);
+            snprintf (buf, sizeof (buf), "ELSE%d", curNumberOfIf);
 
-            elseBlock = addBlock(function,  countNumberOfCmdInFunc (node->right, 0), buf);
+            elseBlock = addBlock (function, bodySize, internedName (binTranslator, buf));
             parseStToIR (node->right->right, binTranslator, function);
+            elseEnd = &function->blockArray[function->blockArraySize - 1];
         }
         else
         {
-            ifBlock = addBlock (function, countNumberOfCmdInFunc (node->right, 0), buf);
+            ifBlock = addBlock (function, bodySize, internedName (binTranslator, buf));
             parseStToIR (node->right, binTranslator, function);
+            ifEnd = &function->blockArray[function->blockArraySize - 1];
         }
 
-        sprintf(buf, "MERGE%d", curNumberOfIf);
-        Block_bt* mergeBlock = addBlock(function, 20, buf);
+        snprintf (buf, sizeof (buf), "MERGE%d", curNumberOfIf);
+        Block_bt* mergeBlock = addBlock (function, 20, internedName (binTranslator, buf));
 
-        addCmd (ifBlock, {OP_JMP, 0, 0, 0}, createOpBt(Pointer_t, {.block = mergeBlock}), NULL, NULL);
+        addCmd (function, ifEnd, {OP_JMP, 0, 0, 0}, blockToOp (function, mergeBlock), NoOp, NoOp);
 
         if (elseBlock != NULL)
         {
-            addCmd (elseBlock, {OP_JMP, 0, 0, 0}, createOpBt(Pointer_t, {.block = mergeBlock}), NULL, NULL);
-            addCmd (elderBlock, {OP_IF, 0, 0, 0}, createOpBt(Pointer_t, {.block = ifBlock}), createOpBt(Pointer_t, {.block = elseBlock}), condition);
+            addCmd (function, elseEnd, {OP_JMP, 0, 0, 0}, blockToOp (function, mergeBlock), NoOp, NoOp);
+            addCmd (function, elderBlock, {OP_IF, 0, 0, 0}, blockToOp (function, ifBlock), blockToOp (function, elseBlock), condition);
         }
         else
-            addCmd (elderBlock, {OP_IF, 0, 0, 0}, createOpBt(Pointer_t, {.block = ifBlock}), createOpBt(Pointer_t, {.block = mergeBlock}), condition);
+            addCmd (function, elderBlock, {OP_IF, 0, 0, 0}, blockToOp (function, ifBlock), blockToOp (function, mergeBlock), condition);
 
     }
 
 }
 
+// Condition is checked in WHILE block, body ends with JMP back to it and
+// false condition leaves to DONE block
+static void parseWhileToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* function)
+{
+    assert (node != NULL);
+    assert (function != NULL);
+    assert (binTranslator != NULL);
+
+    int curNumberOfWhile = function->ctx.numberOfWhile;
+    function->ctx.numberOfWhile += 1;
+
+    char buf[BlockNameSize] = "";
+    size_t conditionSize = treeStats (binTranslator, node->left).numOfCmd;
+
+    snprintf (buf, sizeof (buf), "WHILE%d", curNumberOfWhile);
+    Block_bt* header = addBlock (function, conditionSize + 1, internedName (binTranslator, buf));
+    Op_bt condition = parseExpToIR(node->left, binTranslator, function);
+
+    size_t bodySize = node->right ? treeStats (binTranslator, node->right).numOfCmd : 0;
+
+    snprintf (buf, sizeof (buf), "DO%d", curNumberOfWhile);
+    Block_bt* body = addBlock (function, bodySize + 1, internedName (binTranslator, buf));
+    if (node->right)
+        parseStToIR (node->right, binTranslator, function);
+
+    Block_bt* bodyEnd = &function->blockArray[function->blockArraySize - 1];
+    addCmd (function, bodyEnd, {OP_JMP, 0, 0, 0}, blockToOp (function, header), NoOp, NoOp);
+
+    snprintf (buf, sizeof (buf), "DONE%d", curNumberOfWhile);
+    Block_bt* exitBlock = addBlock (function, 20, internedName (binTranslator, buf));
+
+    addCmd (function, header, {OP_IF, 0, 0, 0}, blockToOp (function, body), blockToOp (function, exitBlock), condition);
+}
+
 static void parseCallParam (Node* node, BinaryTranslator* binTranslator, Func_bt* function)
 {
     assert (node != NULL);
@@ -589,15 +684,14 @@ static void parseCallParam (Node* node, BinaryTranslator* binTranslator, Func_bt
         switch (node->left->type)
         {
             case Num_t:
-                addCmd (&function->blockArray[function->blockArraySize - 1], {.operation = OP_PARIN}, createOpBt(Num_t, {.num = (int) node->left->numValue}), NULL, NULL);
+                addCmd (function, &function->blockArray[function->blockArraySize - 1], {.operation = OP_PARIN}, numOp ((int) node->left->numValue), NoOp, NoOp);
                 break;
             case Var_t:
-                findVar (function->varArray, node->left->var.varName);
-                addCmd (&function->blockArray[function->blockArraySize - 1], {.operation = OP_PARIN}, createOpBt(Var_t, {.var = findVar (function->varArray, node->left->var.varName)}), NULL, NULL);
+                addCmd (function, &function->blockArray[function->blockArraySize - 1], {.operation = OP_PARIN}, varToOp (function, findVar (binTranslator, function, node->left->var.varName)), NoOp, NoOp);
                 break;
 
             case OP_t:
-                addCmd(&function->blockArray[function->blockArraySize - 1], {.operation = OP_PARIN}, parseExpToIR(node->left, binTranslator, function), NULL, NULL);
+                addCmd (function, &function->blockArray[function->blockArraySize - 1], {.operation = OP_PARIN}, parseExpToIR(node->left, binTranslator, function), NoOp, NoOp);
                 break;
 
             default:
@@ -610,7 +704,7 @@ static void parseCallParam (Node* node, BinaryTranslator* binTranslator, Func_bt
         parseCallParam(node->right, binTranslator, function);
 }
 
-static Op_bt* parseCallToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* function)
+static Op_bt parseCallToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* function)
 {
     assert (node != NULL);
     assert (function != NULL);
@@ -623,9 +717,9 @@ static Op_bt* parseCallToIR (Node* node, BinaryTranslator* binTranslator, Func_b
         parseCallParam(curNode->left, binTranslator, function);
     }
 
-    Op_bt* dest = createOpBt(Var_t, {.var = addTempVar(function->varArray, &function->varArraySize, Register)});
-    addCmd (&function->blockArray[function->blockArraySize - 1], {.operation = OP_CALL}, createOpBt(Pointer_t, {.block=findFunctionBlock(binTranslator, curNode->Name)}), NULL, dest);
-    return createOpBt(Var_t, {.var = dest->value.var});
+    Op_bt dest = varToOp (function, addTempVar(function, Register));
+    addCmd (function, &function->blockArray[function->blockArraySize - 1], {.operation = OP_CALL}, funcOp (findFunction (binTranslator, curNode->Name)), NoOp, dest);
+    return dest;
 }
 
 static inline void parseOutToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* function)
@@ -634,7 +728,7 @@ static inline void parseOutToIR (Node* node, BinaryTranslator* binTranslator, Fu
     {
         if (node->left->left)
         {
-            addCmd (&function->blockArray[function->blockArraySize - 1], {.operation = OP_OUT}, createOpBt(Var_t, {.var = findVar(function->varArray, node->left->left->var.varName)}), NULL, NULL);
+            addCmd (function, &function->blockArray[function->blockArraySize - 1], {.operation = OP_OUT}, varToOp (function, findVar (binTranslator, function, node->left->left->var.varName)), NoOp, NoOp);
         }
     }
 }
@@ -645,7 +739,7 @@ static inline void parseInToIR (Node* node, BinaryTranslator* binTranslator, Fun
     {
         if (node->left->left)
         {
-            addCmd (&function->blockArray[function->blockArraySize - 1], {.operation = OP_IN},  NULL, NULL, createOpBt(Var_t, {.var = findVar(function->varArray, node->left->left->var.varName)}));
+            addCmd (function, &function->blockArray[function->blockArraySize - 1], {.operation = OP_IN},  NoOp, NoOp, varToOp (function, findVar (binTranslator, function, node->left->left->var.varName)));
         }
     }
 }
@@ -661,20 +755,20 @@ static void parseStToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* f
          switch (node->left->type)
          {
             case OP_t:
-                free (parseExpToIR (node->left, binTranslator, function));
+                parseExpToIR (node->left, binTranslator, function);
                 break;
 
             case Var_t:
-                free (parseExpToIR (node->left, binTranslator, function));
+                parseExpToIR (node->left, binTranslator, function);
                 break;
 
             case Num_t:
-                free (parseExpToIR (node->left, binTranslator, function));
+                parseExpToIR (node->left, binTranslator, function);
                 break;
 
             case Func_t:
                 if (strcmp (node->left->Name, "CALL") == 0)
-                    free (parseCallToIR (node->left, binTranslator, function));
+                    parseCallToIR (node->left, binTranslator, function);
                 break;
 
             case Key_t:
@@ -682,14 +776,16 @@ static void parseStToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* f
                     parseStToIR (node->left, binTranslator, function);
 
                 else if (strcmp (node->left->Name, "RET") == 0)
-                    addCmd(&function->blockArray[function->blockArraySize - 1], {(unsigned int) OP_RET, 0, 0, 0}, parseExpToIR(node->left->left, binTranslator, function),
-                                        NULL, NULL);
+                    addCmd (function, &function->blockArray[function->blockArraySize - 1], {(unsigned int) OP_RET, 0, 0, 0}, parseExpToIR(node->left->left, binTranslator, function),
+                                        NoOp, NoOp);
                 else if (strcmp (node->left->Name, "IF") == 0)
                     parseIfToIR (node->left, binTranslator, function);
+                else if (strcmp (node->left->Name, "WHILE") == 0)
+                    parseWhileToIR (node->left, binTranslator, function);
                 else if (strcmp (node->left->Name, "VAR") == 0)
                 {
-                    addCmd (&function->blockArray[function->blockArraySize - 1], {(unsigned int) OP_EQ, 0, 0, 0},
-                        parseExpToIR (node->left->right, binTranslator, function), NULL, parseExpToIR(node->left->left, binTranslator, function));
+                    addCmd (function, &function->blockArray[function->blockArraySize - 1], {(unsigned int) OP_EQ, 0, 0, 0},
+                        parseExpToIR (node->left->right, binTranslator, function), NoOp, parseExpToIR(node->left->left, binTranslator, function));
                 }
 
 
@@ -717,33 +813,123 @@ static void parseStToIR (Node* node, BinaryTranslator* binTranslator, Func_bt* f
 }
 //----------------------------------------
 
-static void parseProgToIR (Node* node, BinaryTranslator* binTranslator)
+static void declareProgFuncs (Node* node, BinaryTranslator* binTranslator)
 {
     if (node->left)
     {
         if (node->left->type == Func_t)
-            parseFuncToIR(node->left, binTranslator);
+            declareFunc(node->left, binTranslator);
         else
             assert (0);
     }
 
     if (node->right)
     {
-        parseProgToIR(node->right, binTranslator);
+        declareProgFuncs(node->right, binTranslator);
     }
+}
+
+
+// In process run
+//----------------------------------------
+static const size_t JitPageSize       = 4096;
+
+static inline size_t alignToPage (size_t size)
+{
+    return (size + JitPageSize - 1) / JitPageSize * JitPageSize;
+}
+
+static inline void patchImm64 (unsigned char* code, size_t pos, uint64_t value)
+{
+    memcpy (code + pos, &value, sizeof (value));
+}
+
+// Saves registers that host expects to survive the call, switches to program
+// stack and calls _start at code. Host rsp is kept on top of program stack
+static size_t writeJitTrampoline (unsigned char* trampoline, const unsigned char* code, const unsigned char* stackTop)
+{
+    const unsigned char prologue[] = {0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, // push rbx, rbp, r12 - r15
+                                      0x48, 0x89, 0xe0, 0x48, 0xbc};                              // mov rax, rsp; mov rsp, imm64
+    const unsigned char epilogue[] = {0x5c, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, 0xc3}; // pop rsp, ...
+
+    size_t ip = 0;
+    memcpy (trampoline, prologue, sizeof (prologue));
+    ip += sizeof (prologue);
+
+    patchImm64 (trampoline, ip, (uint64_t) stackTop);
+    ip += sizeof (uint64_t);
 
+    trampoline[ip] = PUSH_REG + RAX;
+    ip += SIZE_PUSH_REG;
+
+    trampoline[ip] = CALL_OP;
+    ip += SIZE_CALL_OP;
+    int32_t relAddress = (int32_t) (code - (trampoline + ip + sizeof (int32_t)));
+    memcpy (trampoline + ip, &relAddress, sizeof (relAddress));
+    ip += sizeof (relAddress);
+
+    memcpy (trampoline + ip, epilogue, sizeof (epilogue));
+    ip += sizeof (epilogue);
+
+    return ip;
 }
 
 void startProg (BinaryTranslator* binTranslator)
 {
     assert (binTranslator != NULL);
+    assert (binTranslator->code.x86_array != NULL);
+
+    size_t runtimeSize = 0;
+    unsigned char* runtime = loadRuntime (&runtimeSize);
+
+    size_t trampolineSize = 64;
+    size_t codeSize = alignToPage (binTranslator->code.x86_arraySize + runtimeSize + trampolineSize);
+    size_t dataSize = alignToPage (PRINTF_BUF_SIZE + SCANF_BUF_SIZE);
+    size_t stackSize = alignToPage (binTranslator->stackSize);
+
+    unsigned char* code  = (unsigned char*) mmap (NULL, codeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    unsigned char* data  = (unsigned char*) mmap (NULL, dataSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    unsigned char* stack = (unsigned char*) mmap (NULL, stackSize, PROT_READ | PROT_WRITE,
+                                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert (code  != MAP_FAILED);
+    assert (data  != MAP_FAILED);
+    assert (stack != MAP_FAILED);
+
+    // Same layout as in ELF file: code, printf, scanf. Calls to runtime are relative, so they stay valid
+    memcpy (code, binTranslator->code.x86_array, binTranslator->code.x86_arraySize);
+    memcpy (code + binTranslator->code.x86_arraySize, runtime, runtimeSize);
+    free (runtime);
+
+    // Buffers move out of code into writable data pages
+    StartPatch_bt patch = binTranslator->startPatch;
+    patchImm64 (code, patch.printfOutPos, (uint64_t) data);
+    patchImm64 (code, patch.scanfBufPos,  (uint64_t) (data + PRINTF_BUF_SIZE));
+
+    // Trampoline sets rsp, so it can come back to host stack
+    memset (code + patch.stackPos - SIZE_MOV_RSP_IMM64, 0x90, SIZE_MOV_RSP_IMM64 + sizeof (uint64_t));
+
+    // Exit syscall would kill translator, return to trampoline instead
+    const unsigned char codeToReturn[] = {RET_OP, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90};
+    memcpy (code + patch.exitPos, codeToReturn, sizeof (codeToReturn));
+
+    unsigned char* trampoline = code + binTranslator->code.x86_arraySize + runtimeSize;
+    size_t writtenTrampolineSize = writeJitTrampoline (trampoline, code, stack + stackSize);
+    assert (writtenTrampolineSize <= trampolineSize);
 
-    mprotect(binTranslator->x86_array, binTranslator->x86_arraySize, PROT_EXEC);
+    int mprotectResult = mprotect (code, codeSize, PROT_READ | PROT_EXEC);
+    assert (mprotectResult == 0);
 
-    void (*func) (void) = ((void (*) (void)) binTranslator->x86_array);
+    // Program writes to fd 1 directly
+    fflush (stdout);
+
+    void (*func) (void) = ((void (*) (void)) trampoline);
     func();
-    mprotect(binTranslator->x86_array, binTranslator->x86_arraySize, PROT_READ | PROT_WRITE);
+
+    munmap (code, codeSize);
+    munmap (data, dataSize);
+    munmap (stack, stackSize);
 }
+//----------------------------------------
 
 void parseTreeToIR (const char* fileName, BinaryTranslator* binTranslator)
 {
@@ -752,66 +938,47 @@ void parseTreeToIR (const char* fileName, BinaryTranslator* binTranslator)
 
     FILE* fileptr = fopen(fileName, "r");
     assert (fileptr != NULL);
-    Node* tree = getTreeFromStandart(fileName);
+    bool treeText = isTreeText (fileptr);
+    fclose (fileptr);
 
-    treeDump(tree, "HEYY\n");
+    symTableCtor (&binTranslator->symbols, &binTranslator->arena);
+    Node* tree = treeText ? readTreeText (fileName) : getTreeFromStandart(fileName);
+    assert (tree != NULL && "tree file is broken");
     binTranslator->tree = tree;
+    timePhase (binTranslator, "tree load", 0);
 
-    binTranslator->funcArray = (Func_bt*) calloc (countNumberOfFunc(tree, 0) + 1, sizeof (Func_bt));
+    if (binTranslator->dumps & DUMP_TREE)
+    {
+        treeDump(tree, "HEYY\n");
+        timePhase (binTranslator, "tree dump", 0);
+    }
 
-    parseProgToIR(tree, binTranslator);
-    dumpIR("Dump.txt", binTranslator);
-}
+    TreeStats_bt stats = collectTreeStats (binTranslator, tree);
+    binTranslator->funcArray = (Func_bt*) arenaAlloc (&binTranslator->arena, (stats.numOfFunc + 1) * sizeof (Func_bt));
 
-//----------------------------------------
+    declareProgFuncs(tree, binTranslator);
+    threadPoolRun (&binTranslator->pool, parseFuncToIR, binTranslator, binTranslator->funcArraySize);
+    symMapDtor (&binTranslator->treeStatsMap);
+    timePhase (binTranslator, "IR build", 0);
 
-static void varArrayDtor (Func_bt* function)
-{
-    for (size_t i = 0; i < function->varArraySize; i++)
+    if (binTranslator->dumps & DUMP_IR)
     {
-        if (strstr(function->varArray[i].name, "temp"))
-            free (function->varArray[i].name);
+        dumpIR("Dump.txt", binTranslator);
+        timePhase (binTranslator, "IR dump", 0);
     }
-
-    free (function->varArray);
 }
 
+//----------------------------------------
+
+// IR lives in arenas of functions, names and function array in the common one
 void IRdtor (BinaryTranslator* binTranslator)
 {
     for (size_t i = 0; i < binTranslator->funcArraySize; i++)
-    {
-
-        for (size_t j = 0; j < binTranslator->funcArray[i].blockArraySize; j ++)
-        {
-            for (size_t k = 0; k < binTranslator->funcArray[i].blockArray[j].cmdArraySize; k++)
-            {
-                if (binTranslator->funcArray[i].blockArray[j].cmdArray[k].operator1)
-                {
-                    free (binTranslator->funcArray[i].blockArray[j].cmdArray[k].operator1);
-                }
-
-                if (binTranslator->funcArray[i].blockArray[j].cmdArray[k].operator2)
-                {
-                    free (binTranslator->funcArray[i].blockArray[j].cmdArray[k].operator2);
-                }
-
-                if (binTranslator->funcArray[i].blockArray[j].cmdArray[k].dest)
-                {
-                    free (binTranslator->funcArray[i].blockArray[j].cmdArray[k].dest);
-                }
-
-            }
-
-            free (binTranslator->funcArray[i].blockArray[j].cmdArray);
-
-        }
-
-        free (binTranslator->funcArray[i].blockArray);
-        varArrayDtor(&binTranslator->funcArray[i]);
-
-    }
-
+        arenaDtor (&binTranslator->funcArray[i].ctx.arena);
 
+    binTranslator->funcArray     = NULL;
+    binTranslator->funcArraySize = 0;
+    arenaDtor (&binTranslator->arena);
 }
 
 void NodeDtor(Node* node)
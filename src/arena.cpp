@@ -0,0 +1,151 @@
+#include <cstddef>
+#include <cstdlib>
+#include <cassert>
+#include <cstring>
+
+#include "../include/arena.h"
+
+// Chunks are taken from calloc and memory is never reused, so everything
+// arenaAlloc returns is already zeroed. Each new chunk is twice as big as the
+// previous one, so number of chunks grows as log of IR size.
+
+struct ArenaChunk_bt
+{
+    ArenaChunk_bt* prev;
+    size_t size;
+    size_t used;
+};
+
+static const size_t ArenaAlign        = alignof (max_align_t);
+static const size_t ArenaStartSize    = 64 * 1024;
+static const size_t ArenaMinStartSize = 1024;
+static const size_t ArenaChunkHeader  = (sizeof (ArenaChunk_bt) + ArenaAlign - 1) / ArenaAlign * ArenaAlign;
+
+static inline size_t alignSize (size_t size)
+{
+    return (size + ArenaAlign - 1) / ArenaAlign * ArenaAlign;
+}
+
+static inline unsigned char* chunkData (ArenaChunk_bt* chunk)
+{
+    return (unsigned char*) chunk + ArenaChunkHeader;
+}
+
+static void addChunk (Arena_bt* arena, size_t size)
+{
+    size_t chunkSize = arena->chunk ? arena->chunk->size * 2 : (arena->startSize ? arena->startSize : ArenaStartSize);
+    while (chunkSize < size)
+        chunkSize *= 2;
+
+    ArenaChunk_bt* chunk = (ArenaChunk_bt*) calloc (1, ArenaChunkHeader + chunkSize);
+    assert (chunk != NULL);
+
+    chunk->prev = arena->chunk;
+    chunk->size = chunkSize;
+    chunk->used = 0;
+
+    arena->chunk          = chunk;
+    arena->numOfChunks   += 1;
+    arena->bytesReserved += ArenaChunkHeader + chunkSize;
+}
+
+// Arenas of functions are many and mostly small, they start with the size
+// their IR is expected to take instead of ArenaStartSize
+void arenaCtor (Arena_bt* arena, size_t startSize)
+{
+    assert (arena != NULL);
+
+    *arena = {};
+    arena->startSize = (startSize < ArenaMinStartSize) ? ArenaMinStartSize : alignSize (startSize);
+}
+
+void* arenaAlloc (Arena_bt* arena, size_t size)
+{
+    assert (arena != NULL);
+
+    size = alignSize (size);
+    if (arena->chunk == NULL || arena->chunk->size - arena->chunk->used < size)
+        addChunk (arena, size);
+
+    void* ptr = chunkData (arena->chunk) + arena->chunk->used;
+    arena->chunk->used    += size;
+    arena->numOfAllocs    += 1;
+    arena->bytesAllocated += size;
+
+    return ptr;
+}
+
+// Last allocation of the current chunk grows in place, anything else is
+// copied and the old copy stays in arena until arenaDtor
+void* arenaRealloc (Arena_bt* arena, void* ptr, size_t oldSize, size_t newSize)
+{
+    assert (arena != NULL);
+
+    if (ptr == NULL)
+        return arenaAlloc (arena, newSize);
+
+    if (newSize <= oldSize)
+        return ptr;
+
+    ArenaChunk_bt* chunk = arena->chunk;
+    oldSize = alignSize (oldSize);
+    newSize = alignSize (newSize);
+
+    if ((unsigned char*) ptr + oldSize == chunkData (chunk) + chunk->used &&
+        chunk->size - chunk->used >= newSize - oldSize)
+    {
+        chunk->used           += newSize - oldSize;
+        arena->bytesAllocated += newSize - oldSize;
+        return ptr;
+    }
+
+    void* newPtr = arenaAlloc (arena, newSize);
+    memcpy (newPtr, ptr, oldSize);
+
+    return newPtr;
+}
+
+char* arenaStrdup (Arena_bt* arena, const char* str)
+{
+    assert (str != NULL);
+
+    size_t length = strlen (str) + 1;
+    char*  copy   = (char*) arenaAlloc (arena, length);
+    memcpy (copy, str, length);
+
+    return copy;
+}
+
+void arenaDtor (Arena_bt* arena)
+{
+    while (arena->chunk)
+    {
+        ArenaChunk_bt* prev = arena->chunk->prev;
+        free (arena->chunk);
+        arena->chunk = prev;
+    }
+
+    *arena = {};
+}
+
+// Sums counters only, total owns no chunks
+void arenaAddStats (Arena_bt* total, const Arena_bt* arena)
+{
+    assert (total != NULL);
+    assert (arena != NULL);
+
+    total->numOfAllocs    += arena->numOfAllocs;
+    total->bytesAllocated += arena->bytesAllocated;
+    total->bytesReserved  += arena->bytesReserved;
+    total->numOfChunks    += arena->numOfChunks;
+}
+
+void dumpArenaStats (FILE* fileptr, const char* name, const Arena_bt* arena)
+{
+    assert (fileptr != NULL);
+    assert (name    != NULL);
+    assert (arena   != NULL);
+
+    fprintf (fileptr, "%s: %lu allocations, %lu bytes used, %lu bytes reserved in %lu chunks\n",
+             name, arena->numOfAllocs, arena->bytesAllocated, arena->bytesReserved, arena->numOfChunks);
+}
@@ -0,0 +1,451 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <cstring>
+#include <climits>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../language/common.h"
+#include "../include/BinaryTranslator.h"
+#include "../include/codeCache.h"
+#include "../include/irUtils.h"
+
+// Code of a function is kept in <cacheDir>/<key>.bin and taken from there
+// instead of optimizing, allocating and emitting the function again.
+// Key is a hash of the FUNC subtree and of the subtrees and signatures of all
+// functions it can call: the inliner copies bodies of callees, so a changed
+// callee must change the code of its callers too. CacheVersion is in the key
+// as well, so code of an older translator is never read.
+//
+// Jumps inside the function are relative and are resolved before the code is
+// stored. Calls of other functions are kept as fixups with the callee name,
+// runtime calls as fixups with their offset. Files are never changed, a new
+// one is written to a temporary name and renamed.
+
+// Bump it with every change of the code translator emits: IR passes,
+// register allocation, translator.cpp, peephole.cpp and the runtime
+static const char CacheVersion[] = "bt code cache 2";
+static const char CacheMagic[4]  = {'B', 'T', 'C', '1'};
+
+static const uint64_t FnvBasis = 0xcbf29ce484222325;
+static const uint64_t FnvPrime = 0x100000001b3;
+
+static const size_t MaxNameSize = 4096;
+
+struct CacheHeader_bt
+{
+    uint32_t magic;         // CacheMagic
+    uint32_t nameSize;
+    uint64_t key;
+    uint64_t codeSize;
+    uint64_t numOfFixups;
+    uint64_t asmTextSize;
+    uint64_t peepholeHits[PH_RULES_COUNT];
+};
+
+// Name of the callee goes right after FIXUP_BLOCK one
+struct CacheFixup_bt
+{
+    uint64_t pos;
+    uint64_t runtimeOffset;
+    uint32_t kind;
+    uint32_t nameSize;
+};
+
+// Keys
+//----------------------------------------
+static uint64_t hashBytes (uint64_t hash, const void* data, size_t size)
+{
+    // FNV-1a, as hashName of symTable.cpp
+    const unsigned char* bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FnvPrime;
+    }
+
+    return hash;
+}
+
+static uint64_t hashString (uint64_t hash, const char* str)
+{
+    if (str == NULL)
+        str = "";
+
+    return hashBytes (hash, str, strlen (str) + 1);     // with '\0', so "ab" "c" != "a" "bc"
+}
+
+static uint64_t hashTree (uint64_t hash, const Node* node)
+{
+    unsigned char present = node != NULL;
+    hash = hashBytes (hash, &present, sizeof (present));
+    if (node == NULL)
+        return hash;
+
+    hash = hashBytes (hash, &node->type, sizeof (node->type));
+
+    if (node->type == Num_t)
+        hash = hashBytes (hash, &node->numValue, sizeof (node->numValue));
+    else if (node->type == Var_t)
+        hash = hashString (hash, node->var.varName);
+    else if (node->type == OP_t || node->type == BuiltIn_t)
+        hash = hashBytes (hash, &node->opValue, sizeof (node->opValue));
+    else if (node->type == Key_t || node->type == Func_t)
+        hash = hashString (hash, node->Name);
+
+    hash = hashTree (hash, node->left);
+    return hashTree (hash, node->right);
+}
+
+static void reachCallees (const BinaryTranslator* binTranslator, size_t index, bool* reached)
+{
+    const Func_bt* function = &binTranslator->funcArray[index];
+
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        const Block_bt* block = &function->blockArray[b];
+        const Cmd_bt*   cmds  = blockCmds (function, block);
+
+        for (size_t i = 0; i < block->cmdArraySize; i++)
+        {
+            if (cmds[i].opCode.operation != OP_CALL)
+                continue;
+
+            size_t callee = cmds[i].operator1.value.func;
+            if (!reached[callee])
+            {
+                reached[callee] = true;
+                reachCallees (binTranslator, callee, reached);
+            }
+        }
+    }
+}
+
+static void computeKeys (BinaryTranslator* binTranslator)
+{
+    size_t numOfFunc = binTranslator->funcArraySize;
+
+    uint64_t* treeHashes = (uint64_t*) calloc (numOfFunc, sizeof (*treeHashes));
+    bool*     reached    = (bool*)     calloc (numOfFunc, sizeof (*reached));
+    assert (treeHashes != NULL);
+    assert (reached    != NULL);
+
+    for (size_t i = 0; i < numOfFunc; i++)
+        treeHashes[i] = hashTree (FnvBasis, binTranslator->funcArray[i].ctx.node);
+
+    for (size_t i = 0; i < numOfFunc; i++)
+    {
+        memset (reached, 0, numOfFunc * sizeof (*reached));
+        reachCallees (binTranslator, i, reached);
+
+        uint64_t key = hashString (FnvBasis, CacheVersion);
+        key = hashBytes (key, &treeHashes[i], sizeof (*treeHashes));
+
+        for (size_t j = 0; j < numOfFunc; j++)
+        {
+            if (!reached[j] || j == i)
+                continue;
+
+            const Func_bt* callee    = &binTranslator->funcArray[j];
+            uint64_t       numOfArgs = numOfParams (callee);
+
+            key = hashString (key, callee->name);
+            key = hashBytes  (key, &numOfArgs, sizeof (numOfArgs));
+            key = hashBytes  (key, &treeHashes[j], sizeof (*treeHashes));
+        }
+
+        binTranslator->funcArray[i].ctx.cacheKey = key;
+    }
+
+    free (treeHashes);
+    free (reached);
+}
+
+// false if the path doesn't fit PATH_MAX, the function is not cached then
+static bool cachePath (char* path, const BinaryTranslator* binTranslator, uint64_t key)
+{
+    int size = snprintf (path, PATH_MAX, "%s/%016lx.bin", binTranslator->cacheDir, (unsigned long) key);
+    return 0 <= size && size < PATH_MAX;
+}
+//----------------------------------------
+
+// Loading
+//----------------------------------------
+static bool readName (FILE* fileptr, char* name, uint32_t nameSize)
+{
+    if (nameSize >= MaxNameSize || fread (name, 1, nameSize, fileptr) != nameSize)
+        return false;
+
+    name[nameSize] = '\0';
+    return true;
+}
+
+static bool readFixups (FILE* fileptr, BinaryTranslator* binTranslator, CodeBuf_bt* code, size_t numOfFixups)
+{
+    code->fixups = (Fixup_bt*) calloc (numOfFixups + 1, sizeof (*code->fixups));
+    if (code->fixups == NULL)
+        return false;
+
+    code->fixupsCapacity = numOfFixups + 1;
+
+    char name[MaxNameSize] = "";
+    for (size_t i = 0; i < numOfFixups; i++)
+    {
+        CacheFixup_bt stored = {};
+        if (fread (&stored, sizeof (stored), 1, fileptr) != 1 || stored.pos + sizeof (int) > code->BT_ip)
+            return false;
+
+        Fixup_bt fixup = {(FIXUP_KIND) stored.kind, stored.pos, NULL, stored.runtimeOffset};
+
+        if (stored.kind == FIXUP_BLOCK)
+        {
+            if (!readName (fileptr, name, stored.nameSize))
+                return false;
+
+            size_t callee = symMapFind (&binTranslator->funcMap, internName (&binTranslator->symbols, name));
+            if (callee == NotFound)
+                return false;
+
+            fixup.runtimeOffset = callee;     // till linkCachedCalls
+        }
+        else if (stored.kind != FIXUP_RUNTIME)
+            return false;
+
+        code->fixups[code->fixupsSize++] = fixup;
+    }
+
+    return true;
+}
+
+static bool readCachedFunction (FILE* fileptr, BinaryTranslator* binTranslator, Func_bt* function)
+{
+    FuncCtx_bt* ctx = &function->ctx;
+
+    if (fseek (fileptr, 0, SEEK_END) != 0)
+        return false;
+
+    long fileSize = ftell (fileptr);
+    rewind (fileptr);
+
+    CacheHeader_bt header = {};
+    char name[MaxNameSize] = "";
+
+    if (fileSize < 0 || fread (&header, sizeof (header), 1, fileptr) != 1)
+        return false;
+
+    if (memcmp (&header.magic, CacheMagic, sizeof (header.magic)) != 0 || header.key != ctx->cacheKey)
+        return false;
+
+    if (!readName (fileptr, name, header.nameSize) || strcmp (name, function->name) != 0)
+        return false;
+
+    // Sizes are checked before anything is allocated for them
+    // Code stored without --dump asm has no text for DebugAsm.s
+    if ((binTranslator->dumps & DUMP_ASM) && header.asmTextSize == 0)
+        return false;
+
+    if (header.codeSize > (uint64_t) fileSize || header.asmTextSize > (uint64_t) fileSize ||
+        header.numOfFixups > (uint64_t) fileSize / sizeof (CacheFixup_bt))
+        return false;
+
+    CodeBuf_bt* code = &ctx->code;
+    code->x86_array = (unsigned char*) calloc (header.codeSize + 1, sizeof (*code->x86_array));
+    if (code->x86_array == NULL || fread (code->x86_array, 1, header.codeSize, fileptr) != header.codeSize)
+        return false;
+
+    code->BT_ip             = header.codeSize;
+    code->x86_arraySize     = header.codeSize;
+    code->x86_arrayCapacity = header.codeSize + 1;
+    memcpy (code->peepholeHits, header.peepholeHits, sizeof (code->peepholeHits));
+
+    if (!readFixups (fileptr, binTranslator, code, header.numOfFixups))
+        return false;
+
+    ctx->asmText = (char*) calloc (header.asmTextSize + 1, sizeof (char));
+    if (ctx->asmText == NULL || fread (ctx->asmText, 1, header.asmTextSize, fileptr) != header.asmTextSize)
+        return false;
+
+    ctx->asmTextSize = header.asmTextSize;
+    return true;
+}
+
+// Job of the pool. Missing or broken file is a miss, the function is compiled as usual
+static void loadFunctionJob (void* arg, size_t index)
+{
+    BinaryTranslator* binTranslator = (BinaryTranslator*) arg;
+    Func_bt*          function      = &binTranslator->funcArray[index];
+    FuncCtx_bt*       ctx           = &function->ctx;
+
+    char path[PATH_MAX] = "";
+    if (!cachePath (path, binTranslator, ctx->cacheKey))
+        return;
+
+    FILE* fileptr = fopen (path, "rb");
+    if (fileptr == NULL)
+        return;
+
+    ctx->cached = readCachedFunction (fileptr, binTranslator, function);
+    fclose (fileptr);
+
+    if (ctx->cached)
+        return;
+
+    free (ctx->code.x86_array);
+    free (ctx->code.fixups);
+    free (ctx->asmText);
+    ctx->code        = {};
+    ctx->asmText     = NULL;
+    ctx->asmTextSize = 0;
+}
+
+// Goes right after parseTreeToIR: bodies of cached functions are still needed for inlining
+void loadCachedFunctions (BinaryTranslator* binTranslator)
+{
+    assert (binTranslator           != NULL);
+    assert (binTranslator->cacheDir != NULL);
+
+    mkdir (binTranslator->cacheDir, 0777);     // may exist already
+
+    computeKeys (binTranslator);
+    threadPoolRun (&binTranslator->pool, loadFunctionJob, binTranslator, binTranslator->funcArraySize);
+
+    size_t numOfCached = 0;
+    for (size_t i = 0; i < binTranslator->funcArraySize; i++)
+        numOfCached += binTranslator->funcArray[i].ctx.cached;
+
+    if (binTranslator->verbose)
+        fprintf (stderr, "Code cache: %lu of %lu functions reused\n", numOfCached, binTranslator->funcArraySize);
+    timePhase (binTranslator, "code cache", 0);
+}
+
+// Inlining moves blocks of functions, so calls of cached code get entries of
+// callees only when code is emitted
+void linkCachedCalls (BinaryTranslator* binTranslator, Func_bt* function)
+{
+    assert (binTranslator       != NULL);
+    assert (function            != NULL);
+    assert (function->ctx.cached);
+
+    function->blockArray[0].codeOffset = 0;
+
+    CodeBuf_bt* code = &function->ctx.code;
+    for (size_t i = 0; i < code->fixupsSize; i++)
+    {
+        Fixup_bt* fixup = &code->fixups[i];
+        if (fixup->kind != FIXUP_BLOCK)
+            continue;
+
+        fixup->block         = &binTranslator->funcArray[fixup->runtimeOffset].blockArray[0];
+        fixup->runtimeOffset = 0;
+    }
+}
+//----------------------------------------
+
+// Storing
+//----------------------------------------
+static bool isOwnBlock (const Func_bt* function, const Block_bt* block)
+{
+    return block >= function->blockArray && block < function->blockArray + function->blockArraySize;
+}
+
+static const char* calleeName (const BinaryTranslator* binTranslator, const Block_bt* entry)
+{
+    for (size_t i = 0; i < binTranslator->funcArraySize; i++)
+    {
+        if (&binTranslator->funcArray[i].blockArray[0] == entry)
+            return binTranslator->funcArray[i].name;
+    }
+
+    assert (0 && "call of a block that is not an entry of function");
+    return NULL;
+}
+
+static bool writeCachedFunction (FILE* fileptr, const BinaryTranslator* binTranslator, const Func_bt* function,
+                                 const unsigned char* bytes, size_t numOfFixups)
+{
+    const FuncCtx_bt* ctx  = &function->ctx;
+    const CodeBuf_bt* code = &ctx->code;
+
+    CacheHeader_bt header = {};
+    memcpy (&header.magic, CacheMagic, sizeof (header.magic));
+    header.nameSize    = (uint32_t) strlen (function->name);
+    header.key         = ctx->cacheKey;
+    header.codeSize    = code->BT_ip;
+    header.numOfFixups = numOfFixups;
+    header.asmTextSize = ctx->asmTextSize;
+    for (size_t r = 0; r < PH_RULES_COUNT; r++)
+        header.peepholeHits[r] = code->peepholeHits[r];
+
+    bool written = fwrite (&header, sizeof (header), 1, fileptr) == 1 &&
+                   fwrite (function->name, 1, header.nameSize, fileptr) == header.nameSize &&
+                   fwrite (bytes, 1, code->BT_ip, fileptr) == code->BT_ip;
+
+    for (size_t i = 0; written && i < code->fixupsSize; i++)
+    {
+        Fixup_bt fixup = code->fixups[i];
+        if (fixup.kind == FIXUP_BLOCK && isOwnBlock (function, fixup.block))
+            continue;
+
+        const char*   name   = (fixup.kind == FIXUP_BLOCK) ? calleeName (binTranslator, fixup.block) : "";
+        CacheFixup_bt stored = {fixup.pos, fixup.runtimeOffset, (uint32_t) fixup.kind, (uint32_t) strlen (name)};
+
+        written = fwrite (&stored, sizeof (stored), 1, fileptr) == 1 &&
+                  fwrite (name, 1, stored.nameSize, fileptr) == stored.nameSize;
+    }
+
+    return written && (ctx->asmTextSize == 0 || fwrite (ctx->asmText, 1, ctx->asmTextSize, fileptr) == ctx->asmTextSize);
+}
+
+// Called by emitFunction, before linkFunctions moves the blocks. Cache is
+// only a speedup, so a file that can't be written is skipped
+void storeCachedFunction (BinaryTranslator* binTranslator, const Func_bt* function)
+{
+    assert (binTranslator           != NULL);
+    assert (binTranslator->cacheDir != NULL);
+    assert (function                != NULL);
+
+    const CodeBuf_bt* code = &function->ctx.code;
+
+    unsigned char* bytes = (unsigned char*) calloc (code->BT_ip + 1, sizeof (*bytes));
+    assert (bytes != NULL);
+    memcpy (bytes, code->x86_array, code->BT_ip);
+
+    size_t numOfFixups = 0;
+    for (size_t i = 0; i < code->fixupsSize; i++)
+    {
+        Fixup_bt fixup = code->fixups[i];
+        if (fixup.kind == FIXUP_BLOCK && isOwnBlock (function, fixup.block))
+        {
+            int rel32 = (int) fixup.block->codeOffset - (int) fixup.pos - (int) sizeof (int);
+            memcpy (bytes + fixup.pos, &rel32, sizeof (rel32));
+        }
+        else
+            numOfFixups += 1;
+    }
+
+    char  path[PATH_MAX]    = "";
+    char  tmpPath[PATH_MAX] = "";
+    FILE* fileptr           = NULL;
+
+    if (cachePath (path, binTranslator, function->ctx.cacheKey))
+    {
+        int size = snprintf (tmpPath, PATH_MAX, "%s.%d.tmp", path, (int) getpid ());
+        if (0 <= size && size < PATH_MAX)
+            fileptr = fopen (tmpPath, "wb");
+    }
+
+    if (fileptr != NULL)
+    {
+        bool written = writeCachedFunction (fileptr, binTranslator, function, bytes, numOfFixups);
+        written      = (fclose (fileptr) == 0) && written;
+
+        if (!written || rename (tmpPath, path) != 0)
+            remove (tmpPath);
+    }
+
+    free (bytes);
+}
+//----------------------------------------
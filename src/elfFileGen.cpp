@@ -4,6 +4,7 @@
 #include <cstring>
 #include <elf.h>
 #include <cassert>
+#include <sys/stat.h>
 
 #include "../language/common.h"
 #include "../include/elfFileGen.h"
@@ -39,77 +40,74 @@ static void writeELFHeader (FILE* fileptr)
     fwrite(&header, sizeof (header), 1, fileptr);
 }
 
-static void writeELFPheader (FILE* fileptr, size_t sizeOfCode)
+static void writeELFPheader (FILE* fileptr, size_t sizeOfCode, size_t stackSize)
 {
     ElfW(Phdr) textSection = {};
-    size_t variableBufSize = 300;
+    // runtime buffers and stack are only in memory, not in file
 
     textSection.p_type = SHT_PROGBITS;
     textSection.p_flags = SHF_WRITE | SHF_ALLOC | SHF_EXECINSTR;
     textSection.p_offset = 0x78;
     textSection.p_vaddr = 0x400078;
     textSection.p_filesz = sizeOfCode;
-    textSection.p_memsz = sizeOfCode + variableBufSize;
+    textSection.p_memsz = sizeOfCode + PRINTF_BUF_SIZE + SCANF_BUF_SIZE + stackSize;
     textSection.p_align = 0x1000;
 
     fwrite(&textSection, sizeof (textSection), 1, fileptr);
 }
-static void giveRights (char* fileName)
+// chmod +x, names of any length
+static void giveRights (const char* fileName)
 {
-    char cmdBuf[30] = "";
-    sprintf(cmdBuf, "chmod +x %s", fileName);
-    system (cmdBuf);
+    int error = chmod (fileName, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+    assert (error == 0);
 }
 
-static void linkMyPrintf (FILE* fileptr)
+static unsigned char* readRuntimeFile (const char* fileName, unsigned char* buf, size_t* bufSize)
 {
-    FILE* printfPtr = fopen ("./bin/BinPrintf", "rb");
-    size_t sizeOfFile = fileSize (printfPtr);
+    FILE* fileptr = fopen (fileName, "rb");
+    assert (fileptr != nullptr);
+    size_t sizeOfFile = fileSize (fileptr);
 
-    unsigned char* buf = (unsigned char*) calloc(sizeOfFile, sizeof(unsigned char));
+    buf = (unsigned char*) realloc (buf, *bufSize + sizeOfFile);
     assert (buf != nullptr);
 
+    fread (buf + *bufSize, sizeof (unsigned char), sizeOfFile, fileptr);
+    fclose (fileptr);
+    *bufSize += sizeOfFile;
 
-    fread (buf, sizeof (unsigned char), sizeOfFile, printfPtr);
-    fclose (printfPtr);
-    fwrite (buf, sizeof (unsigned char), sizeOfFile, fileptr);
-
-    free (buf);
+    return buf;
 }
 
-static void linkMyScanf (FILE* fileptr)
+// printf and scanf exactly as they go after x86_array, caller frees
+unsigned char* loadRuntime (size_t* runtimeSize)
 {
-    FILE* scanfPtr = fopen ("./bin/BinScanf", "rb");
-    size_t sizeOfFile = fileSize (scanfPtr);
-
-    unsigned char* buf = (unsigned char*) calloc(sizeOfFile, sizeof(unsigned char));
-    assert (buf != nullptr);
+    assert (runtimeSize != nullptr);
 
-    fread (buf, sizeof (unsigned char), sizeOfFile, scanfPtr);
-    fclose (scanfPtr);
-    fwrite (buf, sizeof (unsigned char), sizeOfFile, fileptr);
-
-    free (buf);
+    *runtimeSize = 0;
+    unsigned char* buf = readRuntimeFile ("./bin/BinPrintf", nullptr, runtimeSize);
+    return readRuntimeFile ("./bin/BinScanf", buf, runtimeSize);
 }
 
-
-void makeElfFile (char* fileName, BinaryTranslator* binTranslator)
+void makeElfFile (const char* fileName, BinaryTranslator* binTranslator)
 {
     FILE* fileptr = fopen (fileName, "wb");
     assert (fileptr != NULL);
 
-    unsigned char BinPrint[] = {0x48, 0x31, 0xdb, 0x48, 0x31, 0xc9, 0x48, 0x89, 0xf8, 0x48, 0xc7, 0xc7, 0x0a, 0x00, 0x00, 0x00, 0x83, 0xf8, 0x00, 0x7d, 0x07, 0xf7, 0xd0, 0x48, 0xff, 0xc0, 0xb1, 0x01, 0x48, 0x31, 0xd2, 0x48, 0xf7, 0xf7, 0x48, 0x83, 0xc2, 0x30, 0x41, 0x88, 0x14, 0x1b, 0x48, 0xff, 0xc3,0x48, 0x83, 0xf8, 0x00, 0x75, 0xE9, 0x80, 0xf9, 0x01, 0x75, 0x08,0x41, 0xc6, 0x04,0x1b,0x2d, 0x48, 0xff, 0xc3, 0x4c, 0x89, 0xe7, 0x49, 0x8d, 0x74, 0x1b, 0xff, 0x48, 0x89, 0xda, 0xe8, 0x19, 0x00, 0x00, 0x00, 0x48, 0xc7, 0xc7, 0x01, 0x00, 0x00, 0x00, 0xb8, 0x01, 0x00, 0x00, 0x00, 0x4c, 0x89, 0xe6, 0x48, 0xc7, 0xc2, 0x05, 0x00, 0x00, 0x00, 0x0f, 0x05, 0xc3, 0x57, 0x8A, 0x06, 0x88, 0x07, 0x48, 0xff, 0xce, 0x48, 0xff, 0xc7, 0x48, 0xff, 0xca, 0x48, 0x83, 0xfa, 0x00, 0x75, 0xED, 0x58, 0xc3, 0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
-    unsigned char BinScanf[] = {0x41, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x50, 0x50, 0x41, 0x56, 0x57, 0x48, 0x31, 0xc0, 0x48, 0x31, 0xff, 0x4c, 0x89, 0xf6, 0x48, 0xc7, 0xc2, 0x14, 0x00, 0x00, 0x00, 0x0f, 0x05, 0x5f, 0x41, 0x5e, 0x58, 0x41, 0x58, 0x41, 0x5d, 0x41, 0x5c, 0x41, 0x5b, 0x41, 0x56, 0x53, 0x50, 0xe8, 0x4c, 0x00, 0x00, 0x00, 0x48, 0x31, 0xc0, 0x48, 0x31, 0xd2, 0x4d, 0x31, 0xc0, 0x48, 0x31, 0xc9, 0x41, 0x8b, 0x06, 0x88, 0xc2, 0x31, 0xc0, 0x88, 0xd0, 0x83, 0xf8, 0x00, 0x83, 0xe8, 0x30, 0x83, 0xf8, 0x00, 0x7c, 0x24, 0x83, 0xf8, 0x09, 0x7f, 0x1f, 0xb5, 0x0a, 0x53, 0x48, 0x83, 0xfb, 0x00, 0x74, 0x08, 0xf6, 0xe5, 0x48, 0x83, 0xeb, 0x01, 0xeb, 0xf2, 0x5b, 0x48, 0x83, 0xeb, 0x01, 0x49, 0x01, 0xc0, 0x49, 0x83, 0xc6, 0x01, 0xeb, 0xc8, 0x4c, 0x89, 0x07, 0x58, 0x5b, 0x41, 0x5e, 0xc3, 0x48, 0x31, 0xdb, 0x41, 0x56, 0x41, 0x8b, 0x06, 0x88, 0xc2, 0x31, 0xc0, 0x88, 0xd0, 0x83, 0xf8, 0x00, 0x83, 0xe8, 0x30, 0x83, 0xf8, 0x00, 0x7c, 0x0f, 0x83, 0xf8, 0x09, 0x7f, 0x0a, 0x49, 0x83, 0xc6, 0x01, 0x48, 0x83, 0xc3, 0x01, 0xeb, 0xdd, 0x48, 0x83, 0xeb, 0x01, 0x41, 0x5e, 0xc3,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00 };
+    size_t runtimeSize = 0;
+    unsigned char* runtime = loadRuntime (&runtimeSize);
 
-    size_t sizeofProg = binTranslator->x86_arraySize+ sizeof (BinPrint) + sizeof (BinScanf) + 16 + 5*2;
+    size_t sizeofProg = binTranslator->code.x86_arraySize + runtimeSize;
 
     writeELFHeader(fileptr);
-    writeELFPheader(fileptr, sizeofProg);
-    fwrite(binTranslator->x86_array, sizeof (unsigned char), binTranslator->x86_arraySize, fileptr);
-    linkMyPrintf(fileptr);
-    linkMyScanf(fileptr);
+    writeELFPheader(fileptr, sizeofProg, binTranslator->stackSize);
+    fwrite(binTranslator->code.x86_array, sizeof (unsigned char), binTranslator->code.x86_arraySize, fileptr);
+    fwrite (runtime, sizeof (unsigned char), runtimeSize, fileptr);
+    free (runtime);
 
+    long elfSize = ftell (fileptr);
     fclose(fileptr);
     giveRights(fileName);
+
+    timePhase (binTranslator, "ELF write", (elfSize > 0) ? (size_t) elfSize : 0);
 }
 
@@ -0,0 +1,2547 @@
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <cstring>
+
+#include "../language/common.h"
+#include "../include/BinaryTranslator.h"
+#include "../include/irUtils.h"
+#include "../include/irOpt.h"
+
+// IR passes that run before register allocation.
+
+// Inlining
+//----------------------------------------
+// Functions are visited callees first, so a callee is inlined with everything
+// already inlined into it. Body of the callee is copied into the caller between
+// the commands before CALL and a continuation block with the commands after it.
+// Callee vars get new indices in the caller frame, PARIN of the call become
+// EQ to copies of callee params and RET becomes EQ to call result and JMP to
+// continuation. Functions that can reach themselves through calls are never
+// inlined, the rest are limited by InlineCalleeBudget, InlineCallerBudget and
+// InlineDepthBudget.
+
+static const size_t InlineCalleeBudget = 40;    // commands of callee
+static const size_t InlineCallerBudget = 2048;  // commands caller may grow to
+static const size_t InlineDepthBudget  = 3;     // bodies inlined into each other
+
+struct Inliner_opt
+{
+    size_t numOfFuncs;
+    bool*   recursive;      // function can reach itself through calls
+    size_t* depth;          // of bodies inlined into function
+    bool*   visited;
+    size_t  numOfInlined;   // names copies of blocks
+};
+
+// Builds one inlined function, cmds and blocks are big enough for all copies
+struct InlineCopy_opt
+{
+    Cmd_bt*   cmds;
+    size_t    numOfCmds;
+    Block_bt* blocks;
+    size_t    numOfBlocks;
+    Var_bt*   vars;
+    size_t    numOfVars;
+    size_t*   pendingParams;    // positions of PARIN that are not taken by CALL yet
+    size_t    numOfPending;
+};
+
+static size_t funcLength (const Func_bt* function)
+{
+    size_t length = 0;
+    for (size_t b = 0; b < function->blockArraySize; b++)
+        length += blockLength (function, &function->blockArray[b]);
+
+    return length;
+}
+
+static bool reachesFunc (const BinaryTranslator* binTranslator, size_t from, size_t target, bool* visited)
+{
+    if (visited[from])
+        return false;
+
+    visited[from] = true;
+    const Func_bt* function = &binTranslator->funcArray[from];
+
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        const Block_bt* block = &function->blockArray[b];
+        const Cmd_bt*   cmds  = blockCmds (function, block);
+
+        for (size_t i = 0; i < block->cmdArraySize; i++)
+        {
+            if (cmds[i].opCode.operation != OP_CALL)
+                continue;
+
+            size_t callee = cmds[i].operator1.value.func;
+            if (callee == target || reachesFunc (binTranslator, callee, target, visited))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+static void inlinerCtor (Inliner_opt* inliner, const BinaryTranslator* binTranslator)
+{
+    size_t numOfFuncs = binTranslator->funcArraySize;
+    inliner->numOfFuncs = numOfFuncs;
+
+    inliner->recursive = (bool*)   calloc (numOfFuncs, sizeof (bool));
+    inliner->depth     = (size_t*) calloc (numOfFuncs, sizeof (size_t));
+    inliner->visited   = (bool*)   calloc (numOfFuncs, sizeof (bool));
+    assert (inliner->recursive != NULL);
+    assert (inliner->depth     != NULL);
+    assert (inliner->visited   != NULL);
+
+    for (size_t f = 0; f < numOfFuncs; f++)
+    {
+        memset (inliner->visited, 0, numOfFuncs * sizeof (bool));
+        inliner->recursive[f] = reachesFunc (binTranslator, f, f, inliner->visited);
+    }
+
+    memset (inliner->visited, 0, numOfFuncs * sizeof (bool));
+}
+
+static void inlinerDtor (Inliner_opt* inliner)
+{
+    free (inliner->recursive);
+    free (inliner->depth);
+    free (inliner->visited);
+}
+
+static bool canInline (const BinaryTranslator* binTranslator, const Inliner_opt* inliner, size_t caller,
+                       size_t callee, size_t callerLength)
+{
+    if (callee == caller || inliner->recursive[callee] || inliner->depth[callee] >= InlineDepthBudget)
+        return false;
+
+    size_t calleeLength = funcLength (&binTranslator->funcArray[callee]);
+
+    return calleeLength <= InlineCalleeBudget && callerLength + calleeLength <= InlineCallerBudget;
+}
+
+static const char* copyName (BinaryTranslator* binTranslator, const char* name, const char* suffix, size_t number)
+{
+    char buf[256] = "";
+    snprintf (buf, sizeof (buf), "%s_%s%lu", name, suffix, number);
+
+    return symName (&binTranslator->symbols, internName (&binTranslator->symbols, buf));
+}
+
+static inline void startBlock (InlineCopy_opt* copy, const char* name)
+{
+    copy->blocks[copy->numOfBlocks++] = {.name = name, .cmdStart = copy->numOfCmds};
+}
+
+static inline void endBlock (InlineCopy_opt* copy)
+{
+    Block_bt* block = &copy->blocks[copy->numOfBlocks - 1];
+
+    block->cmdArraySize     = copy->numOfCmds - block->cmdStart;
+    block->cmdArrayCapacity = block->cmdArraySize;
+}
+
+static inline void copyCmd (InlineCopy_opt* copy, Cmd_bt cmd)
+{
+    copy->cmds[copy->numOfCmds++] = cmd;
+}
+
+static void shiftOperands (Cmd_bt* cmd, size_t varBase, const size_t* newBlock, size_t blockBase)
+{
+    Op_bt* ops[] = {&cmd->operator1, &cmd->operator2, &cmd->dest};
+
+    for (size_t j = 0; j < 3; j++)
+    {
+        if (ops[j]->type == Var_t)
+            ops[j]->value.var = (uint32_t) (ops[j]->value.var + varBase);
+
+        if (ops[j]->type == Pointer_t)
+            ops[j]->value.block = (uint32_t) (newBlock ? newBlock[ops[j]->value.block] : ops[j]->value.block + blockBase);
+    }
+}
+
+// PARIN taken by the call go right before its body and are the last numOfParams pending ones
+static void assignParams (InlineCopy_opt* copy, const Func_bt* callee, size_t varBase)
+{
+    size_t count = numOfParams (callee);
+    assert (copy->numOfPending >= count);
+
+    copy->numOfPending -= count;
+    const size_t* params = copy->pendingParams + copy->numOfPending;
+
+    const Cmd_bt* parOut = blockCmds (callee, &callee->blockArray[0]);
+
+    for (size_t param = 0; param < count; param++)
+    {
+        Cmd_bt* parIn = &copy->cmds[params[count - 1 - param]];
+        *parIn = {.opCode = {.operation = OP_EQ}, .operator1 = parIn->operator1,
+                  .dest = varOp (opVarIndex (parOut[param].dest) + varBase)};
+    }
+}
+
+static void copyCallee (BinaryTranslator* binTranslator, Inliner_opt* inliner, InlineCopy_opt* copy,
+                        const Cmd_bt* call)
+{
+    const Func_bt* callee = &binTranslator->funcArray[call->operator1.value.func];
+
+    size_t varBase = copy->numOfVars;
+    memcpy (copy->vars + varBase, callee->varArray, callee->varArraySize * sizeof (Var_bt));
+    copy->numOfVars += callee->varArraySize;
+
+    assignParams (copy, callee, varBase);
+
+    // Result is written in every copy of RET, rcx would not keep it until continuation
+    Op_bt result = call->dest;
+    if (hasOp (result) && copy->vars[opVarIndex (result)].location == Register)
+        copy->vars[opVarIndex (result)].location = Memory;
+
+    size_t number    = ++inliner->numOfInlined;
+    size_t blockBase = copy->numOfBlocks;
+    Op_bt  cont      = blockOp (blockBase + callee->blockArraySize);
+
+    copyCmd (copy, {.opCode = {.operation = OP_JMP}, .operator1 = blockOp (blockBase)});
+    endBlock (copy);
+
+    for (size_t b = 0; b < callee->blockArraySize; b++)
+    {
+        const Block_bt* block  = &callee->blockArray[b];
+        const Cmd_bt*   cmds   = blockCmds (callee, block);
+        size_t          length = blockLength (callee, block);
+
+        startBlock (copy, copyName (binTranslator, block->name, "INL", number));
+
+        for (size_t i = 0; i < length; i++)
+        {
+            Cmd_bt cmd = cmds[i];
+            if (cmd.opCode.operation == OP_PAROUT)
+                continue;
+
+            shiftOperands (&cmd, varBase, NULL, blockBase);
+
+            if (cmd.opCode.operation == OP_RET)
+            {
+                if (hasOp (result))
+                    copyCmd (copy, {.opCode = {.operation = OP_EQ}, .operator1 = cmd.operator1, .dest = result});
+
+                cmd = {.opCode = {.operation = OP_JMP}, .operator1 = cont};
+            }
+
+            copyCmd (copy, cmd);
+        }
+
+        // Last block without RET runs into epilogue of callee
+        size_t succ[2] = {};
+        bool   returns = length > 0 && cmds[length - 1].opCode.operation == OP_RET;
+        if (!returns && blockSuccessors (callee, b, length, succ) == 0)
+            copyCmd (copy, {.opCode = {.operation = OP_JMP}, .operator1 = cont});
+
+        endBlock (copy);
+    }
+}
+
+// Decides which calls are inlined and counts blocks and commands of the result
+static size_t planInlining (const BinaryTranslator* binTranslator, const Inliner_opt* inliner, size_t index,
+                            bool* inlineCall, size_t* newBlock, size_t* numOfCmds, size_t* numOfVars)
+{
+    const Func_bt* function = &binTranslator->funcArray[index];
+
+    size_t length      = funcLength (function);
+    size_t numOfBlocks = 0;
+    *numOfCmds = length;
+    *numOfVars = function->varArraySize;
+
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        const Block_bt* block = &function->blockArray[b];
+        const Cmd_bt*   cmds  = blockCmds (function, block);
+        newBlock[b] = numOfBlocks++;
+
+        for (size_t i = 0; i < blockLength (function, block); i++)
+        {
+            if (cmds[i].opCode.operation != OP_CALL)
+                continue;
+
+            size_t callee = cmds[i].operator1.value.func;
+            if (!canInline (binTranslator, inliner, index, callee, length))
+                continue;
+
+            const Func_bt* calleeFunc = &binTranslator->funcArray[callee];
+            size_t calleeLength = funcLength (calleeFunc);
+
+            inlineCall[block->cmdStart + i] = true;
+            length      += calleeLength;
+            numOfBlocks += calleeFunc->blockArraySize + 1;
+            *numOfCmds  += 2 * calleeLength + calleeFunc->blockArraySize + 1;
+            *numOfVars  += calleeFunc->varArraySize;
+        }
+    }
+
+    return numOfBlocks;
+}
+
+static void inlineCalls (BinaryTranslator* binTranslator, Inliner_opt* inliner, size_t index)
+{
+    Func_bt* function = &binTranslator->funcArray[index];
+
+    bool*   inlineCall = (bool*)   calloc (function->cmdArraySize + 1, sizeof (bool));
+    size_t* newBlock   = (size_t*) calloc (function->blockArraySize + 1, sizeof (size_t));
+    assert (inlineCall != NULL);
+    assert (newBlock   != NULL);
+
+    size_t numOfCmds   = 0;
+    size_t numOfVars   = 0;
+    size_t numOfBlocks = planInlining (binTranslator, inliner, index, inlineCall, newBlock, &numOfCmds, &numOfVars);
+
+    if (numOfBlocks == function->blockArraySize)
+    {
+        free (inlineCall);
+        free (newBlock);
+        return;
+    }
+
+    InlineCopy_opt copy = {};
+    copy.cmds   = (Cmd_bt*)   arenaAlloc (&function->ctx.arena, numOfCmds * sizeof (Cmd_bt));
+    copy.blocks = (Block_bt*) arenaAlloc (&function->ctx.arena, (numOfBlocks + 1) * sizeof (Block_bt));
+    copy.vars   = (Var_bt*)   arenaAlloc (&function->ctx.arena, (numOfVars + 1) * sizeof (Var_bt));
+    copy.pendingParams = (size_t*) calloc (function->cmdArraySize + 1, sizeof (size_t));
+    assert (copy.pendingParams != NULL);
+
+    memcpy (copy.vars, function->varArray, function->varArraySize * sizeof (Var_bt));
+    copy.numOfVars = function->varArraySize;
+
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        const Block_bt* block = &function->blockArray[b];
+        const Cmd_bt*   cmds  = blockCmds (function, block);
+        size_t          numOfCalls = 0;
+
+        startBlock (&copy, block->name);
+        copy.numOfPending = 0;
+
+        for (size_t i = 0; i < blockLength (function, block); i++)
+        {
+            Cmd_bt cmd = cmds[i];
+            shiftOperands (&cmd, 0, newBlock, 0);
+
+            if (cmd.opCode.operation == OP_PARIN)
+                copy.pendingParams[copy.numOfPending++] = copy.numOfCmds;
+
+            if (cmd.opCode.operation != OP_CALL)
+            {
+                copyCmd (&copy, cmd);
+                continue;
+            }
+
+            size_t callee = cmd.operator1.value.func;
+
+            if (!inlineCall[block->cmdStart + i])
+            {
+                copy.numOfPending -= numOfParams (&binTranslator->funcArray[callee]);
+                copyCmd (&copy, cmd);
+                continue;
+            }
+
+            copyCallee (binTranslator, inliner, &copy, &cmd);
+            startBlock (&copy, copyName (binTranslator, block->name, "RET", ++numOfCalls));
+
+            if (inliner->depth[index] < inliner->depth[callee] + 1)
+                inliner->depth[index] = inliner->depth[callee] + 1;
+        }
+
+        endBlock (&copy);
+    }
+
+    assert (copy.numOfBlocks == numOfBlocks);
+    assert (copy.numOfCmds   <= numOfCmds);
+
+    function->cmdArray           = copy.cmds;
+    function->cmdArraySize       = copy.numOfCmds;
+    function->cmdArrayCapacity   = numOfCmds;
+    function->blockArray         = copy.blocks;
+    function->blockArraySize     = copy.numOfBlocks;
+    function->blockArrayCapacity = numOfBlocks + 1;
+    function->varArray           = copy.vars;
+    function->varArraySize       = copy.numOfVars;
+    function->varArrayCapacity   = numOfVars + 1;
+
+    free (copy.pendingParams);
+    free (inlineCall);
+    free (newBlock);
+}
+
+static void inlineFunc (BinaryTranslator* binTranslator, Inliner_opt* inliner, size_t index)
+{
+    if (inliner->visited[index])
+        return;
+
+    inliner->visited[index] = true;
+    Func_bt* function = &binTranslator->funcArray[index];
+
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        const Block_bt* block = &function->blockArray[b];
+        const Cmd_bt*   cmds  = blockCmds (function, block);
+
+        for (size_t i = 0; i < block->cmdArraySize; i++)
+        {
+            if (cmds[i].opCode.operation == OP_CALL)
+                inlineFunc (binTranslator, inliner, cmds[i].operator1.value.func);
+        }
+    }
+
+    inlineCalls (binTranslator, inliner, index);
+}
+
+static void inlineFunctions (BinaryTranslator* binTranslator)
+{
+    Inliner_opt inliner = {};
+    inlinerCtor (&inliner, binTranslator);
+
+    for (size_t i = 0; i < binTranslator->funcArraySize; i++)
+        inlineFunc (binTranslator, &inliner, i);
+
+    inlinerDtor (&inliner);
+}
+//----------------------------------------
+
+// Tail calls
+//----------------------------------------
+// CALL whose result goes right to RET is a tail call. Tail call of the function
+// itself becomes assignment of params and JMP to the block after PAROUT, so
+// accumulator style recursion runs in one frame. It goes before inlining:
+// function without other calls to itself is not recursive any more. Other tail
+// calls are only marked, translator turns them into jmp.
+
+static bool isTailCall (const Cmd_bt* cmds, size_t length, size_t index)
+{
+    const Cmd_bt* call = &cmds[index];
+    if (call->opCode.operation != OP_CALL || index + 1 >= length || !hasOp (call->dest))
+        return false;
+
+    const Cmd_bt* ret = &cmds[index + 1];
+    return ret->opCode.operation == OP_RET && opVarIndex (ret->operator1) == opVarIndex (call->dest);
+}
+
+static size_t countSelfTailCalls (const Func_bt* function, size_t index)
+{
+    size_t count = 0;
+
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        const Block_bt* block  = &function->blockArray[b];
+        const Cmd_bt*   cmds   = blockCmds (function, block);
+        size_t          length = blockLength (function, block);
+
+        for (size_t i = 0; i < length; i++)
+        {
+            if (isTailCall (cmds, length, i) && cmds[i].operator1.value.func == index)
+                count++;
+        }
+    }
+
+    return count;
+}
+
+// Var is read or written by cmds[from, to)
+static bool isReferenced (const Cmd_bt* cmds, size_t from, size_t to, size_t var)
+{
+    for (size_t i = from; i < to; i++)
+    {
+        size_t uses[2] = {};
+        size_t def     = NoVar;
+        cmdUsesAndDef (&cmds[i], uses, &def);
+
+        if (uses[0] == var || uses[1] == var || def == var)
+            return true;
+    }
+
+    return false;
+}
+
+// PARIN of the call are rewritten in place to EQ to params. Param that is still
+// needed by the following arguments gets its value through a new temp after all
+// of them. Block ends here, RET is dropped
+static size_t assignTailParams (Func_bt* function, Cmd_bt* cmds, size_t pos, const Cmd_bt* oldCmds,
+                                size_t first, const size_t* args, size_t call)
+{
+    size_t        count  = numOfParams (function);
+    const Cmd_bt* parOut = blockCmds (function, &function->blockArray[0]);
+
+    size_t* temps = (size_t*) calloc (count + 1, sizeof (size_t));
+    assert (temps != NULL);
+
+    size_t blockStart = pos - (call - first);
+
+    for (size_t k = 0; k < count; k++)
+    {
+        size_t  param = opVarIndex (parOut[count - 1 - k].dest);
+        Cmd_bt* parIn = &cmds[blockStart + args[k] - first];
+
+        temps[k] = NoVar;
+        if (isReferenced (oldCmds, args[k] + 1, call, param))
+        {
+            assert (function->varArraySize + 1 < function->varArrayCapacity);
+
+            temps[k] = function->varArraySize++;
+            function->varArray[temps[k]]               = {.location = Memory};
+            function->varArray[function->varArraySize] = {};
+        }
+
+        *parIn = {.opCode = {.operation = OP_EQ}, .operator1 = parIn->operator1,
+                  .dest = varOp ((temps[k] == NoVar) ? param : temps[k])};
+    }
+
+    for (size_t k = 0; k < count; k++)
+    {
+        if (temps[k] != NoVar)
+            cmds[pos++] = {.opCode = {.operation = OP_EQ}, .operator1 = varOp (temps[k]),
+                           .dest = varOp (opVarIndex (parOut[count - 1 - k].dest))};
+    }
+
+    cmds[pos++] = {.opCode = {.operation = OP_JMP}, .operator1 = blockOp (1)};
+
+    free (temps);
+    return pos;
+}
+
+// Block 0 keeps only PAROUT, the rest of it becomes block 1 that tail calls jump to
+static void eliminateTailRecursion (BinaryTranslator* binTranslator, size_t index)
+{
+    Func_bt* function   = &binTranslator->funcArray[index];
+    size_t   numOfSites = countSelfTailCalls (function, index);
+    if (numOfSites == 0)
+        return;
+
+    size_t params      = numOfParams (function);
+    size_t numOfCmds   = function->cmdArraySize + numOfSites * (params + 1);
+    size_t numOfBlocks = function->blockArraySize + 1;
+    size_t numOfVars   = function->varArrayCapacity + numOfSites * params;
+
+    Cmd_bt*   cmds   = (Cmd_bt*)   arenaAlloc (&function->ctx.arena, numOfCmds * sizeof (Cmd_bt));
+    Block_bt* blocks = (Block_bt*) arenaAlloc (&function->ctx.arena, (numOfBlocks + 1) * sizeof (Block_bt));
+    size_t*   args   = (size_t*)   calloc (function->cmdArraySize + 1, sizeof (size_t));
+    assert (args != NULL);
+
+    function->varArray = (Var_bt*) arenaRealloc (&function->ctx.arena, function->varArray,
+                                                 function->varArrayCapacity * sizeof (Var_bt), numOfVars * sizeof (Var_bt));
+    function->varArrayCapacity = numOfVars;
+
+    memcpy (cmds, blockCmds (function, &function->blockArray[0]), params * sizeof (Cmd_bt));
+    blocks[0] = {.name = function->blockArray[0].name, .cmdArraySize = params, .cmdArrayCapacity = params};
+    size_t pos = params;
+
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        const Block_bt* block   = &function->blockArray[b];
+        const Cmd_bt*   oldCmds = blockCmds (function, block);
+        size_t          length  = blockLength (function, block);
+        size_t          first   = (b == 0) ? params : 0;
+        size_t          start   = pos;
+        size_t          numOfArgs = 0;
+
+        for (size_t i = first; i < length; i++)
+        {
+            Cmd_bt cmd = oldCmds[i];
+
+            Op_bt* ops[] = {&cmd.operator1, &cmd.operator2};
+            for (size_t j = 0; j < 2; j++)
+            {
+                if (ops[j]->type == Pointer_t)
+                    ops[j]->value.block += 1;
+            }
+
+            if (cmd.opCode.operation == OP_PARIN)
+                args[numOfArgs++] = i;
+
+            if (cmd.opCode.operation == OP_CALL)
+                numOfArgs -= numOfParams (&binTranslator->funcArray[cmd.operator1.value.func]);
+
+            if (isTailCall (oldCmds, length, i) && cmd.operator1.value.func == index)
+            {
+                pos = assignTailParams (function, cmds, pos, oldCmds, first, args + numOfArgs, i);
+                break;
+            }
+
+            cmds[pos++] = cmd;
+        }
+
+        const char* name = (b == 0) ? copyName (binTranslator, function->name, "BODY", 0) : block->name;
+        blocks[b + 1] = {.name = name, .cmdStart = start, .cmdArraySize = pos - start, .cmdArrayCapacity = pos - start};
+    }
+
+    function->cmdArray           = cmds;
+    function->cmdArraySize       = pos;
+    function->cmdArrayCapacity   = numOfCmds;
+    function->blockArray         = blocks;
+    function->blockArraySize     = numOfBlocks;
+    function->blockArrayCapacity = numOfBlocks + 1;
+
+    free (args);
+}
+
+static void markTailCalls (Func_bt* function)
+{
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        Block_bt* block  = &function->blockArray[b];
+        Cmd_bt*   cmds   = blockCmds (function, block);
+        size_t    length = blockLength (function, block);
+
+        for (size_t i = 0; i < length; i++)
+            cmds[i].opCode.tail = isTailCall (cmds, length, i);
+    }
+}
+//----------------------------------------
+
+// Constant propagation
+//----------------------------------------
+// Values are tracked as 32 bit, the same width immediates, OUT, DIV and the test
+// of IF have, so a folded value matches the low half of the register.
+// Calls can't change caller's variables, they live in its rbp frame and the
+// callee makes its own frame below it on the machine stack.
+
+enum CONST_STATE
+{
+    CONST_UNDEF   = 0,  // no path reached this point yet
+    CONST_KNOWN   = 1,
+    CONST_UNKNOWN = 2,
+};
+
+struct ConstVal_opt
+{
+    CONST_STATE state;
+    int value;
+};
+
+struct ConstProp_opt
+{
+    size_t numOfBlocks;
+    size_t numOfVars;
+    size_t (*succ)[2];
+    size_t* numOfSucc;
+    bool*   reached;
+    ConstVal_opt* in;
+    ConstVal_opt* out;
+};
+
+static const ConstVal_opt UnknownVal = {CONST_UNKNOWN, 0};
+
+static ConstVal_opt meetVal (ConstVal_opt first, ConstVal_opt second)
+{
+    if (first.state == CONST_UNDEF)
+        return second;
+
+    if (second.state == CONST_UNDEF)
+        return first;
+
+    if (first.state == CONST_KNOWN && second.state == CONST_KNOWN && first.value == second.value)
+        return first;
+
+    return UnknownVal;
+}
+
+static bool sameVal (ConstVal_opt first, ConstVal_opt second)
+{
+    return first.state == second.state && (first.state != CONST_KNOWN || first.value == second.value);
+}
+
+static ConstVal_opt operandVal (Op_bt op, const ConstVal_opt* vals)
+{
+    if (op.type == Num_t)
+        return {CONST_KNOWN, op.value.num};
+
+    size_t var = opVarIndex (op);
+    if (var == NoVar)
+        return UnknownVal;
+
+    return vals[var];
+}
+
+static inline int wrap32 (int64_t value)
+{
+    return (int) (uint32_t) (uint64_t) value;
+}
+
+static ConstVal_opt foldArithm (unsigned int operation, ConstVal_opt first, ConstVal_opt second)
+{
+    if (first.state != CONST_KNOWN || second.state != CONST_KNOWN)
+        return UnknownVal;
+
+    int64_t a = first.value;
+    int64_t b = second.value;
+
+    switch (operation)
+    {
+        case OP_ADD:
+            return {CONST_KNOWN, wrap32 (a + b)};
+
+        case OP_SUB:
+            return {CONST_KNOWN, wrap32 (a - b)};
+
+        case OP_MUL:
+            return {CONST_KNOWN, wrap32 (a * b)};
+
+        // Signed and rounded toward zero, division by zero is left to fault at run time
+        case OP_DIV:
+            if (b == 0)
+                return UnknownVal;
+
+            return {CONST_KNOWN, wrap32 (a / b)};
+
+        default:
+            assert (0);
+    }
+
+    return UnknownVal;
+}
+
+static void removeCmd (Func_bt* function, Block_bt* block, size_t index)
+{
+    assert (index < block->cmdArraySize);
+
+    Cmd_bt* cmd = &blockCmds (function, block)[index];
+    memmove (cmd, cmd + 1, (block->cmdArraySize - index - 1) * sizeof (*cmd));
+    block->cmdArraySize -= 1;
+}
+
+static bool replaceWithNum (Op_bt* op, const ConstVal_opt* vals)
+{
+    size_t var = opVarIndex (*op);
+    if (var == NoVar || vals[var].state != CONST_KNOWN)
+        return false;
+
+    *op = numOp (vals[var].value);
+    return true;
+}
+
+static bool substituteUses (Cmd_bt* cmd, const ConstVal_opt* vals)
+{
+    bool changed = false;
+
+    switch (cmd->opCode.operation)
+    {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+            changed |= replaceWithNum (&cmd->operator1, vals);
+            changed |= replaceWithNum (&cmd->operator2, vals);
+            break;
+
+        case OP_EQ:
+        case OP_RET:
+        case OP_PARIN:
+        case OP_OUT:
+            changed |= replaceWithNum (&cmd->operator1, vals);
+            break;
+
+        case OP_IF:
+            changed |= replaceWithNum (&cmd->dest, vals);
+            break;
+
+        default:
+            break;
+    }
+
+    return changed;
+}
+
+// Returns false if IF was removed and nothing took its place
+static bool resolveIf (Func_bt* function, Block_bt* block, size_t index, int condition)
+{
+    Cmd_bt* cmd = &blockCmds (function, block)[index];
+
+    Op_bt target = (condition == 0) ? cmd->operator2 : cmd->operator1;
+
+    // IF without else block just falls through
+    if (!hasOp (target))
+    {
+        removeCmd (function, block, index);
+        return false;
+    }
+
+    *cmd = {.opCode = {.operation = OP_JMP}, .operator1 = target};
+    return true;
+}
+
+// Walks block with vals as the state on entry. With rewrite it replaces known
+// operands with numbers, drops arithmetic that was folded and turns IF on a
+// constant into JMP.
+static bool evalBlock (Func_bt* function, size_t index, ConstVal_opt* vals, bool rewrite)
+{
+    Block_bt* block  = &function->blockArray[index];
+    Cmd_bt*   cmds   = blockCmds (function, block);
+    size_t    length = blockLength (function, block);
+    bool      changed = false;
+
+    for (size_t i = 0; i < length;)
+    {
+        Cmd_bt* cmd = &cmds[i];
+        unsigned int operation = cmd->opCode.operation;
+
+        if (rewrite)
+            changed |= substituteUses (cmd, vals);
+
+        size_t uses[2] = {};
+        size_t def     = NoVar;
+        cmdUsesAndDef (cmd, uses, &def);
+
+        ConstVal_opt result = UnknownVal;
+
+        switch (operation)
+        {
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+                result = foldArithm (operation, operandVal (cmd->operator1, vals),
+                                                operandVal (cmd->operator2, vals));
+                break;
+
+            case OP_EQ:
+                result = operandVal (cmd->operator1, vals);
+                break;
+
+            case OP_IF:
+            {
+                ConstVal_opt condition = operandVal (cmd->dest, vals);
+                if (rewrite && condition.state == CONST_KNOWN)
+                {
+                    changed = true;
+                    bool kept = resolveIf (function, block, i, condition.value);
+                    length = blockLength (function, block);
+
+                    if (!kept)
+                        continue;
+                }
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        if (def != NoVar)
+            vals[def] = result;
+
+        // Every use of a stack temp is in the same block after it and is already a number then
+        if (rewrite && result.state == CONST_KNOWN && operation != OP_EQ &&
+            function->varArray[def].location == Stack)
+        {
+            removeCmd (function, block, i);
+            length -= 1;
+            changed = true;
+            continue;
+        }
+
+        i++;
+    }
+
+    return changed;
+}
+
+static void constPropCtor (ConstProp_opt* prop, const Func_bt* function)
+{
+    prop->numOfBlocks = function->blockArraySize;
+    prop->numOfVars   = function->varArraySize;
+
+    prop->succ      = (size_t (*)[2]) calloc (prop->numOfBlocks, sizeof (*prop->succ));
+    prop->numOfSucc = (size_t*) calloc (prop->numOfBlocks, sizeof (size_t));
+    prop->reached   = (bool*)   calloc (prop->numOfBlocks, sizeof (bool));
+    assert (prop->succ      != NULL);
+    assert (prop->numOfSucc != NULL);
+    assert (prop->reached   != NULL);
+
+    size_t setSize = prop->numOfBlocks * prop->numOfVars + 1;
+    prop->in  = (ConstVal_opt*) calloc (setSize, sizeof (ConstVal_opt));
+    prop->out = (ConstVal_opt*) calloc (setSize, sizeof (ConstVal_opt));
+    assert (prop->in  != NULL);
+    assert (prop->out != NULL);
+
+    for (size_t b = 0; b < prop->numOfBlocks; b++)
+    {
+        const Block_bt* block = &function->blockArray[b];
+        prop->numOfSucc[b] = blockSuccessors (function, b, blockLength (function, block), prop->succ[b]);
+    }
+}
+
+static void constPropDtor (ConstProp_opt* prop)
+{
+    free (prop->succ);
+    free (prop->numOfSucc);
+    free (prop->reached);
+    free (prop->in);
+    free (prop->out);
+}
+
+// Block is skipped while none of its predecessors is reached
+static bool computeBlockIn (ConstProp_opt* prop, size_t index)
+{
+    size_t numOfVars = prop->numOfVars;
+    ConstVal_opt* in = prop->in + index * numOfVars;
+
+    if (index == 0)
+    {
+        for (size_t v = 0; v < numOfVars; v++)
+            in[v] = UnknownVal;
+
+        return true;
+    }
+
+    bool isReached = false;
+    for (size_t v = 0; v < numOfVars; v++)
+        in[v] = {CONST_UNDEF, 0};
+
+    for (size_t pred = 0; pred < prop->numOfBlocks; pred++)
+    {
+        if (!prop->reached[pred])
+            continue;
+
+        for (size_t s = 0; s < prop->numOfSucc[pred]; s++)
+        {
+            if (prop->succ[pred][s] != index)
+                continue;
+
+            isReached = true;
+            const ConstVal_opt* predOut = prop->out + pred * numOfVars;
+
+            for (size_t v = 0; v < numOfVars; v++)
+                in[v] = meetVal (in[v], predOut[v]);
+        }
+    }
+
+    return isReached;
+}
+
+static bool propagateConstants (Func_bt* function)
+{
+    ConstProp_opt prop = {};
+    constPropCtor (&prop, function);
+
+    size_t numOfVars = prop.numOfVars;
+    ConstVal_opt* vals = (ConstVal_opt*) calloc (numOfVars + 1, sizeof (ConstVal_opt));
+    assert (vals != NULL);
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        for (size_t b = 0; b < prop.numOfBlocks; b++)
+        {
+            if (!computeBlockIn (&prop, b))
+                continue;
+
+            memcpy (vals, prop.in + b * numOfVars, numOfVars * sizeof (*vals));
+            evalBlock (function, b, vals, false);
+
+            ConstVal_opt* out = prop.out + b * numOfVars;
+            for (size_t v = 0; v < numOfVars; v++)
+            {
+                if (!sameVal (out[v], vals[v]))
+                {
+                    out[v]  = vals[v];
+                    changed = true;
+                }
+            }
+
+            if (!prop.reached[b])
+            {
+                prop.reached[b] = true;
+                changed = true;
+            }
+        }
+    }
+
+    bool rewritten = false;
+    for (size_t b = 0; b < prop.numOfBlocks; b++)
+    {
+        if (!prop.reached[b])
+            continue;
+
+        memcpy (vals, prop.in + b * numOfVars, numOfVars * sizeof (*vals));
+        rewritten |= evalBlock (function, b, vals, true);
+    }
+
+    free (vals);
+    constPropDtor (&prop);
+
+    return rewritten;
+}
+//----------------------------------------
+
+// Value numbering
+//----------------------------------------
+// SSA is built over the blocks without renaming vars: every definition gets a
+// new value number and so does every var at the blocks where it needs a phi,
+// the iterated dominance frontier of the blocks that define it (MERGE blocks
+// and the loop of eliminated tail recursion). Blocks are walked down the
+// dominator tree with a scoped table of expressions over value numbers. An
+// expression that a dominating command already computed becomes a copy of the
+// var that holds it, and a stack temp with that value is read right from the
+// holder. A var is only taken as holder while its current value number is
+// still the one of the expression, so going out of SSA needs no copies at phis.
+
+struct ValueKey_opt
+{
+    unsigned int operation;     // OP_EQ for a number alone
+    Type    firstType;          // Num_t for a number, Var_t for a value number
+    int64_t first;
+    Type    secondType;
+    int64_t second;
+};
+
+struct ValueEntry_opt
+{
+    ValueKey_opt key;
+    size_t value;
+    size_t holder;              // var that keeps the value, NoVar if none
+    size_t next;                // in bucket
+};
+
+struct ValueNumbering_opt
+{
+    Func_bt* function;
+    Dominators_ir dom;
+    size_t  numOfBlocks;
+    size_t  numOfVars;
+    bool*   phi;                // numOfBlocks * numOfVars, var gets new value on block entry
+    size_t* firstChild;         // in dominator tree
+    size_t* nextSibling;
+    size_t* varValue;           // current value number of every var
+    size_t* readFrom;           // holder for stack temp whose value it already keeps
+    size_t  numOfValues;
+    size_t* undo;               // pairs of var and its previous value number
+    size_t  numOfUndo;
+    ValueEntry_opt* entries;    // scoped, newest is the head of its bucket
+    size_t  numOfEntries;
+    size_t* buckets;
+    size_t  numOfBuckets;
+};
+
+static const size_t ValueBuckets = 256;
+
+static void valueNumberingCtor (ValueNumbering_opt* vn, Func_bt* function)
+{
+    vn->function    = function;
+    vn->numOfBlocks = function->blockArraySize;
+    vn->numOfVars   = function->varArraySize;
+    dominatorsCtor (&vn->dom, function);
+
+    size_t numOfCmds = function->cmdArraySize;
+
+    vn->phi          = (bool*)   calloc (vn->numOfBlocks * vn->numOfVars + 1, sizeof (bool));
+    vn->firstChild   = (size_t*) calloc (vn->numOfBlocks + 1, sizeof (size_t));
+    vn->nextSibling  = (size_t*) calloc (vn->numOfBlocks + 1, sizeof (size_t));
+    vn->varValue     = (size_t*) calloc (vn->numOfVars + 1, sizeof (size_t));
+    vn->readFrom     = (size_t*) calloc (vn->numOfVars + 1, sizeof (size_t));
+    vn->undo         = (size_t*) calloc (2 * (numOfCmds + vn->numOfBlocks * vn->numOfVars) + 1, sizeof (size_t));
+    vn->entries      = (ValueEntry_opt*) calloc (numOfCmds + 1, sizeof (ValueEntry_opt));
+    vn->numOfBuckets = ValueBuckets;
+    vn->buckets      = (size_t*) calloc (vn->numOfBuckets, sizeof (size_t));
+    assert (vn->phi         != NULL);
+    assert (vn->firstChild  != NULL);
+    assert (vn->nextSibling != NULL);
+    assert (vn->varValue    != NULL);
+    assert (vn->readFrom    != NULL);
+    assert (vn->undo        != NULL);
+    assert (vn->entries     != NULL);
+    assert (vn->buckets     != NULL);
+
+    for (size_t b = 0; b < vn->numOfBuckets; b++)
+        vn->buckets[b] = NoVar;
+
+    for (size_t v = 0; v < vn->numOfVars; v++)
+    {
+        vn->varValue[v] = vn->numOfValues++;
+        vn->readFrom[v] = NoVar;
+    }
+
+    for (size_t b = 0; b < vn->numOfBlocks; b++)
+    {
+        vn->firstChild[b]  = NoBlock;
+        vn->nextSibling[b] = NoBlock;
+    }
+
+    // Children are linked in reverse, so walk goes in reverse postorder
+    for (size_t i = vn->dom.numOfOrdered; i-- > 1;)
+    {
+        size_t b      = vn->dom.order[i];
+        size_t parent = vn->dom.idom[b];
+
+        vn->nextSibling[b]      = vn->firstChild[parent];
+        vn->firstChild[parent]  = b;
+    }
+}
+
+static void valueNumberingDtor (ValueNumbering_opt* vn)
+{
+    dominatorsDtor (&vn->dom);
+    free (vn->phi);
+    free (vn->firstChild);
+    free (vn->nextSibling);
+    free (vn->varValue);
+    free (vn->readFrom);
+    free (vn->undo);
+    free (vn->entries);
+    free (vn->buckets);
+}
+
+// Cytron et al.: frontier of b are the blocks where b stops dominating
+static void placePhis (ValueNumbering_opt* vn)
+{
+    size_t numOfBlocks = vn->numOfBlocks;
+    size_t numOfVars   = vn->numOfVars;
+    const Dominators_ir* dom = &vn->dom;
+
+    bool*   frontier = (bool*)   calloc (numOfBlocks * numOfBlocks + 1, sizeof (bool));
+    bool*   defines  = (bool*)   calloc (numOfBlocks * numOfVars + 1, sizeof (bool));
+    size_t* worklist = (size_t*) calloc (numOfBlocks + 1, sizeof (size_t));
+    bool*   queued   = (bool*)   calloc (numOfBlocks + 1, sizeof (bool));
+    assert (frontier != NULL);
+    assert (defines  != NULL);
+    assert (worklist != NULL);
+    assert (queued   != NULL);
+
+    for (size_t b = 0; b < numOfBlocks; b++)
+    {
+        if (dom->idom[b] == NoBlock || dom->predStart[b + 1] - dom->predStart[b] < 2)
+            continue;
+
+        for (size_t p = dom->predStart[b]; p < dom->predStart[b + 1]; p++)
+        {
+            size_t runner = dom->preds[p];
+            if (dom->idom[runner] == NoBlock)
+                continue;
+
+            while (runner != dom->idom[b])
+            {
+                frontier[runner * numOfBlocks + b] = true;
+                if (runner == 0)
+                    break;
+
+                runner = dom->idom[runner];
+            }
+        }
+    }
+
+    for (size_t b = 0; b < numOfBlocks; b++)
+    {
+        const Block_bt* block = &vn->function->blockArray[b];
+        const Cmd_bt*   cmds  = blockCmds (vn->function, block);
+        size_t          length = blockLength (vn->function, block);
+
+        for (size_t i = 0; i < length; i++)
+        {
+            size_t uses[2] = {};
+            size_t def     = NoVar;
+            cmdUsesAndDef (&cmds[i], uses, &def);
+
+            if (def != NoVar)
+                defines[b * numOfVars + def] = true;
+        }
+    }
+
+    for (size_t v = 0; v < numOfVars; v++)
+    {
+        size_t numOfQueued = 0;
+        memset (queued, 0, numOfBlocks * sizeof (bool));
+
+        for (size_t b = 0; b < numOfBlocks; b++)
+        {
+            if (defines[b * numOfVars + v])
+            {
+                worklist[numOfQueued++] = b;
+                queued[b] = true;
+            }
+        }
+
+        while (numOfQueued > 0)
+        {
+            size_t b = worklist[--numOfQueued];
+
+            for (size_t f = 0; f < numOfBlocks; f++)
+            {
+                if (!frontier[b * numOfBlocks + f] || vn->phi[f * numOfVars + v])
+                    continue;
+
+                vn->phi[f * numOfVars + v] = true;
+                if (!queued[f])
+                {
+                    worklist[numOfQueued++] = f;
+                    queued[f] = true;
+                }
+            }
+        }
+    }
+
+    free (frontier);
+    free (defines);
+    free (worklist);
+    free (queued);
+}
+
+static void setValue (ValueNumbering_opt* vn, size_t var, size_t value)
+{
+    vn->undo[vn->numOfUndo++] = var;
+    vn->undo[vn->numOfUndo++] = vn->varValue[var];
+    vn->varValue[var] = value;
+}
+
+static void operandKey (const ValueNumbering_opt* vn, Op_bt op, Type* type, int64_t* key)
+{
+    if (op.type == Num_t)
+    {
+        *type = Num_t;
+        *key  = op.value.num;
+        return;
+    }
+
+    *type = Var_t;
+    *key  = (int64_t) vn->varValue[opVarIndex (op)];
+}
+
+static ValueKey_opt exprKey (const ValueNumbering_opt* vn, const Cmd_bt* cmd)
+{
+    ValueKey_opt key = {.operation = cmd->opCode.operation};
+    operandKey (vn, cmd->operator1, &key.firstType,  &key.first);
+    operandKey (vn, cmd->operator2, &key.secondType, &key.second);
+
+    bool commutative = key.operation == OP_ADD || key.operation == OP_MUL;
+    if (commutative && (key.firstType > key.secondType || (key.firstType == key.secondType && key.first > key.second)))
+    {
+        Type    type  = key.firstType;
+        int64_t value = key.first;
+        key.firstType  = key.secondType;
+        key.first      = key.second;
+        key.secondType = type;
+        key.second     = value;
+    }
+
+    return key;
+}
+
+static size_t hashKey (const ValueNumbering_opt* vn, const ValueKey_opt* key)
+{
+    uint64_t hash = key->operation;
+    hash = hash * 31 + (uint64_t) key->firstType;
+    hash = hash * 1000003 + (uint64_t) key->first;
+    hash = hash * 31 + (uint64_t) key->secondType;
+    hash = hash * 1000003 + (uint64_t) key->second;
+
+    return (size_t) (hash % vn->numOfBuckets);
+}
+
+static ValueEntry_opt* findValue (ValueNumbering_opt* vn, const ValueKey_opt* key)
+{
+    for (size_t e = vn->buckets[hashKey (vn, key)]; e != NoVar; e = vn->entries[e].next)
+    {
+        const ValueKey_opt* other = &vn->entries[e].key;
+        if (other->operation  == key->operation  &&
+            other->firstType  == key->firstType  && other->first  == key->first &&
+            other->secondType == key->secondType && other->second == key->second)
+            return &vn->entries[e];
+    }
+
+    return NULL;
+}
+
+static void addValue (ValueNumbering_opt* vn, const ValueKey_opt* key, size_t value, size_t holder)
+{
+    size_t bucket = hashKey (vn, key);
+
+    vn->entries[vn->numOfEntries] = {.key = *key, .value = value, .holder = holder, .next = vn->buckets[bucket]};
+    vn->buckets[bucket] = vn->numOfEntries++;
+}
+
+static size_t numValue (ValueNumbering_opt* vn, int num)
+{
+    ValueKey_opt key = {.operation = OP_EQ, .firstType = Num_t, .first = num};
+
+    ValueEntry_opt* entry = findValue (vn, &key);
+    if (entry != NULL)
+        return entry->value;
+
+    addValue (vn, &key, vn->numOfValues, NoVar);
+    return vn->numOfValues++;
+}
+
+// Call result in rcx can't be read twice
+static bool holdsValue (const ValueNumbering_opt* vn, const ValueEntry_opt* entry)
+{
+    return entry->holder != NoVar && vn->varValue[entry->holder] == entry->value &&
+           vn->function->varArray[entry->holder].location != Register;
+}
+
+// PARIN of a stack temp takes it right from the stack, so it keeps the copy
+static void readFromHolders (const ValueNumbering_opt* vn, Cmd_bt* cmd)
+{
+    Op_bt* ops[] = {&cmd->operator1, &cmd->operator2, &cmd->dest};
+    size_t numOfOps = (cmd->opCode.operation == OP_IF) ? 3 : 2;
+
+    if (cmd->opCode.operation == OP_PARIN)
+        return;
+
+    for (size_t j = 0; j < numOfOps; j++)
+    {
+        size_t var = opVarIndex (*ops[j]);
+        if (var == NoVar || vn->readFrom[var] == NoVar)
+            continue;
+
+        size_t holder = vn->readFrom[var];
+        if (vn->varValue[holder] == vn->varValue[var])
+            *ops[j] = varOp (holder);
+    }
+}
+
+static bool numberCmd (ValueNumbering_opt* vn, Cmd_bt* cmd)
+{
+    unsigned int operation = cmd->opCode.operation;
+
+    if (operation != OP_PAROUT && operation != OP_CALL && operation != OP_IN)
+        readFromHolders (vn, cmd);
+
+    size_t uses[2] = {};
+    size_t def     = NoVar;
+    cmdUsesAndDef (cmd, uses, &def);
+
+    if (def == NoVar)
+        return false;
+
+    switch (operation)
+    {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        {
+            ValueKey_opt    key   = exprKey (vn, cmd);
+            ValueEntry_opt* entry = findValue (vn, &key);
+
+            if (entry == NULL)
+            {
+                addValue (vn, &key, vn->numOfValues, def);
+                setValue (vn, def, vn->numOfValues++);
+                return false;
+            }
+
+            size_t value = entry->value;
+            if (!holdsValue (vn, entry))
+            {
+                addValue (vn, &key, value, def);
+                setValue (vn, def, value);
+                return false;
+            }
+
+            // Holder is read again, so it can't stay on the stack
+            Var_bt* holder = &vn->function->varArray[entry->holder];
+            if (holder->location == Stack)
+                holder->location = Memory;
+
+            if (vn->function->varArray[def].location == Stack)
+                vn->readFrom[def] = entry->holder;
+
+            *cmd = {.opCode = {.operation = OP_EQ}, .operator1 = varOp (entry->holder), .dest = cmd->dest};
+            setValue (vn, def, value);
+            return true;
+        }
+
+        case OP_EQ:
+            if (cmd->operator1.type == Num_t)
+                setValue (vn, def, numValue (vn, cmd->operator1.value.num));
+            else
+                setValue (vn, def, vn->varValue[opVarIndex (cmd->operator1)]);
+            return false;
+
+        default:
+            setValue (vn, def, vn->numOfValues++);
+            return false;
+    }
+}
+
+static bool numberBlock (ValueNumbering_opt* vn, size_t index)
+{
+    size_t undoMark  = vn->numOfUndo;
+    size_t entryMark = vn->numOfEntries;
+    bool   changed   = false;
+
+    for (size_t v = 0; v < vn->numOfVars; v++)
+    {
+        if (vn->phi[index * vn->numOfVars + v])
+            setValue (vn, v, vn->numOfValues++);
+    }
+
+    Block_bt* block  = &vn->function->blockArray[index];
+    Cmd_bt*   cmds   = blockCmds (vn->function, block);
+    size_t    length = blockLength (vn->function, block);
+
+    for (size_t i = 0; i < length; i++)
+        changed |= numberCmd (vn, &cmds[i]);
+
+    for (size_t child = vn->firstChild[index]; child != NoBlock; child = vn->nextSibling[child])
+        changed |= numberBlock (vn, child);
+
+    while (vn->numOfEntries > entryMark)
+    {
+        ValueEntry_opt* entry = &vn->entries[--vn->numOfEntries];
+        vn->buckets[hashKey (vn, &entry->key)] = entry->next;
+    }
+
+    while (vn->numOfUndo > undoMark)
+    {
+        vn->numOfUndo -= 2;
+        vn->varValue[vn->undo[vn->numOfUndo]] = vn->undo[vn->numOfUndo + 1];
+    }
+
+    return changed;
+}
+
+static bool numberValues (Func_bt* function)
+{
+    if (function->blockArraySize == 0)
+        return false;
+
+    ValueNumbering_opt vn = {};
+    valueNumberingCtor (&vn, function);
+    placePhis (&vn);
+
+    bool changed = numberBlock (&vn, 0);
+
+    valueNumberingDtor (&vn);
+    return changed;
+}
+//----------------------------------------
+
+// Loops
+//----------------------------------------
+// Natural loops are found by back edges into a block that dominates their
+// source, inner loops go first. Loop is only changed if it has a preheader:
+// the only block outside of it that enters the header and has no other
+// successor. WHILE and eliminated tail recursion always have one.
+//
+// Arithmetic over operands that the loop doesn't change moves to the end of
+// the preheader. Its dest has to be defined once in the loop, be dead on entry
+// to the header and either be dead at the exits or be set in a block that
+// dominates all exiting ones. Moved stack temps go to memory.
+//
+// Var whose only definition in the loop adds a number to it is a basic
+// induction variable. MUL of it by a number becomes a copy of a new var that
+// gets the product in the preheader and the step times the number right after
+// every update of the induction variable.
+
+struct Loop_opt
+{
+    size_t header;
+    size_t preheader;
+    size_t size;            // blocks in the loop
+    bool*  body;            // numOfBlocks, block is in the loop
+};
+
+// Changes of one loop, applied to cmdArray by rebuildLoop
+struct LoopEdit_opt
+{
+    bool*   moved;          // by index in cmdArray, commands that leave their block
+    Cmd_bt* preheaderCmds;  // go before the terminator of the preheader
+    size_t  numOfPreheaderCmds;
+    Cmd_bt* inserted;       // inserted[k] goes right after cmdArray[insertedAfter[k]]
+    size_t* insertedAfter;
+    size_t  numOfInserted;
+};
+
+static size_t findPreheader (const Func_bt* function, const Dominators_ir* dom, const Loop_opt* loop)
+{
+    size_t preheader = NoBlock;
+
+    for (size_t p = dom->predStart[loop->header]; p < dom->predStart[loop->header + 1]; p++)
+    {
+        size_t pred = dom->preds[p];
+        if (loop->body[pred] || dom->idom[pred] == NoBlock)
+            continue;
+
+        if (preheader != NoBlock && preheader != pred)
+            return NoBlock;
+
+        preheader = pred;
+    }
+
+    if (preheader == NoBlock)
+        return NoBlock;
+
+    const Block_bt* block  = &function->blockArray[preheader];
+    size_t          length = blockLength (function, block);
+    size_t          succ[2] = {};
+
+    if (blockSuccessors (function, preheader, length, succ) != 1)
+        return NoBlock;
+
+    if (length > 0 && blockCmds (function, block)[length - 1].opCode.operation == OP_IF)
+        return NoBlock;
+
+    return preheader;
+}
+
+// Back edges into one header make one loop
+static size_t findLoops (const Func_bt* function, const Dominators_ir* dom, Loop_opt* loops)
+{
+    size_t numOfBlocks = function->blockArraySize;
+    size_t numOfLoops  = 0;
+
+    size_t* stack = (size_t*) calloc (numOfBlocks + 1, sizeof (size_t));
+    assert (stack != NULL);
+
+    // Nothing jumps to the entry block
+    for (size_t h = 1; h < numOfBlocks; h++)
+    {
+        if (dom->idom[h] == NoBlock)
+            continue;
+
+        Loop_opt loop  = {.header = h, .preheader = NoBlock};
+        size_t   stackSize = 0;
+
+        for (size_t p = dom->predStart[h]; p < dom->predStart[h + 1]; p++)
+        {
+            size_t pred = dom->preds[p];
+            if (!dominates (dom, h, pred))
+                continue;
+
+            if (loop.body == NULL)
+            {
+                loop.body = (bool*) calloc (numOfBlocks, sizeof (bool));
+                assert (loop.body != NULL);
+
+                loop.body[h] = true;
+                loop.size    = 1;
+            }
+
+            if (!loop.body[pred])
+            {
+                loop.body[pred] = true;
+                loop.size += 1;
+                stack[stackSize++] = pred;
+            }
+        }
+
+        if (loop.body == NULL)
+            continue;
+
+        while (stackSize > 0)
+        {
+            size_t b = stack[--stackSize];
+
+            for (size_t p = dom->predStart[b]; p < dom->predStart[b + 1]; p++)
+            {
+                size_t pred = dom->preds[p];
+                if (loop.body[pred] || dom->idom[pred] == NoBlock)
+                    continue;
+
+                loop.body[pred] = true;
+                loop.size += 1;
+                stack[stackSize++] = pred;
+            }
+        }
+
+        loop.preheader = findPreheader (function, dom, &loop);
+        if (loop.preheader == NoBlock)
+        {
+            free (loop.body);
+            continue;
+        }
+
+        size_t pos = numOfLoops++;
+        while (pos > 0 && loops[pos - 1].size > loop.size)
+        {
+            loops[pos] = loops[pos - 1];
+            pos--;
+        }
+        loops[pos] = loop;
+    }
+
+    free (stack);
+    return numOfLoops;
+}
+
+static void loopEditCtor (LoopEdit_opt* edit, const Func_bt* function)
+{
+    size_t numOfCmds = function->cmdArraySize;
+
+    edit->moved         = (bool*)   calloc (numOfCmds + 1, sizeof (bool));
+    edit->preheaderCmds = (Cmd_bt*) calloc (numOfCmds + 1, sizeof (Cmd_bt));
+    edit->inserted      = (Cmd_bt*) calloc (numOfCmds + 1, sizeof (Cmd_bt));
+    edit->insertedAfter = (size_t*) calloc (numOfCmds + 1, sizeof (size_t));
+    assert (edit->moved         != NULL);
+    assert (edit->preheaderCmds != NULL);
+    assert (edit->inserted      != NULL);
+    assert (edit->insertedAfter != NULL);
+}
+
+static void loopEditDtor (LoopEdit_opt* edit)
+{
+    free (edit->moved);
+    free (edit->preheaderCmds);
+    free (edit->inserted);
+    free (edit->insertedAfter);
+}
+
+// defs counts definitions of every var in the loop, defAt is the last one
+static void countLoopDefs (const Func_bt* function, const Loop_opt* loop, size_t* defs, size_t* defAt)
+{
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        if (!loop->body[b])
+            continue;
+
+        const Block_bt* block  = &function->blockArray[b];
+        const Cmd_bt*   cmds   = blockCmds (function, block);
+        size_t          length = blockLength (function, block);
+
+        for (size_t i = 0; i < length; i++)
+        {
+            size_t uses[2] = {};
+            size_t def     = NoVar;
+            cmdUsesAndDef (&cmds[i], uses, &def);
+
+            if (def != NoVar)
+            {
+                defs[def]  += 1;
+                defAt[def]  = block->cmdStart + i;
+            }
+        }
+    }
+}
+
+static size_t addLoopVar (Func_bt* function)
+{
+    if (function->varArraySize + 1 >= function->varArrayCapacity)
+    {
+        size_t capacity = function->varArrayCapacity * 2 + 2;
+        function->varArray = (Var_bt*) arenaRealloc (&function->ctx.arena, function->varArray,
+                                                     function->varArrayCapacity * sizeof (Var_bt), capacity * sizeof (Var_bt));
+        function->varArrayCapacity = capacity;
+    }
+
+    size_t var = function->varArraySize++;
+    function->varArray[var]                    = {.location = Memory};
+    function->varArray[function->varArraySize] = {};
+
+    return var;
+}
+
+// Call result in rcx is read once, right after the call
+static bool isInvariantOp (const Func_bt* function, Op_bt op, const size_t* defs)
+{
+    if (op.type == Num_t)
+        return true;
+
+    size_t var = opVarIndex (op);
+    return var != NoVar && defs[var] == 0 && function->varArray[var].location != Register;
+}
+
+// Moved command runs even if the loop body would not, so it must not fault
+static bool canHoist (const Cmd_bt* cmd)
+{
+    switch (cmd->opCode.operation)
+    {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+            return true;
+
+        case OP_DIV:
+            return cmd->operator2.type == Num_t && cmd->operator2.value.num != 0 && cmd->operator2.value.num != -1;
+
+        default:
+            return false;
+    }
+}
+
+static bool dominatesExits (const Dominators_ir* dom, const bool* exiting, size_t numOfBlocks, size_t index)
+{
+    for (size_t b = 0; b < numOfBlocks; b++)
+    {
+        if (exiting[b] && !dominates (dom, index, b))
+            return false;
+    }
+
+    return true;
+}
+
+static void hoistInvariants (Func_bt* function, const Loop_opt* loop, const Dominators_ir* dom, size_t* defs, LoopEdit_opt* edit)
+{
+    Liveness_ir live = {};
+    livenessCtor (&live, function);
+    computeLiveness (&live, function);
+
+    size_t numOfBlocks = live.numOfBlocks;
+    size_t numOfVars   = live.numOfVars;
+    const bool* headerIn = live.liveIn + loop->header * numOfVars;
+
+    bool* exiting    = (bool*) calloc (numOfBlocks + 1, sizeof (bool));
+    bool* liveAtExit = (bool*) calloc (numOfVars + 1, sizeof (bool));
+    assert (exiting    != NULL);
+    assert (liveAtExit != NULL);
+
+    for (size_t b = 0; b < numOfBlocks; b++)
+    {
+        if (!loop->body[b])
+            continue;
+
+        size_t succ[2] = {};
+        size_t numOfSucc = blockSuccessors (function, b, live.blockLength[b], succ);
+
+        for (size_t s = 0; s < numOfSucc; s++)
+        {
+            if (loop->body[succ[s]])
+                continue;
+
+            exiting[b] = true;
+            for (size_t v = 0; v < numOfVars; v++)
+                liveAtExit[v] = liveAtExit[v] || live.liveIn[succ[s] * numOfVars + v];
+        }
+    }
+
+    // Command that reads dest of a moved one may move on the next walk
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        for (size_t b = 0; b < numOfBlocks; b++)
+        {
+            if (!loop->body[b])
+                continue;
+
+            Block_bt* block = &function->blockArray[b];
+            Cmd_bt*   cmds  = blockCmds (function, block);
+
+            for (size_t i = 0; i < live.blockLength[b]; i++)
+            {
+                Cmd_bt* cmd = &cmds[i];
+                size_t  def = opVarIndex (cmd->dest);
+
+                if (edit->moved[block->cmdStart + i] || !canHoist (cmd) || def == NoVar)
+                    continue;
+
+                if (defs[def] != 1 || headerIn[def])
+                    continue;
+
+                if (!isInvariantOp (function, cmd->operator1, defs) || !isInvariantOp (function, cmd->operator2, defs))
+                    continue;
+
+                if (liveAtExit[def] && !dominatesExits (dom, exiting, numOfBlocks, b))
+                    continue;
+
+                if (function->varArray[def].location == Stack)
+                    function->varArray[def].location = Memory;
+
+                edit->moved[block->cmdStart + i] = true;
+                edit->preheaderCmds[edit->numOfPreheaderCmds++] = *cmd;
+                defs[def] = 0;
+                changed   = true;
+            }
+        }
+    }
+
+    free (exiting);
+    free (liveAtExit);
+    livenessDtor (&live);
+}
+
+// Step of var if it is a basic induction variable, 0 otherwise. Update is
+// either ADD/SUB right into var or EQ from a stack temp made by it
+static int inductionStep (const Func_bt* function, const size_t* defs, const size_t* defAt, size_t var)
+{
+    if (defs[var] != 1)
+        return 0;
+
+    const Cmd_bt* update = &function->cmdArray[defAt[var]];
+
+    if (update->opCode.operation == OP_EQ)
+    {
+        size_t temp = opVarIndex (update->operator1);
+        if (temp == NoVar || defs[temp] != 1 || function->varArray[temp].location != Stack)
+            return 0;
+
+        update = &function->cmdArray[defAt[temp]];
+    }
+
+    size_t first  = opVarIndex (update->operator1);
+    size_t second = opVarIndex (update->operator2);
+
+    switch (update->opCode.operation)
+    {
+        case OP_ADD:
+            if (first == var && update->operator2.type == Num_t)
+                return update->operator2.value.num;
+
+            if (second == var && update->operator1.type == Num_t)
+                return update->operator1.value.num;
+
+            return 0;
+
+        case OP_SUB:
+            if (first == var && update->operator2.type == Num_t && update->operator2.value.num != INT32_MIN)
+                return -update->operator2.value.num;
+
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+// Multiplication by power of two is a shift, no cheaper than the add instead of it
+static bool isReducibleFactor (int factor)
+{
+    int64_t magnitude = (factor < 0) ? -(int64_t) factor : factor;
+
+    return (magnitude & (magnitude - 1)) != 0;
+}
+
+static void reduceInductions (Func_bt* function, const Loop_opt* loop,
+                              const size_t* defs, const size_t* defAt, LoopEdit_opt* edit)
+{
+    size_t  numOfCmds = function->cmdArraySize;
+    size_t* ivVar     = (size_t*) calloc (numOfCmds + 1, sizeof (size_t));
+    int*    ivFactor  = (int*)    calloc (numOfCmds + 1, sizeof (int));
+    size_t* ivReduced = (size_t*) calloc (numOfCmds + 1, sizeof (size_t));
+    assert (ivVar     != NULL);
+    assert (ivFactor  != NULL);
+    assert (ivReduced != NULL);
+
+    size_t numOfReduced = 0;
+
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        if (!loop->body[b])
+            continue;
+
+        Block_bt* block  = &function->blockArray[b];
+        Cmd_bt*   cmds   = blockCmds (function, block);
+        size_t    length = blockLength (function, block);
+
+        for (size_t i = 0; i < length; i++)
+        {
+            Cmd_bt* cmd = &cmds[i];
+            if (cmd->opCode.operation != OP_MUL || edit->moved[block->cmdStart + i])
+                continue;
+
+            Op_bt factorOp = cmd->operator2;
+            size_t var     = opVarIndex (cmd->operator1);
+            if (factorOp.type != Num_t)
+            {
+                factorOp = cmd->operator1;
+                var      = opVarIndex (cmd->operator2);
+            }
+
+            if (var == NoVar || factorOp.type != Num_t || !isReducibleFactor (factorOp.value.num))
+                continue;
+
+            int     factor = factorOp.value.num;
+            int64_t step   = (int64_t) inductionStep (function, defs, defAt, var) * factor;
+            if (step == 0 || step != (int) step)
+                continue;
+
+            size_t r = 0;
+            while (r < numOfReduced && (ivVar[r] != var || ivFactor[r] != factor))
+                r++;
+
+            if (r == numOfReduced)
+            {
+                size_t reduced = addLoopVar (function);
+                ivVar[r]     = var;
+                ivFactor[r]  = factor;
+                ivReduced[r] = reduced;
+                numOfReduced += 1;
+
+                edit->preheaderCmds[edit->numOfPreheaderCmds++] = {.opCode = {.operation = OP_MUL}, .operator1 = varOp (var),
+                                                                   .operator2 = numOp (factor), .dest = varOp (reduced)};
+
+                edit->insertedAfter[edit->numOfInserted] = defAt[var];
+                edit->inserted[edit->numOfInserted++]    = {.opCode = {.operation = OP_ADD}, .operator1 = varOp (reduced),
+                                                            .operator2 = numOp ((int) step), .dest = varOp (reduced)};
+            }
+
+            *cmd = {.opCode = {.operation = OP_EQ}, .operator1 = varOp (ivReduced[r]), .dest = cmd->dest};
+        }
+    }
+
+    free (ivVar);
+    free (ivFactor);
+    free (ivReduced);
+}
+
+static void rebuildLoop (Func_bt* function, const Loop_opt* loop, const LoopEdit_opt* edit)
+{
+    size_t  numOfCmds = function->cmdArraySize + edit->numOfPreheaderCmds + edit->numOfInserted;
+    Cmd_bt* cmds      = (Cmd_bt*) arenaAlloc (&function->ctx.arena, numOfCmds * sizeof (Cmd_bt));
+    size_t  pos       = 0;
+
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        Block_bt*     block   = &function->blockArray[b];
+        const Cmd_bt* oldCmds = blockCmds (function, block);
+        size_t        length  = blockLength (function, block);
+        size_t        start   = pos;
+
+        bool hasJmp = length > 0 && oldCmds[length - 1].opCode.operation == OP_JMP;
+        size_t end  = (b == loop->preheader && hasJmp) ? length - 1 : length;
+
+        for (size_t i = 0; i < end; i++)
+        {
+            size_t index = block->cmdStart + i;
+            if (!edit->moved[index])
+                cmds[pos++] = oldCmds[i];
+
+            for (size_t k = 0; k < edit->numOfInserted; k++)
+            {
+                if (edit->insertedAfter[k] == index)
+                    cmds[pos++] = edit->inserted[k];
+            }
+        }
+
+        if (b == loop->preheader)
+        {
+            memcpy (cmds + pos, edit->preheaderCmds, edit->numOfPreheaderCmds * sizeof (Cmd_bt));
+            pos += edit->numOfPreheaderCmds;
+
+            if (hasJmp)
+                cmds[pos++] = oldCmds[length - 1];
+        }
+
+        block->cmdStart         = start;
+        block->cmdArraySize     = pos - start;
+        block->cmdArrayCapacity = pos - start;
+    }
+
+    function->cmdArray         = cmds;
+    function->cmdArraySize     = pos;
+    function->cmdArrayCapacity = numOfCmds;
+}
+
+// Blocks stay where they are, so dominators and loops hold for every loop
+static void optimizeLoops (Func_bt* function)
+{
+    if (function->blockArraySize == 0)
+        return;
+
+    Dominators_ir dom = {};
+    dominatorsCtor (&dom, function);
+
+    Loop_opt* loops = (Loop_opt*) calloc (function->blockArraySize + 1, sizeof (Loop_opt));
+    assert (loops != NULL);
+
+    size_t numOfLoops = findLoops (function, &dom, loops);
+
+    for (size_t l = 0; l < numOfLoops; l++)
+    {
+        size_t  numOfVars = function->varArraySize;
+        size_t* defs  = (size_t*) calloc (numOfVars + 1, sizeof (size_t));
+        size_t* defAt = (size_t*) calloc (numOfVars + 1, sizeof (size_t));
+        assert (defs  != NULL);
+        assert (defAt != NULL);
+
+        LoopEdit_opt edit = {};
+        loopEditCtor (&edit, function);
+
+        countLoopDefs (function, &loops[l], defs, defAt);
+        hoistInvariants (function, &loops[l], &dom, defs, &edit);
+        reduceInductions (function, &loops[l], defs, defAt, &edit);
+
+        if (edit.numOfPreheaderCmds > 0 || edit.numOfInserted > 0)
+            rebuildLoop (function, &loops[l], &edit);
+
+        loopEditDtor (&edit);
+        free (defs);
+        free (defAt);
+    }
+
+    for (size_t l = 0; l < numOfLoops; l++)
+        free (loops[l].body);
+
+    free (loops);
+    dominatorsDtor (&dom);
+}
+//----------------------------------------
+
+// Dead code
+//----------------------------------------
+static void markReached (const Func_bt* function, size_t index, bool* reached)
+{
+    if (reached[index])
+        return;
+
+    reached[index] = true;
+
+    size_t succ[2] = {};
+    size_t numOfSucc = blockSuccessors (function, index, blockLength (function, &function->blockArray[index]), succ);
+
+    for (size_t s = 0; s < numOfSucc; s++)
+        markReached (function, succ[s], reached);
+}
+
+// Blocks move down in blockArray, block 0 is the entry and stays in place
+static void removeUnreachableBlocks (Func_bt* function)
+{
+    size_t numOfBlocks = function->blockArraySize;
+
+    bool*   reached  = (bool*)   calloc (numOfBlocks, sizeof (bool));
+    size_t* newIndex = (size_t*) calloc (numOfBlocks, sizeof (size_t));
+    assert (reached  != NULL);
+    assert (newIndex != NULL);
+
+    markReached (function, 0, reached);
+
+    size_t numOfKept = 0;
+    for (size_t b = 0; b < numOfBlocks; b++)
+    {
+        Block_bt* block = &function->blockArray[b];
+
+        if (reached[b])
+        {
+            newIndex[b] = numOfKept++;
+            block->cmdArraySize = blockLength (function, block);
+            continue;
+        }
+
+        block->cmdArraySize = 0;
+    }
+
+    for (size_t b = 0; b < numOfBlocks; b++)
+    {
+        if (!reached[b])
+            continue;
+
+        Block_bt* block = &function->blockArray[b];
+        Cmd_bt*   cmds  = blockCmds (function, block);
+
+        for (size_t i = 0; i < block->cmdArraySize; i++)
+        {
+            Op_bt* ops[] = {&cmds[i].operator1, &cmds[i].operator2};
+
+            for (size_t j = 0; j < 2; j++)
+            {
+                if (ops[j]->type == Pointer_t)
+                    ops[j]->value.block = (uint32_t) newIndex[ops[j]->value.block];
+            }
+        }
+    }
+
+    for (size_t b = 0; b < numOfBlocks; b++)
+    {
+        if (reached[b] && newIndex[b] != b)
+            function->blockArray[newIndex[b]] = function->blockArray[b];
+    }
+    function->blockArraySize = numOfKept;
+
+    free (reached);
+    free (newIndex);
+}
+
+// Stack temps are only made by arithmetic, so dropping the only reader of one
+// makes its producer dead as well and push/pop stay balanced
+static bool isPureCmd (const Cmd_bt* cmd)
+{
+    switch (cmd->opCode.operation)
+    {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_EQ:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static bool removeDeadCmds (Func_bt* function)
+{
+    Liveness_ir live = {};
+    livenessCtor (&live, function);
+    computeLiveness (&live, function);
+
+    size_t numOfVars = live.numOfVars;
+    bool*  alive = (bool*) calloc (numOfVars + 1, sizeof (bool));
+    assert (alive != NULL);
+
+    bool changed = false;
+
+    for (size_t b = 0; b < live.numOfBlocks; b++)
+    {
+        Block_bt* block = &function->blockArray[b];
+        Cmd_bt*   cmds  = blockCmds (function, block);
+        memcpy (alive, live.liveOut + b * numOfVars, numOfVars * sizeof (bool));
+
+        for (size_t i = block->cmdArraySize; i-- > 0;)
+        {
+            size_t uses[2] = {};
+            size_t def     = NoVar;
+            cmdUsesAndDef (&cmds[i], uses, &def);
+
+            if (def != NoVar && !alive[def] && isPureCmd (&cmds[i]))
+            {
+                removeCmd (function, block, i);
+                changed = true;
+                continue;
+            }
+
+            if (def != NoVar)
+                alive[def] = false;
+
+            for (size_t j = 0; j < 2; j++)
+                if (uses[j] != NoVar)
+                    alive[uses[j]] = true;
+        }
+    }
+
+    free (alive);
+    livenessDtor (&live);
+
+    return changed;
+}
+
+// Drops variables no command refers to and packs memory ones into a smaller frame
+static void compactVars (Func_bt* function)
+{
+    size_t numOfVars = function->varArraySize;
+
+    bool*   used     = (bool*)   calloc (numOfVars + 1, sizeof (bool));
+    size_t* newIndex = (size_t*) calloc (numOfVars + 1, sizeof (size_t));
+    assert (used     != NULL);
+    assert (newIndex != NULL);
+
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        Block_bt* block = &function->blockArray[b];
+        Cmd_bt*   cmds  = blockCmds (function, block);
+
+        for (size_t i = 0; i < block->cmdArraySize; i++)
+        {
+            Op_bt* ops[] = {&cmds[i].operator1, &cmds[i].operator2, &cmds[i].dest};
+
+            for (size_t j = 0; j < 3; j++)
+            {
+                size_t var = opVarIndex (*ops[j]);
+                if (var != NoVar)
+                    used[var] = true;
+            }
+        }
+    }
+
+    size_t numOfKept = 0;
+    for (size_t v = 0; v < numOfVars; v++)
+    {
+        if (used[v])
+            newIndex[v] = numOfKept++;
+    }
+
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        Block_bt* block = &function->blockArray[b];
+        Cmd_bt*   cmds  = blockCmds (function, block);
+
+        for (size_t i = 0; i < block->cmdArraySize; i++)
+        {
+            Op_bt* ops[] = {&cmds[i].operator1, &cmds[i].operator2, &cmds[i].dest};
+
+            for (size_t j = 0; j < 3; j++)
+            {
+                size_t var = opVarIndex (*ops[j]);
+                if (var != NoVar)
+                    ops[j]->value.var = (uint32_t) newIndex[var];
+            }
+        }
+    }
+
+    for (size_t v = 0; v < numOfVars; v++)
+    {
+        if (used[v] && newIndex[v] != v)
+            function->varArray[newIndex[v]] = function->varArray[v];
+    }
+    function->varArray[numOfKept] = {};
+    function->varArraySize        = numOfKept;
+
+    // Params stay in the arguments caller pushed, [rbp + 16] is the last one
+    memset (used, 0, (numOfVars + 1) * sizeof (bool));
+    const Cmd_bt* parOut = blockCmds (function, &function->blockArray[0]);
+
+    for (size_t j = 0; j < numOfParams (function); j++)
+    {
+        size_t param = opVarIndex (parOut[j].dest);
+        used[param] = true;
+        function->varArray[param].offset = -(int) (16 + 8 * j);
+    }
+
+    size_t numOfSlots = 0;
+    function->numberOfTempVar = 0;
+
+    for (size_t v = 0; v < numOfKept; v++)
+    {
+        if (used[v])
+            continue;
+
+        if (function->varArray[v].location == Memory)
+            function->varArray[v].offset = (int) (++numOfSlots * 8);
+        else
+            function->numberOfTempVar += 1;
+    }
+    function->frameSize = numOfSlots * 8;
+
+    free (used);
+    free (newIndex);
+}
+
+static void eliminateDeadCode (Func_bt* function)
+{
+    removeUnreachableBlocks (function);
+
+    while (removeDeadCmds (function)) {};
+
+    compactVars (function);
+    packCmds (function);
+}
+//----------------------------------------
+
+// Block layout
+//----------------------------------------
+// Jumps are threaded through blocks that only pass control on, then blocks
+// are placed by DFS that continues with the JMP target or the true branch of
+// IF, so one path through every IF falls through. A block that is the only
+// way into its JMP target is merged with it. Commands are copied to a new
+// array in the new order and every fallthrough becomes explicit JMP,
+// translator drops the ones that go to the next block.
+
+struct Layout_opt
+{
+    size_t  numOfBlocks;
+    size_t* length;
+    size_t (*succ)[2];
+    size_t* numOfSucc;
+    size_t* numOfPred;
+    bool*   placed;
+    size_t* order;          // of placed blocks
+    bool*   merged;         // order[i] continues order[i - 1] in one block
+    size_t  numOfPlaced;
+    size_t* newIndex;
+};
+
+static void layoutCtor (Layout_opt* layout, const Func_bt* function)
+{
+    size_t numOfBlocks = function->blockArraySize;
+    layout->numOfBlocks = numOfBlocks;
+
+    layout->length    = (size_t*) calloc (numOfBlocks, sizeof (size_t));
+    layout->succ      = (size_t (*)[2]) calloc (numOfBlocks, sizeof (*layout->succ));
+    layout->numOfSucc = (size_t*) calloc (numOfBlocks, sizeof (size_t));
+    layout->numOfPred = (size_t*) calloc (numOfBlocks, sizeof (size_t));
+    layout->placed    = (bool*)   calloc (numOfBlocks, sizeof (bool));
+    layout->order     = (size_t*) calloc (numOfBlocks, sizeof (size_t));
+    layout->merged    = (bool*)   calloc (numOfBlocks, sizeof (bool));
+    layout->newIndex  = (size_t*) calloc (numOfBlocks, sizeof (size_t));
+    assert (layout->length    != NULL);
+    assert (layout->succ      != NULL);
+    assert (layout->numOfSucc != NULL);
+    assert (layout->numOfPred != NULL);
+    assert (layout->placed    != NULL);
+    assert (layout->order     != NULL);
+    assert (layout->merged    != NULL);
+    assert (layout->newIndex  != NULL);
+
+    for (size_t b = 0; b < numOfBlocks; b++)
+    {
+        layout->length[b]    = blockLength (function, &function->blockArray[b]);
+        layout->numOfSucc[b] = blockSuccessors (function, b, layout->length[b], layout->succ[b]);
+    }
+}
+
+static void layoutDtor (Layout_opt* layout)
+{
+    free (layout->length);
+    free (layout->succ);
+    free (layout->numOfSucc);
+    free (layout->numOfPred);
+    free (layout->placed);
+    free (layout->order);
+    free (layout->merged);
+    free (layout->newIndex);
+}
+
+// Empty block that falls through or block with one JMP
+static bool isTrampoline (const Func_bt* function, const Layout_opt* layout, size_t index)
+{
+    if (index == 0 || layout->numOfSucc[index] != 1)
+        return false;
+
+    return layout->length[index] == 0 ||
+           (layout->length[index] == 1 &&
+            blockCmds (function, &function->blockArray[index])[0].opCode.operation == OP_JMP);
+}
+
+static size_t threadTarget (const Func_bt* function, const Layout_opt* layout, size_t index)
+{
+    size_t target = index;
+
+    // Trampolines that form a loop are left as they are
+    for (size_t steps = 0; steps < layout->numOfBlocks && isTrampoline (function, layout, target); steps++)
+        target = layout->succ[target][0];
+
+    return isTrampoline (function, layout, target) ? index : target;
+}
+
+static void threadJumps (Func_bt* function, Layout_opt* layout)
+{
+    size_t* target = (size_t*) calloc (layout->numOfBlocks, sizeof (size_t));
+    assert (target != NULL);
+
+    for (size_t b = 0; b < layout->numOfBlocks; b++)
+        target[b] = threadTarget (function, layout, b);
+
+    for (size_t b = 0; b < layout->numOfBlocks; b++)
+    {
+        for (size_t s = 0; s < layout->numOfSucc[b]; s++)
+            layout->succ[b][s] = target[layout->succ[b][s]];
+
+        if (layout->length[b] == 0)
+            continue;
+
+        Cmd_bt* last = &blockCmds (function, &function->blockArray[b])[layout->length[b] - 1];
+        Op_bt*  ops[] = {&last->operator1, &last->operator2};
+
+        for (size_t j = 0; j < 2; j++)
+        {
+            if (ops[j]->type == Pointer_t)
+                ops[j]->value.block = (uint32_t) target[ops[j]->value.block];
+        }
+    }
+
+    free (target);
+}
+
+static void countPreds (Layout_opt* layout, size_t index, bool* reached)
+{
+    if (reached[index])
+        return;
+
+    reached[index] = true;
+
+    for (size_t s = 0; s < layout->numOfSucc[index]; s++)
+    {
+        layout->numOfPred[layout->succ[index][s]] += 1;
+        countPreds (layout, layout->succ[index][s], reached);
+    }
+}
+
+// Block that ends without terminator and successor runs into epilogue, it has to stay last
+static size_t findExitBlock (const Func_bt* function, const Layout_opt* layout)
+{
+    size_t last   = layout->numOfBlocks - 1;
+    size_t length = layout->length[last];
+    if (layout->numOfSucc[last] != 0)
+        return NoBlock;
+
+    if (length > 0 && blockCmds (function, &function->blockArray[last])[length - 1].opCode.operation == OP_RET)
+        return NoBlock;
+
+    return last;
+}
+
+static void placeBlocks (const Func_bt* function, Layout_opt* layout, const bool* reached)
+{
+    size_t  exitBlock = findExitBlock (function, layout);
+    size_t* stack     = (size_t*) calloc (2 * layout->numOfBlocks + 1, sizeof (size_t));
+    assert (stack != NULL);
+
+    size_t stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        size_t index = stack[--stackSize];
+        bool   merge = false;
+
+        while (!layout->placed[index] && index != exitBlock)
+        {
+            layout->placed[index] = true;
+            layout->merged[layout->numOfPlaced] = merge;
+            layout->order[layout->numOfPlaced++] = index;
+
+            if (layout->numOfSucc[index] == 0)
+                break;
+
+            if (layout->numOfSucc[index] == 2)
+                stack[stackSize++] = layout->succ[index][1];
+
+            size_t next = layout->succ[index][0];
+            merge = layout->numOfSucc[index] == 1 && layout->numOfPred[next] == 1 && next != 0;
+            index = next;
+        }
+    }
+
+    if (exitBlock != NoBlock && reached[exitBlock])
+    {
+        layout->placed[exitBlock] = true;
+        layout->order[layout->numOfPlaced++] = exitBlock;
+    }
+
+    free (stack);
+}
+
+static void rebuildBlocks (Func_bt* function, Layout_opt* layout)
+{
+    size_t numOfCmds = layout->numOfPlaced;
+    for (size_t i = 0; i < layout->numOfPlaced; i++)
+        numOfCmds += layout->length[layout->order[i]];
+
+    Cmd_bt*   cmds   = (Cmd_bt*) arenaAlloc (&function->ctx.arena, numOfCmds * sizeof (Cmd_bt));
+    Block_bt* blocks = (Block_bt*) calloc (layout->numOfPlaced, sizeof (Block_bt));
+    assert (blocks != NULL);
+
+    size_t numOfBlocks = 0;
+    size_t pos = 0;
+
+    for (size_t i = 0; i < layout->numOfPlaced; i++)
+    {
+        size_t index = layout->order[i];
+
+        if (!layout->merged[i])
+            blocks[numOfBlocks++] = {.name = function->blockArray[index].name, .cmdStart = pos};
+
+        layout->newIndex[index] = numOfBlocks - 1;
+
+        const Cmd_bt* blockCmd = blockCmds (function, &function->blockArray[index]);
+        size_t length = layout->length[index];
+        memcpy (cmds + pos, blockCmd, length * sizeof (Cmd_bt));
+        pos += length;
+
+        bool mergesNext = i + 1 < layout->numOfPlaced && layout->merged[i + 1];
+        bool hasJmp     = length > 0 && blockCmd[length - 1].opCode.operation == OP_JMP;
+
+        if (mergesNext && hasJmp)
+            pos--;
+
+        // Block without terminator fell through to the next one in old order
+        if (!mergesNext && !hasJmp && layout->numOfSucc[index] == 1)
+            cmds[pos++] = {.opCode = {.operation = OP_JMP}, .operator1 = blockOp (layout->succ[index][0])};
+
+        blocks[numOfBlocks - 1].cmdArraySize = pos - blocks[numOfBlocks - 1].cmdStart;
+    }
+
+    for (size_t b = 0; b < numOfBlocks; b++)
+    {
+        blocks[b].cmdArrayCapacity = blocks[b].cmdArraySize;
+        if (blocks[b].cmdArraySize == 0)
+            continue;
+
+        Cmd_bt* last  = cmds + blocks[b].cmdStart + blocks[b].cmdArraySize - 1;
+        Op_bt*  ops[] = {&last->operator1, &last->operator2};
+        for (size_t j = 0; j < 2; j++)
+        {
+            if (ops[j]->type == Pointer_t)
+                ops[j]->value.block = (uint32_t) layout->newIndex[ops[j]->value.block];
+        }
+    }
+
+    memcpy (function->blockArray, blocks, numOfBlocks * sizeof (Block_bt));
+    function->blockArraySize   = numOfBlocks;
+    function->cmdArray         = cmds;
+    function->cmdArraySize     = pos;
+    function->cmdArrayCapacity = numOfCmds;
+
+    free (blocks);
+}
+
+static void layoutBlocks (Func_bt* function)
+{
+    Layout_opt layout = {};
+    layoutCtor (&layout, function);
+
+    threadJumps (function, &layout);
+
+    bool* reached = (bool*) calloc (layout.numOfBlocks, sizeof (bool));
+    assert (reached != NULL);
+    countPreds (&layout, 0, reached);
+
+    placeBlocks (function, &layout, reached);
+    rebuildBlocks (function, &layout);
+
+    free (reached);
+    layoutDtor (&layout);
+}
+//----------------------------------------
+
+// Jobs of the pool, every one changes only its function
+static void eliminateTailRecursionJob (void* arg, size_t index)
+{
+    eliminateTailRecursion ((BinaryTranslator*) arg, index);
+}
+
+static void propagateConstantsPass (Func_bt* function)
+{
+    // Resolved IF changes CFG, so propagate again until nothing changes
+    while (propagateConstants (function)) {};
+}
+
+static void numberValuesPass (Func_bt* function)
+{
+    numberValues (function);
+}
+
+struct FuncPass_opt
+{
+    const char* name;       // for --time-report
+    void (*run) (Func_bt* function);
+};
+
+// Passes over one function in their order
+static const FuncPass_opt FuncPasses[] =
+{
+    {"constant propagation", propagateConstantsPass},
+    {"value numbering",      numberValuesPass},
+    {"loop optimization",    optimizeLoops},
+    {"dead code",            eliminateDeadCode},
+    {"block layout",         layoutBlocks},
+    {"tail calls",           markTailCalls},
+};
+
+struct PassJob_opt
+{
+    BinaryTranslator*   binTranslator;
+    const FuncPass_opt* pass;
+};
+
+// Code of cached function is already there, see codeCache.cpp
+static void funcPassJob (void* arg, size_t index)
+{
+    PassJob_opt* job      = (PassJob_opt*) arg;
+    Func_bt*     function = &job->binTranslator->funcArray[index];
+
+    if (!function->ctx.cached)
+        job->pass->run (function);
+}
+
+// Inlining reads bodies of callees while it changes callers, so only it goes in one thread.
+// Every pass over functions is a batch of its own, so each one is timed
+void optimizeIR (BinaryTranslator* binTranslator)
+{
+    assert (binTranslator != NULL);
+
+    threadPoolRun (&binTranslator->pool, eliminateTailRecursionJob, binTranslator, binTranslator->funcArraySize);
+    timePhase (binTranslator, "tail recursion", 0);
+
+    inlineFunctions (binTranslator);
+    timePhase (binTranslator, "inlining", 0);
+
+    for (size_t i = 0; i < sizeof (FuncPasses) / sizeof (*FuncPasses); i++)
+    {
+        PassJob_opt job = {binTranslator, &FuncPasses[i]};
+        threadPoolRun (&binTranslator->pool, funcPassJob, &job, binTranslator->funcArraySize);
+        timePhase (binTranslator, FuncPasses[i].name, 0);
+    }
+}
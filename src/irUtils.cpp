@@ -0,0 +1,414 @@
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+
+#include <cstddef>
+#include <cstdlib>
+#include <cassert>
+#include <cstring>
+
+#include "../language/common.h"
+#include "../include/BinaryTranslator.h"
+#include "../include/irUtils.h"
+
+// Def-use and CFG queries shared by IR passes
+
+size_t opVarIndex (Op_bt op)
+{
+    if (op.type != Var_t)
+        return NoVar;
+
+    return op.value.var;
+}
+
+void cmdUsesAndDef (const Cmd_bt* cmd, size_t uses[2], size_t* def)
+{
+    uses[0] = NoVar;
+    uses[1] = NoVar;
+    *def    = NoVar;
+
+    switch (cmd->opCode.operation)
+    {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+            uses[0] = opVarIndex (cmd->operator1);
+            uses[1] = opVarIndex (cmd->operator2);
+            *def    = opVarIndex (cmd->dest);
+            break;
+
+        case OP_EQ:
+            uses[0] = opVarIndex (cmd->operator1);
+            *def    = opVarIndex (cmd->dest);
+            break;
+
+        case OP_IF:
+            uses[0] = opVarIndex (cmd->dest);
+            break;
+
+        case OP_RET:
+        case OP_PARIN:
+        case OP_OUT:
+            uses[0] = opVarIndex (cmd->operator1);
+            break;
+
+        case OP_PAROUT:
+        case OP_CALL:
+        case OP_IN:
+            *def = opVarIndex (cmd->dest);
+            break;
+
+        case OP_JMP:
+            break;
+
+        default:
+            assert (0);
+    }
+}
+
+size_t blockIndex (Op_bt op)
+{
+    assert (op.type == Pointer_t);
+
+    return op.value.block;
+}
+
+// Commands after IF, JMP or RET are never executed
+size_t blockLength (const Func_bt* function, const Block_bt* block)
+{
+    const Cmd_bt* cmds = blockCmds (function, block);
+
+    for (size_t i = 0; i < block->cmdArraySize; i++)
+    {
+        unsigned int operation = cmds[i].opCode.operation;
+
+        if (operation == OP_JMP || operation == OP_RET || (operation == OP_IF && hasOp (cmds[i].operator2)))
+            return i + 1;
+    }
+
+    return block->cmdArraySize;
+}
+
+size_t blockSuccessors (const Func_bt* function, size_t index, size_t length, size_t succ[2])
+{
+    const Block_bt* block = &function->blockArray[index];
+
+    if (length > 0)
+    {
+        const Cmd_bt* last = &blockCmds (function, block)[length - 1];
+
+        if (last->opCode.operation == OP_RET)
+            return 0;
+
+        if (last->opCode.operation == OP_JMP)
+        {
+            succ[0] = blockIndex (last->operator1);
+            return 1;
+        }
+
+        if (last->opCode.operation == OP_IF && hasOp (last->operator2))
+        {
+            succ[0] = blockIndex (last->operator1);
+            succ[1] = blockIndex (last->operator2);
+            return 2;
+        }
+    }
+
+    if (index + 1 < function->blockArraySize)
+    {
+        succ[0] = index + 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+// PAROUT go first in the entry block. Callee pops arguments in PAROUT order,
+// so the last PARIN of a call goes to the first PAROUT. They are counted when
+// the head is parsed, callers read it while the callee is changed in other thread
+size_t numOfParams (const Func_bt* function)
+{
+    return function->numberOfParams;
+}
+
+// Moves commands of every block right after the previous block, so passes
+// that remove commands leave no gaps. Blocks keep their order in cmdArray
+void packCmds (Func_bt* function)
+{
+    size_t pos = 0;
+
+    for (size_t b = 0; b < function->blockArraySize; b++)
+    {
+        Block_bt* block = &function->blockArray[b];
+        assert (block->cmdStart >= pos);
+
+        memmove (function->cmdArray + pos, blockCmds (function, block), block->cmdArraySize * sizeof (Cmd_bt));
+        block->cmdStart         = pos;
+        block->cmdArrayCapacity = block->cmdArraySize;
+        pos += block->cmdArraySize;
+    }
+
+    function->cmdArraySize = pos;
+}
+
+// Dominators
+//----------------------------------------
+// Iterative algorithm of Cooper, Harvey and Kennedy over reverse postorder
+
+static void postorder (const Func_bt* function, size_t index, bool* visited, size_t* order, size_t* numOfOrdered)
+{
+    visited[index] = true;
+
+    size_t succ[2] = {};
+    size_t numOfSucc = blockSuccessors (function, index, blockLength (function, &function->blockArray[index]), succ);
+
+    for (size_t s = 0; s < numOfSucc; s++)
+    {
+        if (!visited[succ[s]])
+            postorder (function, succ[s], visited, order, numOfOrdered);
+    }
+
+    order[(*numOfOrdered)++] = index;
+}
+
+static void collectPreds (Dominators_ir* dom, const Func_bt* function)
+{
+    size_t numOfBlocks = dom->numOfBlocks;
+    size_t (*succ)[2]  = (size_t (*)[2]) calloc (numOfBlocks, sizeof (*succ));
+    size_t* numOfSucc  = (size_t*) calloc (numOfBlocks, sizeof (size_t));
+    assert (succ      != NULL);
+    assert (numOfSucc != NULL);
+
+    for (size_t b = 0; b < numOfBlocks; b++)
+    {
+        numOfSucc[b] = blockSuccessors (function, b, blockLength (function, &function->blockArray[b]), succ[b]);
+
+        for (size_t s = 0; s < numOfSucc[b]; s++)
+            dom->predStart[succ[b][s] + 1]++;
+    }
+
+    for (size_t b = 0; b < numOfBlocks; b++)
+        dom->predStart[b + 1] += dom->predStart[b];
+
+    size_t* filled = (size_t*) calloc (numOfBlocks + 1, sizeof (size_t));
+    assert (filled != NULL);
+
+    for (size_t b = 0; b < numOfBlocks; b++)
+    {
+        for (size_t s = 0; s < numOfSucc[b]; s++)
+        {
+            size_t target = succ[b][s];
+            dom->preds[dom->predStart[target] + filled[target]++] = b;
+        }
+    }
+
+    free (filled);
+    free (succ);
+    free (numOfSucc);
+}
+
+static size_t intersect (const Dominators_ir* dom, const size_t* rpoIndex, size_t first, size_t second)
+{
+    while (first != second)
+    {
+        while (rpoIndex[first] > rpoIndex[second])
+            first = dom->idom[first];
+
+        while (rpoIndex[second] > rpoIndex[first])
+            second = dom->idom[second];
+    }
+
+    return first;
+}
+
+void dominatorsCtor (Dominators_ir* dom, const Func_bt* function)
+{
+    size_t numOfBlocks = function->blockArraySize;
+    dom->numOfBlocks = numOfBlocks;
+
+    dom->idom      = (size_t*) calloc (numOfBlocks + 1, sizeof (size_t));
+    dom->order     = (size_t*) calloc (numOfBlocks + 1, sizeof (size_t));
+    dom->predStart = (size_t*) calloc (numOfBlocks + 1, sizeof (size_t));
+    dom->preds     = (size_t*) calloc (2 * numOfBlocks + 1, sizeof (size_t));
+    assert (dom->idom      != NULL);
+    assert (dom->order     != NULL);
+    assert (dom->predStart != NULL);
+    assert (dom->preds     != NULL);
+
+    collectPreds (dom, function);
+
+    bool*   visited  = (bool*)   calloc (numOfBlocks + 1, sizeof (bool));
+    size_t* rpoIndex = (size_t*) calloc (numOfBlocks + 1, sizeof (size_t));
+    assert (visited  != NULL);
+    assert (rpoIndex != NULL);
+
+    dom->numOfOrdered = 0;
+    if (numOfBlocks > 0)
+        postorder (function, 0, visited, dom->order, &dom->numOfOrdered);
+
+    for (size_t i = 0; i < dom->numOfOrdered / 2; i++)
+    {
+        size_t tmp = dom->order[i];
+        dom->order[i] = dom->order[dom->numOfOrdered - 1 - i];
+        dom->order[dom->numOfOrdered - 1 - i] = tmp;
+    }
+
+    for (size_t b = 0; b < numOfBlocks; b++)
+        dom->idom[b] = NoBlock;
+
+    for (size_t i = 0; i < dom->numOfOrdered; i++)
+        rpoIndex[dom->order[i]] = i;
+
+    if (numOfBlocks > 0)
+        dom->idom[0] = 0;
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        for (size_t i = 1; i < dom->numOfOrdered; i++)
+        {
+            size_t b       = dom->order[i];
+            size_t newIdom = NoBlock;
+
+            for (size_t p = dom->predStart[b]; p < dom->predStart[b + 1]; p++)
+            {
+                size_t pred = dom->preds[p];
+                if (dom->idom[pred] == NoBlock)
+                    continue;
+
+                newIdom = (newIdom == NoBlock) ? pred : intersect (dom, rpoIndex, pred, newIdom);
+            }
+
+            if (dom->idom[b] != newIdom)
+            {
+                dom->idom[b] = newIdom;
+                changed = true;
+            }
+        }
+    }
+
+    free (visited);
+    free (rpoIndex);
+}
+
+void dominatorsDtor (Dominators_ir* dom)
+{
+    free (dom->idom);
+    free (dom->order);
+    free (dom->predStart);
+    free (dom->preds);
+}
+
+bool dominates (const Dominators_ir* dom, size_t first, size_t second)
+{
+    if (dom->idom[second] == NoBlock)
+        return false;
+
+    while (second != first && second != 0)
+        second = dom->idom[second];
+
+    return second == first;
+}
+//----------------------------------------
+
+// Liveness
+//----------------------------------------
+void livenessCtor (Liveness_ir* live, const Func_bt* function)
+{
+    live->numOfBlocks = function->blockArraySize;
+    live->numOfVars   = function->varArraySize;
+
+    live->blockStart  = (size_t*) calloc (live->numOfBlocks, sizeof (size_t));
+    live->blockEnd    = (size_t*) calloc (live->numOfBlocks, sizeof (size_t));
+    live->blockLength = (size_t*) calloc (live->numOfBlocks, sizeof (size_t));
+    assert (live->blockStart  != NULL);
+    assert (live->blockEnd    != NULL);
+    assert (live->blockLength != NULL);
+
+    size_t setSize = live->numOfBlocks * live->numOfVars + 1;
+    live->use     = (bool*) calloc (setSize, sizeof (bool));
+    live->def     = (bool*) calloc (setSize, sizeof (bool));
+    live->liveIn  = (bool*) calloc (setSize, sizeof (bool));
+    live->liveOut = (bool*) calloc (setSize, sizeof (bool));
+    assert (live->use     != NULL);
+    assert (live->def     != NULL);
+    assert (live->liveIn  != NULL);
+    assert (live->liveOut != NULL);
+}
+
+void livenessDtor (Liveness_ir* live)
+{
+    free (live->blockStart);
+    free (live->blockEnd);
+    free (live->blockLength);
+    free (live->use);
+    free (live->def);
+    free (live->liveIn);
+    free (live->liveOut);
+}
+
+void computeLiveness (Liveness_ir* live, const Func_bt* function)
+{
+    size_t numOfVars = live->numOfVars;
+    size_t pos = 0;
+
+    for (size_t b = 0; b < live->numOfBlocks; b++)
+    {
+        const Block_bt* block = &function->blockArray[b];
+        const Cmd_bt*   cmds  = blockCmds (function, block);
+        bool* use = live->use + b * numOfVars;
+        bool* def = live->def + b * numOfVars;
+
+        live->blockLength[b] = blockLength (function, block);
+        live->blockStart[b]  = pos++;
+
+        for (size_t i = 0; i < live->blockLength[b]; i++, pos++)
+        {
+            size_t uses[2] = {};
+            size_t defVar  = 0;
+            cmdUsesAndDef (&cmds[i], uses, &defVar);
+
+            for (size_t j = 0; j < 2; j++)
+                if (uses[j] != NoVar && !def[uses[j]])
+                    use[uses[j]] = true;
+
+            if (defVar != NoVar)
+                def[defVar] = true;
+        }
+
+        live->blockEnd[b] = pos - 1;
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        for (size_t b = live->numOfBlocks; b-- > 0;)
+        {
+            bool* in  = live->liveIn  + b * numOfVars;
+            bool* out = live->liveOut + b * numOfVars;
+
+            size_t succ[2] = {};
+            size_t numOfSucc = blockSuccessors (function, b, live->blockLength[b], succ);
+
+            for (size_t s = 0; s < numOfSucc; s++)
+            {
+                bool* succIn = live->liveIn + succ[s] * numOfVars;
+                for (size_t v = 0; v < numOfVars; v++)
+                    out[v] = out[v] || succIn[v];
+            }
+
+            for (size_t v = 0; v < numOfVars; v++)
+            {
+                bool newIn = live->use[b * numOfVars + v] || (out[v] && !live->def[b * numOfVars + v]);
+                if (newIn != in[v])
+                {
+                    in[v]   = newIn;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,1163 @@
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <cstring>
+
+#include "../include/BinaryTranslator.h"
+#include "../include/peephole.h"
+
+// Block is decoded back from x86_array, rewritten and encoded again in place.
+// Only the forms translator.cpp emits are decoded, a block with anything
+// else is left untouched.
+
+enum INSTR_KIND
+{
+    INSTR_REMOVED,
+    INSTR_PUSH,         // push reg2
+    INSTR_PUSH_IMM,     // push imm
+    INSTR_POP,          // pop reg1
+    INSTR_MOV_RR,       // mov reg1, reg2
+    INSTR_MOV_RI,       // mov reg1, imm, imm is the 64 bit value
+    INSTR_LOAD,         // mov reg1, [rbp + disp]
+    INSTR_STORE,        // mov [rbp + disp], reg2
+    INSTR_STORE_IMM,    // mov qword [rbp + disp], imm
+    INSTR_LEA_FRAME,    // lea reg1, [rbp + disp]
+    INSTR_ALU_RR,       // op reg1, reg2
+    INSTR_ALU_RI,       // op reg1, imm
+    INSTR_MUL_DIV,      // op reg2, rax and rdx are implicit
+    INSTR_IMUL_RR,      // imul reg1, reg2
+    INSTR_IMUL_RI,      // imul reg1, reg2, imm
+    INSTR_LEA_SCALED,   // lea reg1, [reg2 + reg2 * imm]
+    INSTR_SHIFT,        // op reg1, imm
+    INSTR_MOVSXD,       // movsxd reg1, reg2 (low half)
+    INSTR_CQO,          // rdx = sign of rax
+    INSTR_NEG,          // neg reg1
+    INSTR_TEST32,       // test reg1, reg2 (low halves)
+
+    // control flow goes last
+    INSTR_JMP,
+    INSTR_JCC,
+    INSTR_CALL,
+    INSTR_RET,          // ret imm, imm is 0 for plain ret
+};
+
+// ModRM digits of 0xC1 group
+enum SHIFT_OP
+{
+    SHIFT_SHL = 4,
+    SHIFT_SHR = 5,
+    SHIFT_SAR = 7,
+};
+
+// ModRM digits of 0x81 group, test has none
+enum ALU_OP
+{
+    ALU_ADD  = 0,
+    ALU_SUB  = 5,
+    ALU_CMP  = 7,
+    ALU_TEST = 8,
+};
+
+enum INSTR_BYTES : unsigned char
+{
+    BYTE_REX        = 0x40,
+    BYTE_REX_W      = 0x48,
+    BYTE_REX_W_MASK = 0x08,
+    BYTE_ADD        = 0x01,
+    BYTE_SUB        = 0x29,
+    BYTE_CMP        = 0x39,
+    BYTE_TEST       = 0x85,
+    BYTE_ALU_IMM32  = 0x81,
+    BYTE_ALU_IMM8   = 0x83,
+    BYTE_MOV_STORE  = 0x89,     // mov r/m64, r64
+    BYTE_MOV_LOAD   = 0x8B,     // mov r64, r/m64
+    BYTE_MOV_IMM32  = 0xC7,     // mov r/m64, imm32
+    BYTE_GROUP_F7   = 0xF7,     // neg, mul, imul, div, idiv
+    BYTE_TWO_BYTE   = 0x0F,
+    BYTE_IMUL       = 0xAF,     // after 0x0F
+    BYTE_IMUL_IMM32 = 0x69,
+    BYTE_IMUL_IMM8  = 0x6B,
+    BYTE_MOVSXD     = 0x63,
+    BYTE_LEA        = 0x8D,
+    BYTE_SHIFT_IMM  = 0xC1,
+    BYTE_CQO        = 0x99,
+    BYTE_SIB        = 0x04,     // rm of ModRM that is followed by SIB
+    BYTE_REX_X_MASK = 0x02,
+};
+
+struct x86_instr
+{
+    INSTR_KIND kind;
+    REG_NUM  reg1;
+    REG_NUM  reg2;
+    unsigned op;        // ALU_OP, SHIFT_OP, F7 digit for mul/div or condition byte of jcc
+    int64_t  imm;
+    int64_t  disp;      // [rbp + disp]
+    size_t   fixup;     // index in buf->fixups for jmp, jcc and call
+};
+
+static inline uint32_t regMask (REG_NUM reg)
+{
+    return 1u << reg;
+}
+
+// rax, rbx and rdx are reloaded by every command, they never live across blocks
+static const uint32_t ScratchRegs = (1u << RAX) | (1u << RBX) | (1u << RDX);
+
+// bin/BinPrintf and bin/BinScanf keep these
+static const uint32_t RuntimeKeptRegs = (1u << RSP) | (1u << RBP) | (1u << R9)  | (1u << R10) |
+                                        (1u << R12) | (1u << R13) | (1u << R14) | (1u << R15);
+// Callee restores rbp, allocated registers are caller saved
+static const uint32_t FunctionKeptRegs = (1u << RSP) | (1u << RBP);
+
+static const uint32_t AllRegs = 0xFFFF;
+
+static const char* PeepholeRuleNames[PH_RULES_COUNT] =
+{
+    "push/pop pairs",
+    "save/restore pairs",
+    "store to load",
+    "cmp with zero",
+    "immediate operands",
+    "mov chains",
+};
+
+//----------------------------------------------------------------------------
+// Decoding
+
+static inline int32_t readImm32 (const unsigned char* code)
+{
+    int32_t number = 0;
+    memcpy (&number, code, sizeof (number));
+    return number;
+}
+
+static inline REG_NUM modrmReg (unsigned char modrm, unsigned char rex)
+{
+    return (REG_NUM) (((modrm >> 3) & 7) + ((rex & REX_R_MASK) ? 8 : 0));
+}
+
+static inline REG_NUM modrmRm (unsigned char modrm, unsigned char rex)
+{
+    return (REG_NUM) ((modrm & 7) + ((rex & REX_B_MASK) ? 8 : 0));
+}
+
+// [rbp + disp] after ModRM, returns size of displacement or 0
+static size_t decodeFrameOperand (const unsigned char* code, unsigned char rex, x86_instr* instr)
+{
+    unsigned char modrm = code[0];
+    if (modrmRm (modrm, rex) != RBP)
+        return 0;
+
+    int32_t disp = 0;
+    size_t  size = 0;
+
+    switch (modrm >> 6)
+    {
+        case 1:
+            disp = (int8_t) code[1];
+            size = 1;
+            break;
+
+        case 2:
+            disp = readImm32 (code + 1);
+            size = 4;
+            break;
+
+        default:
+            return 0;
+    }
+
+    instr->disp = disp;
+    return size;
+}
+
+static bool aluFromOpcode (unsigned char opcode, unsigned* op)
+{
+    switch (opcode)
+    {
+        case BYTE_ADD:  *op = ALU_ADD;  return true;
+        case BYTE_SUB:  *op = ALU_SUB;  return true;
+        case BYTE_CMP:  *op = ALU_CMP;  return true;
+        case BYTE_TEST: *op = ALU_TEST; return true;
+        default:
+            return false;
+    }
+}
+
+// Returns size of instruction at pos or 0 if it is not one of ours
+static size_t decodeInstr (const CodeBuf_bt* buf, size_t pos, x86_instr* instr)
+{
+    const unsigned char* code = buf->x86_array + pos;
+    unsigned char rex = 0;
+    size_t size = 0;
+
+    if ((code[0] & 0xF0) == 0x40)
+        rex = code[size++];
+
+    unsigned char opcode = code[size++];
+    REG_NUM shortReg = (REG_NUM) ((opcode & 7) + ((rex & REX_B_MASK) ? 8 : 0));
+
+    if ((rex & BYTE_REX_W_MASK) == 0)
+    {
+        switch (opcode & 0xF8)
+        {
+            case PUSH_REG:
+                *instr = {.kind = INSTR_PUSH, .reg2 = shortReg};
+                return size;
+
+            case POP_REG:
+                *instr = {.kind = INSTR_POP, .reg1 = shortReg};
+                return size;
+
+            case MOV_REG_IMM:
+                *instr = {.kind = INSTR_MOV_RI, .reg1 = shortReg, .imm = (uint32_t) readImm32 (code + size)};
+                return size + sizeof (int32_t);
+
+            default:
+                break;
+        }
+    }
+
+    // test of IF is the only one without REX.W that has ModRM
+    if (opcode == BYTE_TEST && (rex & BYTE_REX_W_MASK) == 0)
+    {
+        if ((code[size] >> 6) != 3)
+            return 0;
+
+        *instr = {.kind = INSTR_TEST32, .reg1 = modrmRm (code[size], rex), .reg2 = modrmReg (code[size], rex)};
+        return size + 1;
+    }
+
+    if (rex == 0)
+    {
+        switch (opcode)
+        {
+            case PUSH_32b:
+                *instr = {.kind = INSTR_PUSH_IMM, .imm = readImm32 (code + size)};
+                return size + sizeof (int32_t);
+
+            case CALL_OP:
+            case JMP_OP:
+                *instr = {.kind = (opcode == CALL_OP) ? INSTR_CALL : INSTR_JMP};
+                return size + sizeof (int32_t);
+
+            case BYTE_TWO_BYTE:
+            {
+                unsigned char condition = code[size++];
+                if (condition < 0x80 || 0x8F < condition)
+                    return 0;
+
+                *instr = {.kind = INSTR_JCC, .op = condition};
+                return size + sizeof (int32_t);
+            }
+
+            case RET_OP:
+                *instr = {.kind = INSTR_RET};
+                return size;
+
+            case RET_IMM16:
+                *instr = {.kind = INSTR_RET, .imm = code[size] | (code[size + 1] << 8)};
+                return size + 2;
+
+            default:
+                return 0;
+        }
+    }
+
+    if ((rex & BYTE_REX_W_MASK) == 0)
+        return 0;
+
+    if (opcode == BYTE_CQO)
+    {
+        *instr = {.kind = INSTR_CQO};
+        return size;
+    }
+
+    if (opcode == BYTE_TWO_BYTE)
+    {
+        if (code[size] != BYTE_IMUL || (code[size + 1] >> 6) != 3)
+            return 0;
+
+        *instr = {.kind = INSTR_IMUL_RR, .reg1 = modrmReg (code[size + 1], rex), .reg2 = modrmRm (code[size + 1], rex)};
+        return size + 2;
+    }
+
+    unsigned char modrm = code[size];
+    REG_NUM  reg   = modrmReg (modrm, rex);
+    REG_NUM  rm    = modrmRm  (modrm, rex);
+    unsigned digit = (modrm >> 3) & 7;
+    bool     isReg = (modrm >> 6) == 3;
+    unsigned op    = 0;
+
+    if (aluFromOpcode (opcode, &op))
+    {
+        if (!isReg)
+            return 0;
+
+        *instr = {.kind = INSTR_ALU_RR, .reg1 = rm, .reg2 = reg, .op = op};
+        return size + 1;
+    }
+
+    switch (opcode)
+    {
+        case BYTE_MOV_STORE:
+        case BYTE_MOV_LOAD:
+        {
+            if (isReg)
+            {
+                if (opcode == BYTE_MOV_STORE)
+                    *instr = {.kind = INSTR_MOV_RR, .reg1 = rm, .reg2 = reg};
+                else
+                    *instr = {.kind = INSTR_MOV_RR, .reg1 = reg, .reg2 = rm};
+                return size + 1;
+            }
+
+            if (opcode == BYTE_MOV_STORE)
+                *instr = {.kind = INSTR_STORE, .reg2 = reg};
+            else
+                *instr = {.kind = INSTR_LOAD, .reg1 = reg};
+
+            size_t dispSize = decodeFrameOperand (code + size, rex, instr);
+            return dispSize ? size + 1 + dispSize : 0;
+        }
+
+        case BYTE_MOV_IMM32:
+        {
+            if (digit != 0)
+                return 0;
+
+            if (isReg)
+            {
+                *instr = {.kind = INSTR_MOV_RI, .reg1 = rm, .imm = readImm32 (code + size + 1)};
+                return size + 1 + sizeof (int32_t);
+            }
+
+            *instr = {.kind = INSTR_STORE_IMM};
+            size_t dispSize = decodeFrameOperand (code + size, rex, instr);
+            if (!dispSize)
+                return 0;
+
+            size += 1 + dispSize;
+            instr->imm = readImm32 (code + size);
+            return size + sizeof (int32_t);
+        }
+
+        case BYTE_ALU_IMM32:
+        case BYTE_ALU_IMM8:
+            if (!isReg || (digit != ALU_ADD && digit != ALU_SUB && digit != ALU_CMP))
+                return 0;
+
+            *instr = {.kind = INSTR_ALU_RI, .reg1 = rm, .op = digit};
+            size++;
+
+            if (opcode == BYTE_ALU_IMM8)
+            {
+                instr->imm = (int8_t) code[size];
+                return size + 1;
+            }
+
+            instr->imm = readImm32 (code + size);
+            return size + sizeof (int32_t);
+
+        case BYTE_GROUP_F7:
+            if (!isReg || digit < 3)
+                return 0;
+
+            if (digit == 3)
+                *instr = {.kind = INSTR_NEG, .reg1 = rm};
+            else
+                *instr = {.kind = INSTR_MUL_DIV, .reg2 = rm, .op = digit};
+            return size + 1;
+
+        case BYTE_IMUL_IMM32:
+        case BYTE_IMUL_IMM8:
+            if (!isReg)
+                return 0;
+
+            *instr = {.kind = INSTR_IMUL_RI, .reg1 = reg, .reg2 = rm};
+            size++;
+
+            if (opcode == BYTE_IMUL_IMM8)
+            {
+                instr->imm = (int8_t) code[size];
+                return size + 1;
+            }
+
+            instr->imm = readImm32 (code + size);
+            return size + sizeof (int32_t);
+
+        case BYTE_MOVSXD:
+            if (!isReg)
+                return 0;
+
+            *instr = {.kind = INSTR_MOVSXD, .reg1 = reg, .reg2 = rm};
+            return size + 1;
+
+        case BYTE_SHIFT_IMM:
+            if (!isReg || (digit != SHIFT_SHL && digit != SHIFT_SHR && digit != SHIFT_SAR))
+                return 0;
+
+            *instr = {.kind = INSTR_SHIFT, .reg1 = rm, .op = digit, .imm = code[size + 1]};
+            return size + 2;
+
+        // Only [base + base * scale] and [rbp + disp] are made by translator
+        case BYTE_LEA:
+        {
+            if ((modrm >> 6) != 0)
+            {
+                *instr = {.kind = INSTR_LEA_FRAME, .reg1 = reg};
+                size_t dispSize = decodeFrameOperand (code + size, rex, instr);
+                return dispSize ? size + 1 + dispSize : 0;
+            }
+
+            if ((modrm & 7) != BYTE_SIB)
+                return 0;
+
+            unsigned char sib   = code[size + 1];
+            REG_NUM       base  = (REG_NUM) ((sib & 7) + ((rex & REX_B_MASK) ? 8 : 0));
+            REG_NUM       index = (REG_NUM) (((sib >> 3) & 7) + ((rex & BYTE_REX_X_MASK) ? 8 : 0));
+            if (base != index || (base & 7) == RSP || (base & 7) == RBP)
+                return 0;
+
+            *instr = {.kind = INSTR_LEA_SCALED, .reg1 = reg, .reg2 = base, .imm = 1 << (sib >> 6)};
+            return size + 2;
+        }
+
+        default:
+            return 0;
+    }
+}
+
+//----------------------------------------------------------------------------
+// Encoding
+
+static inline void emitByte (CodeBuf_bt* buf, uint64_t byte)
+{
+    buf->x86_array[buf->BT_ip++] = (unsigned char) byte;
+}
+
+static inline void emitImm32 (CodeBuf_bt* buf, int64_t number)
+{
+    int32_t imm = (int32_t) number;
+    memcpy (buf->x86_array + buf->BT_ip, &imm, sizeof (imm));
+    buf->BT_ip += sizeof (imm);
+}
+
+// rel32 is still unresolved, only its position moves
+static inline void emitFixup (CodeBuf_bt* buf, size_t fixup)
+{
+    buf->fixups[fixup].pos = buf->BT_ip;
+    emitImm32 (buf, 0);
+}
+
+static inline uint64_t rexW (uint64_t reg, uint64_t rm)
+{
+    return BYTE_REX_W | ((reg >= R8) ? (uint64_t) REX_R_MASK : 0) | ((rm >= R8) ? (uint64_t) REX_B_MASK : 0);
+}
+
+// Prefix of 32 bit forms, only r8-r15 need it
+static inline uint64_t rexRB (uint64_t reg, uint64_t rm)
+{
+    return BYTE_REX | ((reg >= R8) ? (uint64_t) REX_R_MASK : 0) | ((rm >= R8) ? (uint64_t) REX_B_MASK : 0);
+}
+
+static inline uint64_t modrmByte (uint64_t mod, uint64_t reg, uint64_t rm)
+{
+    return (mod << 6) | ((reg & 7) << 3) | (rm & 7);
+}
+
+static void emitFrameOperand (CodeBuf_bt* buf, REG_NUM reg, int64_t disp)
+{
+    if (INT8_MIN <= disp && disp <= INT8_MAX)
+    {
+        emitByte (buf, modrmByte (1, reg, RBP));
+        emitByte (buf, (uint64_t) disp);
+        return;
+    }
+
+    emitByte  (buf, modrmByte (2, reg, RBP));
+    emitImm32 (buf, disp);
+}
+
+static void emitShortReg (CodeBuf_bt* buf, uint64_t opcode, REG_NUM reg)
+{
+    if (reg >= R8)
+        emitByte (buf, REX_B);
+
+    emitByte (buf, opcode + (reg & 7));
+}
+
+static uint64_t aluOpcode (unsigned op)
+{
+    switch (op)
+    {
+        case ALU_ADD:  return BYTE_ADD;
+        case ALU_SUB:  return BYTE_SUB;
+        case ALU_CMP:  return BYTE_CMP;
+        case ALU_TEST: return BYTE_TEST;
+        default:
+            assert (0);
+    }
+
+    return 0;
+}
+
+static void encodeInstr (CodeBuf_bt* buf, const x86_instr* instr)
+{
+    switch (instr->kind)
+    {
+        case INSTR_REMOVED:
+            break;
+
+        case INSTR_PUSH:
+            emitShortReg (buf, PUSH_REG, instr->reg2);
+            break;
+
+        case INSTR_POP:
+            emitShortReg (buf, POP_REG, instr->reg1);
+            break;
+
+        case INSTR_PUSH_IMM:
+            emitByte  (buf, PUSH_32b);
+            emitImm32 (buf, instr->imm);
+            break;
+
+        case INSTR_MOV_RR:
+            emitByte (buf, rexW (instr->reg2, instr->reg1));
+            emitByte (buf, BYTE_MOV_STORE);
+            emitByte (buf, modrmByte (3, instr->reg2, instr->reg1));
+            break;
+
+        // Short form zero extends, the long one sign extends
+        case INSTR_MOV_RI:
+            if (instr->imm >= 0)
+                emitShortReg (buf, MOV_REG_IMM, instr->reg1);
+            else
+            {
+                emitByte (buf, rexW (RAX, instr->reg1));
+                emitByte (buf, BYTE_MOV_IMM32);
+                emitByte (buf, modrmByte (3, 0, instr->reg1));
+            }
+            emitImm32 (buf, instr->imm);
+            break;
+
+        case INSTR_LOAD:
+            emitByte (buf, rexW (instr->reg1, RBP));
+            emitByte (buf, BYTE_MOV_LOAD);
+            emitFrameOperand (buf, instr->reg1, instr->disp);
+            break;
+
+        case INSTR_STORE:
+            emitByte (buf, rexW (instr->reg2, RBP));
+            emitByte (buf, BYTE_MOV_STORE);
+            emitFrameOperand (buf, instr->reg2, instr->disp);
+            break;
+
+        case INSTR_STORE_IMM:
+            emitByte (buf, rexW (RAX, RBP));
+            emitByte (buf, BYTE_MOV_IMM32);
+            emitFrameOperand (buf, RAX, instr->disp);
+            emitImm32 (buf, instr->imm);
+            break;
+
+        case INSTR_LEA_FRAME:
+            emitByte (buf, rexW (instr->reg1, RBP));
+            emitByte (buf, BYTE_LEA);
+            emitFrameOperand (buf, instr->reg1, instr->disp);
+            break;
+
+        case INSTR_ALU_RR:
+            emitByte (buf, rexW (instr->reg2, instr->reg1));
+            emitByte (buf, aluOpcode (instr->op));
+            emitByte (buf, modrmByte (3, instr->reg2, instr->reg1));
+            break;
+
+        case INSTR_ALU_RI:
+            emitByte (buf, rexW (RAX, instr->reg1));
+            if (INT8_MIN <= instr->imm && instr->imm <= INT8_MAX)
+            {
+                emitByte (buf, BYTE_ALU_IMM8);
+                emitByte (buf, modrmByte (3, instr->op, instr->reg1));
+                emitByte (buf, (uint64_t) instr->imm);
+                break;
+            }
+
+            emitByte  (buf, BYTE_ALU_IMM32);
+            emitByte  (buf, modrmByte (3, instr->op, instr->reg1));
+            emitImm32 (buf, instr->imm);
+            break;
+
+        case INSTR_MUL_DIV:
+            emitByte (buf, rexW (RAX, instr->reg2));
+            emitByte (buf, BYTE_GROUP_F7);
+            emitByte (buf, modrmByte (3, instr->op, instr->reg2));
+            break;
+
+        case INSTR_NEG:
+            emitByte (buf, rexW (RAX, instr->reg1));
+            emitByte (buf, BYTE_GROUP_F7);
+            emitByte (buf, modrmByte (3, 3, instr->reg1));
+            break;
+
+        case INSTR_TEST32:
+            if (instr->reg1 >= R8 || instr->reg2 >= R8)
+                emitByte (buf, rexRB (instr->reg2, instr->reg1));
+
+            emitByte (buf, BYTE_TEST);
+            emitByte (buf, modrmByte (3, instr->reg2, instr->reg1));
+            break;
+
+        case INSTR_IMUL_RR:
+            emitByte (buf, rexW (instr->reg1, instr->reg2));
+            emitByte (buf, BYTE_TWO_BYTE);
+            emitByte (buf, BYTE_IMUL);
+            emitByte (buf, modrmByte (3, instr->reg1, instr->reg2));
+            break;
+
+        case INSTR_IMUL_RI:
+            emitByte (buf, rexW (instr->reg1, instr->reg2));
+            if (INT8_MIN <= instr->imm && instr->imm <= INT8_MAX)
+            {
+                emitByte (buf, BYTE_IMUL_IMM8);
+                emitByte (buf, modrmByte (3, instr->reg1, instr->reg2));
+                emitByte (buf, (uint64_t) instr->imm);
+                break;
+            }
+
+            emitByte  (buf, BYTE_IMUL_IMM32);
+            emitByte  (buf, modrmByte (3, instr->reg1, instr->reg2));
+            emitImm32 (buf, instr->imm);
+            break;
+
+        case INSTR_LEA_SCALED:
+        {
+            uint64_t scale = (instr->imm == 8) ? 3 : (uint64_t) instr->imm / 2;
+
+            emitByte (buf, rexW (instr->reg1, instr->reg2) | ((instr->reg2 >= R8) ? BYTE_REX_X_MASK : 0));
+            emitByte (buf, BYTE_LEA);
+            emitByte (buf, modrmByte (0, instr->reg1, BYTE_SIB));
+            emitByte (buf, modrmByte (scale, instr->reg2, instr->reg2));
+            break;
+        }
+
+        case INSTR_SHIFT:
+            emitByte (buf, rexW (RAX, instr->reg1));
+            emitByte (buf, BYTE_SHIFT_IMM);
+            emitByte (buf, modrmByte (3, instr->op, instr->reg1));
+            emitByte (buf, (uint64_t) instr->imm);
+            break;
+
+        case INSTR_MOVSXD:
+            emitByte (buf, rexW (instr->reg1, instr->reg2));
+            emitByte (buf, BYTE_MOVSXD);
+            emitByte (buf, modrmByte (3, instr->reg1, instr->reg2));
+            break;
+
+        case INSTR_CQO:
+            emitByte (buf, BYTE_REX_W);
+            emitByte (buf, BYTE_CQO);
+            break;
+
+        case INSTR_JMP:
+            emitByte  (buf, JMP_OP);
+            emitFixup (buf, instr->fixup);
+            break;
+
+        case INSTR_JCC:
+            emitByte  (buf, BYTE_TWO_BYTE);
+            emitByte  (buf, instr->op);
+            emitFixup (buf, instr->fixup);
+            break;
+
+        case INSTR_CALL:
+            emitByte  (buf, CALL_OP);
+            emitFixup (buf, instr->fixup);
+            break;
+
+        case INSTR_RET:
+            if (instr->imm == 0)
+            {
+                emitByte (buf, RET_OP);
+                break;
+            }
+
+            emitByte (buf, RET_IMM16);
+            emitByte (buf, (uint64_t) instr->imm & 0xFF);
+            emitByte (buf, (uint64_t) instr->imm >> 8);
+            break;
+
+        default:
+            assert (0);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Rules
+
+static inline bool isRuntimeCall (const CodeBuf_bt* buf, const x86_instr* instr)
+{
+    return instr->kind == INSTR_CALL && buf->fixups[instr->fixup].kind == FIXUP_RUNTIME;
+}
+
+// Stack pointer moves of push and pop are not counted as writes
+static void instrRegs (const CodeBuf_bt* buf, const x86_instr* instr, uint32_t* reads, uint32_t* writes)
+{
+    *reads  = 0;
+    *writes = 0;
+
+    switch (instr->kind)
+    {
+        case INSTR_PUSH:
+            *reads = regMask (instr->reg2);
+            break;
+
+        case INSTR_POP:
+        case INSTR_MOV_RI:
+            *writes = regMask (instr->reg1);
+            break;
+
+        case INSTR_MOV_RR:
+            *reads  = regMask (instr->reg2);
+            *writes = regMask (instr->reg1);
+            break;
+
+        case INSTR_LOAD:
+        case INSTR_LEA_FRAME:
+            *reads  = regMask (RBP);
+            *writes = regMask (instr->reg1);
+            break;
+
+        case INSTR_STORE:
+            *reads = regMask (instr->reg2) | regMask (RBP);
+            break;
+
+        case INSTR_STORE_IMM:
+            *reads = regMask (RBP);
+            break;
+
+        case INSTR_ALU_RR:
+        case INSTR_ALU_RI:
+            *reads = regMask (instr->reg1);
+            if (instr->kind == INSTR_ALU_RR)
+                *reads |= regMask (instr->reg2);
+
+            if (instr->op == ALU_ADD || instr->op == ALU_SUB)
+                *writes = regMask (instr->reg1);
+            break;
+
+        case INSTR_MUL_DIV:
+            *reads  = regMask (RAX) | regMask (instr->reg2);
+            if (instr->op >= 6)
+                *reads |= regMask (RDX);
+
+            *writes = regMask (RAX) | regMask (RDX);
+            break;
+
+        case INSTR_IMUL_RR:
+            *reads  = regMask (instr->reg1) | regMask (instr->reg2);
+            *writes = regMask (instr->reg1);
+            break;
+
+        case INSTR_IMUL_RI:
+        case INSTR_LEA_SCALED:
+        case INSTR_MOVSXD:
+            *reads  = regMask (instr->reg2);
+            *writes = regMask (instr->reg1);
+            break;
+
+        case INSTR_SHIFT:
+        case INSTR_NEG:
+            *reads  = regMask (instr->reg1);
+            *writes = regMask (instr->reg1);
+            break;
+
+        case INSTR_TEST32:
+            *reads = regMask (instr->reg1) | regMask (instr->reg2);
+            break;
+
+        case INSTR_CQO:
+            *reads  = regMask (RAX);
+            *writes = regMask (RDX);
+            break;
+
+        case INSTR_CALL:
+            if (isRuntimeCall (buf, instr))
+            {
+                *reads  = regMask (RDI);
+                *writes = AllRegs & ~RuntimeKeptRegs;
+            }
+            else
+                *writes = AllRegs & ~FunctionKeptRegs;
+            break;
+
+        default:
+            break;
+    }
+}
+
+static inline size_t nextInstr (const x86_instr* instrs, size_t count, size_t pos)
+{
+    do
+        pos++;
+    while (pos < count && instrs[pos].kind == INSTR_REMOVED);
+
+    return pos;
+}
+
+static bool scratchDeadAfter (const CodeBuf_bt* buf, const x86_instr* instrs, size_t count,
+                              size_t pos, REG_NUM reg)
+{
+    assert (ScratchRegs & regMask (reg));
+
+    for (size_t i = nextInstr (instrs, count, pos); i < count; i = nextInstr (instrs, count, i))
+    {
+        uint32_t reads  = 0;
+        uint32_t writes = 0;
+        instrRegs (buf, &instrs[i], &reads, &writes);
+
+        if (reads & regMask (reg))
+            return false;
+
+        if (writes & regMask (reg))
+            return true;
+    }
+
+    return true;
+}
+
+// Block is encoded again in the bytes it had, so a rule never makes code longer
+static size_t instrSize (const x86_instr* instr)
+{
+    assert (instr->kind < INSTR_JMP);
+
+    unsigned char bytes[16] = {};
+    CodeBuf_bt    scratch   = {};
+    scratch.x86_array = bytes;
+
+    encodeInstr (&scratch, instr);
+    return scratch.BT_ip;
+}
+
+static inline bool fitsInPlace (const x86_instr* replacement, const x86_instr* first, const x86_instr* second)
+{
+    return instrSize (replacement) <= instrSize (first) + instrSize (second);
+}
+
+// push x; pop y
+static bool foldPushPop (CodeBuf_bt* buf, x86_instr* instrs, size_t count, size_t pos)
+{
+    size_t popPos = nextInstr (instrs, count, pos);
+    if (popPos == count || instrs[popPos].kind != INSTR_POP)
+        return false;
+
+    x86_instr* push = &instrs[pos];
+    REG_NUM    dest = instrs[popPos].reg1;
+    x86_instr  mov  = {};
+
+    if (push->kind == INSTR_PUSH)
+        mov = {.kind = (push->reg2 == dest) ? INSTR_REMOVED : INSTR_MOV_RR, .reg1 = dest, .reg2 = push->reg2};
+    else if (push->kind == INSTR_PUSH_IMM)
+        mov = {.kind = INSTR_MOV_RI, .reg1 = dest, .imm = push->imm};
+    else
+        return false;
+
+    // push rsi; pop rbx is 2 bytes and mov rbx, rsi is 3
+    if (!fitsInPlace (&mov, push, &instrs[popPos]))
+        return false;
+
+    *push = mov;
+
+    instrs[popPos].kind = INSTR_REMOVED;
+    buf->peepholeHits[PH_PUSH_POP]++;
+    return true;
+}
+
+// push x ... pop x when code between leaves x and the stack as they were
+static bool dropSaveRestore (CodeBuf_bt* buf, x86_instr* instrs, size_t count, size_t pos)
+{
+    if (instrs[pos].kind != INSTR_PUSH)
+        return false;
+
+    REG_NUM reg   = instrs[pos].reg2;
+    size_t  depth = 0;
+
+    for (size_t i = nextInstr (instrs, count, pos); i < count; i = nextInstr (instrs, count, i))
+    {
+        switch (instrs[i].kind)
+        {
+            case INSTR_PUSH:
+            case INSTR_PUSH_IMM:
+                depth++;
+                continue;
+
+            case INSTR_POP:
+                if (depth == 0)
+                {
+                    if (instrs[i].reg1 != reg)
+                        return false;
+
+                    instrs[pos].kind = INSTR_REMOVED;
+                    instrs[i].kind   = INSTR_REMOVED;
+                    buf->peepholeHits[PH_SAVE_RESTORE]++;
+                    return true;
+                }
+                depth--;
+                break;
+
+            // Callee takes its parameters from the stack
+            case INSTR_CALL:
+                if (!isRuntimeCall (buf, &instrs[i]))
+                    return false;
+                break;
+
+            case INSTR_JMP:
+            case INSTR_JCC:
+            case INSTR_RET:
+                return false;
+
+            default:
+                break;
+        }
+
+        uint32_t reads  = 0;
+        uint32_t writes = 0;
+        instrRegs (buf, &instrs[i], &reads, &writes);
+
+        // mov rsp, rbp and add rsp of tail call drop the stack under pop
+        if (writes & (regMask (reg) | regMask (RSP)))
+            return false;
+    }
+
+    return false;
+}
+
+// mov [rbp - n], x; mov y, [rbp - n]
+static bool forwardStore (CodeBuf_bt* buf, x86_instr* instrs, size_t count, size_t pos)
+{
+    x86_instr* store = &instrs[pos];
+    if (store->kind != INSTR_STORE && store->kind != INSTR_STORE_IMM)
+        return false;
+
+    size_t loadPos = nextInstr (instrs, count, pos);
+    if (loadPos == count || instrs[loadPos].kind != INSTR_LOAD || instrs[loadPos].disp != store->disp)
+        return false;
+
+    x86_instr* load = &instrs[loadPos];
+    x86_instr  mov  = {};
+
+    if (store->kind == INSTR_STORE)
+        mov = {.kind = (store->reg2 == load->reg1) ? INSTR_REMOVED : INSTR_MOV_RR, .reg1 = load->reg1, .reg2 = store->reg2};
+    else
+        mov = {.kind = INSTR_MOV_RI, .reg1 = load->reg1, .imm = store->imm};
+
+    // Load with disp8 is 4 bytes, mov r32, imm32 is 5
+    x86_instr removed = {.kind = INSTR_REMOVED};
+    if (!fitsInPlace (&mov, load, &removed))
+        return false;
+
+    *load = mov;
+
+    buf->peepholeHits[PH_STORE_LOAD]++;
+    return true;
+}
+
+// mov rbx, imm; op rax, rbx
+static bool foldImmOperand (CodeBuf_bt* buf, x86_instr* instrs, size_t count, size_t pos)
+{
+    x86_instr* mov = &instrs[pos];
+    if (mov->kind != INSTR_MOV_RI || !(ScratchRegs & regMask (mov->reg1)) || mov->imm > INT32_MAX)
+        return false;
+
+    // translateBaseMath loads rax between them
+    size_t aluPos = nextInstr (instrs, count, pos);
+    for (; aluPos < count; aluPos = nextInstr (instrs, count, aluPos))
+    {
+        uint32_t reads  = 0;
+        uint32_t writes = 0;
+        instrRegs (buf, &instrs[aluPos], &reads, &writes);
+
+        if (((reads | writes) & regMask (mov->reg1)) || instrs[aluPos].kind >= INSTR_JMP)
+            break;
+    }
+
+    if (aluPos == count)
+        return false;
+
+    x86_instr* alu = &instrs[aluPos];
+    if (alu->kind != INSTR_ALU_RR || alu->op == ALU_TEST || alu->reg2 != mov->reg1 || alu->reg1 == mov->reg1)
+        return false;
+
+    if (!scratchDeadAfter (buf, instrs, count, aluPos, mov->reg1))
+        return false;
+
+    // Flags of test x, x match cmp x, 0 for every condition
+    if (alu->op == ALU_CMP && mov->imm == 0)
+    {
+        alu->op   = ALU_TEST;
+        alu->reg2 = alu->reg1;
+        buf->peepholeHits[PH_CMP_ZERO]++;
+    }
+    else
+    {
+        *alu = {.kind = INSTR_ALU_RI, .reg1 = alu->reg1, .op = alu->op, .imm = mov->imm};
+        buf->peepholeHits[PH_ALU_IMM]++;
+    }
+
+    mov->kind = INSTR_REMOVED;
+    return true;
+}
+
+// mov x, y; mov y, x and mov rax, x; mov/push/store rax
+static bool foldMov (CodeBuf_bt* buf, x86_instr* instrs, size_t count, size_t pos)
+{
+    x86_instr* first = &instrs[pos];
+    if (first->kind != INSTR_MOV_RR && first->kind != INSTR_MOV_RI && first->kind != INSTR_LOAD)
+        return false;
+
+    size_t secondPos = nextInstr (instrs, count, pos);
+    if (secondPos == count)
+        return false;
+
+    x86_instr* second = &instrs[secondPos];
+
+    if (first->kind == INSTR_MOV_RR && second->kind == INSTR_MOV_RR &&
+        second->reg1 == first->reg2 && second->reg2 == first->reg1)
+    {
+        second->kind = INSTR_REMOVED;
+        buf->peepholeHits[PH_MOV_FOLD]++;
+        return true;
+    }
+
+    REG_NUM scratch = first->reg1;
+    if (!(ScratchRegs & regMask (scratch)))
+        return false;
+
+    switch (second->kind)
+    {
+        case INSTR_MOV_RR:
+            if (second->reg2 != scratch || !scratchDeadAfter (buf, instrs, count, secondPos, scratch))
+                return false;
+
+            first->reg1 = second->reg1;
+            if (first->kind == INSTR_MOV_RR && first->reg1 == first->reg2)
+                first->kind = INSTR_REMOVED;
+            break;
+
+        case INSTR_PUSH:
+            if (second->reg2 != scratch || first->kind == INSTR_LOAD || first->imm > INT32_MAX ||
+                !scratchDeadAfter (buf, instrs, count, secondPos, scratch))
+                return false;
+
+            if (first->kind == INSTR_MOV_RR)
+                *first = {.kind = INSTR_PUSH, .reg2 = first->reg2};
+            else
+                *first = {.kind = INSTR_PUSH_IMM, .imm = first->imm};
+            break;
+
+        case INSTR_STORE:
+            if (second->reg2 != scratch || first->kind == INSTR_LOAD || first->imm > INT32_MAX ||
+                !scratchDeadAfter (buf, instrs, count, secondPos, scratch))
+                return false;
+
+            if (first->kind == INSTR_MOV_RR)
+                *first = {.kind = INSTR_STORE, .reg2 = first->reg2, .disp = second->disp};
+            else
+                *first = {.kind = INSTR_STORE_IMM, .imm = first->imm, .disp = second->disp};
+            break;
+
+        default:
+            return false;
+    }
+
+    second->kind = INSTR_REMOVED;
+    buf->peepholeHits[PH_MOV_FOLD]++;
+    return true;
+}
+
+static bool applyRules (CodeBuf_bt* buf, x86_instr* instrs, size_t count, size_t pos)
+{
+    return foldPushPop     (buf, instrs, count, pos) ||
+           dropSaveRestore (buf, instrs, count, pos) ||
+           forwardStore    (buf, instrs, count, pos) ||
+           foldImmOperand  (buf, instrs, count, pos) ||
+           foldMov         (buf, instrs, count, pos);
+}
+
+//----------------------------------------------------------------------------
+
+// Every rel32 of jumps and calls is a fixup, encoding only moves its position.
+// Blocks only start at labels, so nothing jumps inside the one being rewritten
+void peepholeBlock (CodeBuf_bt* buf, size_t blockStart)
+{
+    size_t blockEnd = buf->BT_ip;
+    if (blockEnd == blockStart)
+        return;
+
+    x86_instr* instrs = (x86_instr*) calloc (blockEnd - blockStart, sizeof (x86_instr));
+    assert (instrs != NULL);
+
+    // Fixups of this block are the last ones
+    size_t fixup = buf->fixupsSize;
+    while (fixup > 0 && buf->fixups[fixup - 1].pos >= blockStart)
+        fixup--;
+
+    size_t count = 0;
+    for (size_t pos = blockStart; pos < blockEnd; count++)
+    {
+        size_t size = decodeInstr (buf, pos, &instrs[count]);
+        if (size == 0 || pos + size > blockEnd)
+        {
+            free (instrs);
+            return;
+        }
+
+        if (instrs[count].kind >= INSTR_JMP && instrs[count].kind != INSTR_RET)
+        {
+            if (fixup >= buf->fixupsSize || buf->fixups[fixup].pos != pos + size - sizeof (int32_t))
+            {
+                free (instrs);
+                return;
+            }
+
+            instrs[count].fixup = fixup++;
+        }
+
+        pos += size;
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (instrs[i].kind != INSTR_REMOVED && applyRules (buf, instrs, count, i))
+                changed = true;
+        }
+    }
+
+    buf->BT_ip = blockStart;
+    for (size_t i = 0; i < count; i++)
+    {
+        encodeInstr (buf, &instrs[i]);
+    }
+    assert (buf->BT_ip <= blockEnd);
+
+    free (instrs);
+}
+
+void dumpPeepholeStats (FILE* fileptr, const CodeBuf_bt* buf)
+{
+    fprintf (fileptr, "peephole hits:\n");
+
+    for (size_t i = 0; i < PH_RULES_COUNT; i++)
+    {
+        fprintf (fileptr, "\t%-20s %lu\n", PeepholeRuleNames[i], buf->peepholeHits[i]);
+    }
+}
@@ -1,60 +1,95 @@
+OutBufSize equ 4096         ; keep in sync with PRINTF_BUF_SIZE in BinaryTranslator.h
+
 section .text
 
 global _start
 ;=======================================
-; Entry: rdi - pointer on int
-; Exit:  none, prints int to buffer
-; Uses:  r11 - intermediate buffer for puting int there, r12 - buffer for reversing number there
+; Entry: rdi - int to print
+; Exit:  none, appends int and '\n' to output buffer
+; Uses:  r12 - output buffer: qword with number of used bytes, then OutBufSize bytes
+; Destr: rax, rbx, rcx, rdx, rsi, rdi, r11
 ;=======================================
 _start:
-	xor rbx, rbx
-    xor rcx, rcx
 	mov rax, rdi
-	mov rdi, 10
-	cmp eax, 0              ; if negative
-	jge .Loop
-	not eax
-	inc rax
-	mov cl, 0x01            ; flag for negative
-
-.Loop:
-	xor rdx, rdx
-	div rdi
-	add rdx, 0x30
-	mov byte [r11 + rbx], dl
-	inc rbx
-	cmp rax, 0x00
+	mov rbx, [r12]
+	cmp rbx, OutBufSize - 12    ; sign, 10 digits and '\n' have to fit
+	jbe .HasRoom
+	push rax
+	call Flush
+	pop rax
+	xor rbx, rbx
+
+.HasRoom:
+	lea rsi, [r12 + 8 + rbx]
+	cmp eax, 0                  ; if negative
+	jge .Positive
+	neg eax
+	mov byte [rsi], '-'
+	inc rsi
+
+.Positive:
+	mov rdi, rsi                ; first digit
+	mov eax, eax                ; only low half is the number
+	mov ecx, 0xCCCCCCCD         ; 2^35 / 10 rounded up
+
+.Loop:                          ; x / 10 = x * 0xCCCCCCCD >> 35 for every 32 bit x
+	mov edx, eax
+	imul rdx, rcx
+	shr rdx, 35
+	lea ebx, [rdx + rdx * 4]
+	add ebx, ebx
+	sub eax, ebx                ; remainder
+	add al, 0x30
+	mov byte [rsi], al
+	inc rsi
+	mov eax, edx
+	test eax, eax
 	jne .Loop
 
-	cmp cl, 0x01 				; check if number is negative
-	jne .NotNeg
-	mov byte [r11 + rbx], '-'   ;
-	inc rbx
-
-.NotNeg:
-	mov rdi, r12
-	lea rsi, [r11 + rbx - 1]
-	mov rdx, rbx
-	call MemcpyR
-    mov rdi, 1
-    mov eax, 1
-    mov rsi, r12
-    mov rdx, 5
-    syscall
-    ret
-
-MemcpyR:        ; reverses the number from r11 buff to r12 buff
-
-	push rdi
-.Loop1:
-	mov al, byte [rsi]
-	mov byte [rdi], al
+	mov byte [rsi], 0x0a
+	lea rax, [rsi + 1]
+	sub rax, r12
+	sub rax, 8
+	mov [r12], rax
 
-	dec rsi
+	dec rsi                     ; digits are reversed, swap them in place
+.Reverse:
+	cmp rdi, rsi
+	jae .Done
+	mov al, byte [rdi]
+	mov dl, byte [rsi]
+	mov byte [rdi], dl
+	mov byte [rsi], al
 	inc rdi
-	dec rdx
-	cmp rdx, 0x00
-	jne .Loop1
-	pop rax
+	dec rsi
+	jmp .Reverse
+
+.Done:
 	ret
 
+;=======================================
+; Entry: none
+; Exit:  none, writes used part of output buffer to stdout and empties it
+; Uses:  r12 - output buffer
+; Destr: rax, rcx, rdx, rsi, rdi, r11
+; Called from exit sequence at offset PRINTF_FLUSH_OFFSET
+;=======================================
+Flush:
+	mov rdx, [r12]
+	lea rsi, [r12 + 8]
+
+.Write:
+	test rdx, rdx
+	je .Flushed
+	mov eax, 1
+	mov edi, 1
+	syscall
+	test rax, rax
+	jle .Flushed                ; nothing to do on write error
+	add rsi, rax
+	sub rdx, rax
+	jmp .Write
+
+.Flushed:
+	mov qword [r12], 0
+	ret
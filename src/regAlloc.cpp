@@ -0,0 +1,300 @@
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <cstring>
+
+#include "../language/common.h"
+#include "../include/BinaryTranslator.h"
+#include "../include/regAlloc.h"
+#include "../include/irUtils.h"
+
+// Linear scan register allocation over Func_bt.
+// Every command gets a position in block order, liveness is computed on the CFG
+// and every variable gets one interval [start, end] that covers all places where it is alive.
+
+// Nothing in translator or runtime relies on these. r13, r15 and r9 survive OUT and IN,
+// the rest are trashed by runtime and pushed around it.
+static const REG_NUM AllocatableRegs[] = {R13, R15, R9, RSI, R8, RDI};
+static const size_t  NumOfAllocatableRegs = sizeof (AllocatableRegs) / sizeof (*AllocatableRegs);
+
+static const uint32_t RuntimeClobberedRegs = (1u << RSI) | (1u << R8) | (1u << RDI);
+
+static const size_t NoPos = (size_t) -1;
+
+struct Interval_ra
+{
+    size_t varIndex;
+    size_t start;
+    size_t end;
+    size_t numOfUses;
+    int    reg;         // index in AllocatableRegs or -1 if spilled
+};
+
+// Intervals
+//----------------------------------------
+static void extendInterval (Interval_ra* interval, size_t pos)
+{
+    if (interval->start == NoPos || pos < interval->start)
+        interval->start = pos;
+
+    if (interval->end == NoPos || pos > interval->end)
+        interval->end = pos;
+}
+
+static void buildIntervals (Interval_ra* intervals, const Liveness_ir* live, const Func_bt* function)
+{
+    size_t numOfVars = live->numOfVars;
+
+    for (size_t v = 0; v < numOfVars; v++)
+        intervals[v] = {v, NoPos, NoPos, 0, -1};
+
+    for (size_t b = 0; b < live->numOfBlocks; b++)
+    {
+        const Cmd_bt* cmds = blockCmds (function, &function->blockArray[b]);
+        size_t pos = live->blockStart[b] + 1;
+
+        for (size_t i = 0; i < live->blockLength[b]; i++, pos++)
+        {
+            size_t uses[2] = {};
+            size_t defVar  = 0;
+            cmdUsesAndDef (&cmds[i], uses, &defVar);
+
+            for (size_t j = 0; j < 2; j++)
+            {
+                if (uses[j] != NoVar)
+                {
+                    extendInterval (&intervals[uses[j]], pos);
+                    intervals[uses[j]].numOfUses += 1;
+                }
+            }
+
+            if (defVar != NoVar)
+                extendInterval (&intervals[defVar], pos);
+        }
+
+        for (size_t v = 0; v < numOfVars; v++)
+        {
+            if (live->liveIn[b * numOfVars + v])
+                extendInterval (&intervals[v], live->blockStart[b]);
+
+            if (live->liveOut[b * numOfVars + v])
+                extendInterval (&intervals[v], live->blockEnd[b]);
+        }
+    }
+}
+
+static int compareByStart (const void* first, const void* second)
+{
+    const Interval_ra* a = *(const Interval_ra* const*) first;
+    const Interval_ra* b = *(const Interval_ra* const*) second;
+
+    if (a->start != b->start)
+        return (a->start < b->start) ? -1 : 1;
+
+    return (a->varIndex < b->varIndex) ? -1 : (a->varIndex > b->varIndex);
+}
+//----------------------------------------
+
+// Linear scan
+//----------------------------------------
+static void linearScan (Interval_ra* intervals, size_t numOfVars)
+{
+    Interval_ra** sorted = (Interval_ra**) calloc (numOfVars + 1, sizeof (*sorted));
+    assert (sorted != NULL);
+
+    size_t numOfSorted = 0;
+    for (size_t v = 0; v < numOfVars; v++)
+    {
+        // Values that are never read don't deserve a register
+        if (intervals[v].numOfUses > 0)
+            sorted[numOfSorted++] = &intervals[v];
+    }
+
+    qsort (sorted, numOfSorted, sizeof (*sorted), compareByStart);
+
+    Interval_ra* active[NumOfAllocatableRegs] = {};   // sorted by end
+    size_t numOfActive = 0;
+    bool   regIsFree[NumOfAllocatableRegs] = {};
+
+    for (size_t r = 0; r < NumOfAllocatableRegs; r++)
+        regIsFree[r] = true;
+
+    for (size_t i = 0; i < numOfSorted; i++)
+    {
+        Interval_ra* cur = sorted[i];
+
+        // Operands are read before dest is written, so interval that ends here can give its register
+        size_t expired = 0;
+        while (expired < numOfActive && active[expired]->end <= cur->start)
+        {
+            regIsFree[active[expired]->reg] = true;
+            expired++;
+        }
+        memmove (active, active + expired, (numOfActive - expired) * sizeof (*active));
+        numOfActive -= expired;
+
+        if (numOfActive == NumOfAllocatableRegs)
+        {
+            Interval_ra* spill = active[numOfActive - 1];
+            if (spill->end <= cur->end)
+                continue;
+
+            cur->reg   = spill->reg;
+            spill->reg = -1;
+            numOfActive -= 1;
+        }
+        else
+        {
+            for (size_t r = 0; r < NumOfAllocatableRegs; r++)
+            {
+                if (regIsFree[r])
+                {
+                    cur->reg     = (int) r;
+                    regIsFree[r] = false;
+                    break;
+                }
+            }
+        }
+
+        size_t insertPos = numOfActive;
+        while (insertPos > 0 && active[insertPos - 1]->end > cur->end)
+        {
+            active[insertPos] = active[insertPos - 1];
+            insertPos--;
+        }
+        active[insertPos] = cur;
+        numOfActive += 1;
+    }
+
+    free (sorted);
+}
+//----------------------------------------
+
+static bool isCrossing (const Interval_ra* interval, size_t pos)
+{
+    return interval->start != NoPos && interval->start < pos && pos < interval->end;
+}
+
+static void addFrameSlot (Func_bt* function, Var_bt* var)
+{
+    function->frameSize += 8;
+    var->offset = (int) function->frameSize;
+}
+
+// CALL, OUT and IN clobber registers, mark what has to be saved around them
+static void markLiveRegs (Func_bt* function, const Liveness_ir* live, const Interval_ra* intervals)
+{
+    bool needSaveArea = false;
+
+    for (size_t b = 0; b < live->numOfBlocks; b++)
+    {
+        Cmd_bt* cmds = blockCmds (function, &function->blockArray[b]);
+        size_t  pos  = live->blockStart[b] + 1;
+
+        for (size_t i = 0; i < live->blockLength[b]; i++, pos++)
+        {
+            Cmd_bt* cmd = &cmds[i];
+            unsigned int operation = cmd->opCode.operation;
+
+            if (operation != OP_CALL && operation != OP_OUT && operation != OP_IN && operation != OP_RET)
+                continue;
+
+            uint32_t liveRegs = 0;
+            for (size_t v = 0; v < live->numOfVars; v++)
+            {
+                if (!isCrossing (&intervals[v], pos))
+                    continue;
+
+                Var_bt* var = &function->varArray[v];
+
+                if (var->location == Allocated)
+                    liveRegs |= 1u << var->reg;
+
+                // Call result waits in rcx, which doesn't survive calls and RET
+                else if (var->location == Register)
+                {
+                    var->location = Memory;
+                    addFrameSlot (function, var);
+                }
+            }
+
+            if (operation == OP_OUT || operation == OP_IN)
+                liveRegs &= RuntimeClobberedRegs;
+
+            if (operation == OP_CALL && liveRegs)
+                needSaveArea = true;
+
+            if (operation != OP_RET)
+                cmd->liveRegs = liveRegs;
+        }
+    }
+
+    if (needSaveArea)
+    {
+        function->saveAreaOffset = function->frameSize;
+        function->frameSize     += NumOfAllocatableRegs * 8;
+    }
+}
+
+size_t regSaveOffset (const Func_bt* function, REG_NUM reg)
+{
+    assert (function != NULL);
+
+    for (size_t r = 0; r < NumOfAllocatableRegs; r++)
+    {
+        if (AllocatableRegs[r] == reg)
+            return function->saveAreaOffset + (r + 1) * 8;
+    }
+
+    assert (0);
+    return 0;
+}
+
+static void allocateFunctionRegisters (Func_bt* function)
+{
+    assert (function != NULL);
+
+    Liveness_ir live = {};
+    livenessCtor (&live, function);
+    computeLiveness (&live, function);
+
+    Interval_ra* intervals = (Interval_ra*) calloc (live.numOfVars + 1, sizeof (*intervals));
+    assert (intervals != NULL);
+
+    buildIntervals (intervals, &live, function);
+    linearScan (intervals, live.numOfVars);
+
+    for (size_t v = 0; v < live.numOfVars; v++)
+    {
+        if (intervals[v].reg < 0)
+            continue;
+
+        function->varArray[v].location = Allocated;
+        function->varArray[v].reg      = AllocatableRegs[intervals[v].reg];
+    }
+
+    markLiveRegs (function, &live, intervals);
+
+    free (intervals);
+    livenessDtor (&live);
+}
+
+// Job of the pool
+static void allocateRegistersJob (void* arg, size_t index)
+{
+    Func_bt* function = &((BinaryTranslator*) arg)->funcArray[index];
+    if (!function->ctx.cached)
+        allocateFunctionRegisters (function);
+}
+
+void allocateRegisters (BinaryTranslator* binTranslator)
+{
+    assert (binTranslator != NULL);
+
+    threadPoolRun (&binTranslator->pool, allocateRegistersJob, binTranslator, binTranslator->funcArraySize);
+    timePhase (binTranslator, "register allocation", 0);
+}
@@ -0,0 +1,83 @@
+InBufSize equ 4096          ; keep in sync with SCANF_BUF_SIZE in BinaryTranslator.h
+
+section .text
+
+global _start
+;=======================================
+; Entry: rdi - pointer on qword for int
+; Exit:  none, reads int from input buffer, 0 if input is over
+; Uses:  r14 - input buffer: qword read position, qword number of bytes in buffer, then InBufSize bytes
+; Destr: rax, rbx, rcx, rdx, rsi, r8, r11
+;=======================================
+_start:
+	push rdi
+	xor r8, r8
+	xor ebx, ebx                ; flag for negative
+
+.Skip:                          ; everything before number is skipped
+	call Peek
+	cmp eax, -1
+	je .Store
+	cmp eax, '-'
+	je .Minus
+	sub eax, 0x30
+	cmp eax, 9
+	jbe .Loop
+	inc qword [r14]
+	jmp .Skip
+
+.Minus:
+	inc qword [r14]
+	mov ebx, 1
+
+.Loop:                          ; Peek refills buffer, so number may be split between reads
+	call Peek
+	sub eax, 0x30
+	cmp eax, 9                  ; end of input and non digits are above 9 as unsigned
+	ja .Store
+	inc qword [r14]
+	imul r8, r8, 10
+	add r8, rax
+	jmp .Loop
+
+.Store:
+	test ebx, ebx
+	je .NotNeg
+	neg r8
+
+.NotNeg:
+	pop rdi
+	mov qword [rdi], r8
+	ret
+
+;=======================================
+; Entry: none
+; Exit:  eax - next char of input, -1 if input is over. Char is not consumed
+; Uses:  r14 - input buffer
+; Destr: rcx, rdx, rsi, rdi, r11
+;=======================================
+Peek:
+	mov rcx, [r14]
+	cmp rcx, [r14 + 8]
+	jb .Ready
+
+	xor eax, eax                ; read whole block from stdin
+	xor edi, edi
+	lea rsi, [r14 + 16]
+	mov edx, InBufSize
+	syscall
+
+	xor ecx, ecx
+	mov [r14], rcx
+	test rax, rax
+	jg .Filled
+	mov [r14 + 8], rcx          ; nothing was read
+	mov eax, -1
+	ret
+
+.Filled:
+	mov [r14 + 8], rax
+
+.Ready:
+	movzx eax, byte [r14 + 16 + rcx]
+	ret
@@ -0,0 +1,214 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cassert>
+#include <cstring>
+
+#include "../include/symTable.h"
+#include "../include/arena.h"
+
+// Both tables use linear probing over power of two capacity and grow twice
+// when they are half full.
+
+static const size_t StartCapacity = 64;
+
+static size_t hashName (const char* name)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    for (; *name; name++)
+    {
+        hash ^= (unsigned char) *name;
+        hash *= 0x100000001b3;
+    }
+
+    return (size_t) hash;
+}
+
+static inline size_t hashSym (Sym_bt sym)
+{
+    return (size_t) ((uint64_t) sym * 0x9E3779B97F4A7C15);
+}
+
+static Sym_bt* allocSlots (size_t capacity)
+{
+    Sym_bt* slots = (Sym_bt*) malloc (capacity * sizeof (*slots));
+    assert (slots != NULL);
+
+    for (size_t i = 0; i < capacity; i++)
+        slots[i] = NoSym;
+
+    return slots;
+}
+
+// Names
+//----------------------------------------
+static size_t findSlot (const SymTable_bt* table, const char* name, size_t hash)
+{
+    size_t mask = table->slotsCapacity - 1;
+    size_t slot = hash & mask;
+
+    while (table->slots[slot] != NoSym && strcmp (table->names[table->slots[slot]], name) != 0)
+        slot = (slot + 1) & mask;
+
+    return slot;
+}
+
+static void growSlots (SymTable_bt* table)
+{
+    Sym_bt* oldSlots    = table->slots;
+    size_t  oldCapacity = table->slotsCapacity;
+
+    table->slotsCapacity = oldCapacity ? oldCapacity * 2 : StartCapacity;
+    table->slots         = allocSlots (table->slotsCapacity);
+
+    for (size_t i = 0; i < oldCapacity; i++)
+    {
+        if (oldSlots[i] == NoSym)
+            continue;
+
+        const char* name = table->names[oldSlots[i]];
+        table->slots[findSlot (table, name, hashName (name))] = oldSlots[i];
+    }
+
+    free (oldSlots);
+}
+
+void symTableCtor (SymTable_bt* table, Arena_bt* arena)
+{
+    assert (table != NULL);
+    assert (arena != NULL);
+
+    *table = {};
+    table->arena = arena;
+    pthread_mutex_init (&table->lock, NULL);
+}
+
+Sym_bt internName (SymTable_bt* table, const char* name)
+{
+    assert (table != NULL);
+    assert (name  != NULL);
+
+    pthread_mutex_lock (&table->lock);
+
+    if (2 * (table->namesSize + 1) > table->slotsCapacity)
+        growSlots (table);
+
+    size_t slot = findSlot (table, name, hashName (name));
+    if (table->slots[slot] != NoSym)
+    {
+        Sym_bt sym = table->slots[slot];
+        pthread_mutex_unlock (&table->lock);
+        return sym;
+    }
+
+    if (table->namesSize >= table->namesCapacity)
+    {
+        table->namesCapacity = table->namesCapacity ? table->namesCapacity * 2 : StartCapacity;
+        table->names = (char**) realloc (table->names, table->namesCapacity * sizeof (*table->names));
+        assert (table->names != NULL);
+    }
+
+    Sym_bt sym = table->namesSize++;
+    table->names[sym]  = arenaStrdup (table->arena, name);
+    table->slots[slot] = sym;
+
+    pthread_mutex_unlock (&table->lock);
+    return sym;
+}
+
+// names may be moved by internName in other thread
+const char* symName (SymTable_bt* table, Sym_bt sym)
+{
+    assert (table != NULL);
+
+    pthread_mutex_lock (&table->lock);
+    assert (sym < table->namesSize);
+    const char* name = table->names[sym];
+    pthread_mutex_unlock (&table->lock);
+
+    return name;
+}
+
+void symTableDtor (SymTable_bt* table)
+{
+    free (table->names);
+    free (table->slots);
+    pthread_mutex_destroy (&table->lock);
+    *table = {};
+}
+//----------------------------------------
+
+// Maps
+//----------------------------------------
+static size_t findKey (const SymMap_bt* map, Sym_bt key)
+{
+    size_t mask = map->capacity - 1;
+    size_t slot = hashSym (key) & mask;
+
+    while (map->keys[slot] != NoSym && map->keys[slot] != key)
+        slot = (slot + 1) & mask;
+
+    return slot;
+}
+
+static void growMap (SymMap_bt* map)
+{
+    Sym_bt* oldKeys     = map->keys;
+    size_t* oldValues   = map->values;
+    size_t  oldCapacity = map->capacity;
+
+    map->capacity = oldCapacity ? oldCapacity * 2 : StartCapacity;
+    map->keys     = allocSlots (map->capacity);
+    map->values   = (size_t*) malloc (map->capacity * sizeof (*map->values));
+    assert (map->values != NULL);
+
+    for (size_t i = 0; i < oldCapacity; i++)
+    {
+        if (oldKeys[i] == NoSym)
+            continue;
+
+        size_t slot = findKey (map, oldKeys[i]);
+        map->keys[slot]   = oldKeys[i];
+        map->values[slot] = oldValues[i];
+    }
+
+    free (oldKeys);
+    free (oldValues);
+}
+
+// Value of a key that is already there is replaced
+void symMapAdd (SymMap_bt* map, Sym_bt key, size_t value)
+{
+    assert (map != NULL);
+    assert (key != NoSym);
+
+    if (2 * (map->size + 1) > map->capacity)
+        growMap (map);
+
+    size_t slot = findKey (map, key);
+    if (map->keys[slot] == NoSym)
+        map->size += 1;
+
+    map->keys[slot]   = key;
+    map->values[slot] = value;
+}
+
+size_t symMapFind (const SymMap_bt* map, Sym_bt key)
+{
+    assert (map != NULL);
+
+    if (map->capacity == 0)
+        return NotFound;
+
+    size_t slot = findKey (map, key);
+    return (map->keys[slot] == NoSym) ? NotFound : map->values[slot];
+}
+
+void symMapDtor (SymMap_bt* map)
+{
+    free (map->keys);
+    free (map->values);
+    *map = {};
+}
+//----------------------------------------
@@ -0,0 +1,204 @@
+#include <cstddef>
+#include <cstdlib>
+#include <cassert>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../include/threadPool.h"
+
+// Jobs of a batch are dealt to queues of workers round robin. Worker runs
+// its own jobs from the tail and when they are over steals from the head of
+// others, so a long job does not leave the rest of its queue waiting. Jobs
+// don't add new ones, so a worker that finds every queue empty is done.
+
+// Queues
+//----------------------------------------
+static void reserveTasks (TaskQueue_bt* queue, size_t capacity)
+{
+    if (capacity <= queue->capacity)
+        return;
+
+    queue->tasks = (size_t*) realloc (queue->tasks, capacity * sizeof (*queue->tasks));
+    assert (queue->tasks != NULL);
+    queue->capacity = capacity;
+}
+
+static bool popTask (TaskQueue_bt* queue, size_t* task)
+{
+    pthread_mutex_lock (&queue->lock);
+
+    bool found = queue->head < queue->tail;
+    if (found)
+        *task = queue->tasks[--queue->tail];
+
+    pthread_mutex_unlock (&queue->lock);
+    return found;
+}
+
+static bool stealTask (TaskQueue_bt* queue, size_t* task)
+{
+    pthread_mutex_lock (&queue->lock);
+
+    bool found = queue->head < queue->tail;
+    if (found)
+        *task = queue->tasks[queue->head++];
+
+    pthread_mutex_unlock (&queue->lock);
+    return found;
+}
+//----------------------------------------
+
+// Workers
+//----------------------------------------
+static void runJobs (ThreadPool_bt* pool, size_t self)
+{
+    size_t task = 0;
+
+    while (true)
+    {
+        bool found = popTask (&pool->workers[self].queue, &task);
+
+        for (size_t i = 1; !found && i < pool->numOfWorkers; i++)
+            found = stealTask (&pool->workers[(self + i) % pool->numOfWorkers].queue, &task);
+
+        if (!found)
+            return;
+
+        pool->job (pool->arg, task);
+    }
+}
+
+static void* workerMain (void* arg)
+{
+    Worker_bt*     worker = (Worker_bt*) arg;
+    ThreadPool_bt* pool   = worker->pool;
+    size_t         seen   = 0;
+
+    pthread_mutex_lock (&pool->lock);
+    while (true)
+    {
+        while (pool->batch == seen && !pool->stop)
+            pthread_cond_wait (&pool->start, &pool->lock);
+
+        if (pool->stop)
+            break;
+
+        seen = pool->batch;
+        pthread_mutex_unlock (&pool->lock);
+
+        runJobs (pool, worker->index);
+
+        pthread_mutex_lock (&pool->lock);
+        pool->numOfBusy -= 1;
+        if (pool->numOfBusy == 0)
+            pthread_cond_signal (&pool->done);
+    }
+    pthread_mutex_unlock (&pool->lock);
+
+    return NULL;
+}
+//----------------------------------------
+
+void threadPoolCtor (ThreadPool_bt* pool, size_t numOfThreads)
+{
+    assert (pool != NULL);
+
+    if (numOfThreads == 0)
+    {
+        long online  = sysconf (_SC_NPROCESSORS_ONLN);
+        numOfThreads = (online > 0) ? (size_t) online : 1;
+    }
+
+    *pool = {};
+    pool->numOfWorkers = numOfThreads;
+    pool->workers      = (Worker_bt*) calloc (numOfThreads, sizeof (*pool->workers));
+    assert (pool->workers != NULL);
+
+    pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init  (&pool->start, NULL);
+    pthread_cond_init  (&pool->done, NULL);
+
+    for (size_t i = 0; i < numOfThreads; i++)
+    {
+        pool->workers[i].pool  = pool;
+        pool->workers[i].index = i;
+        pthread_mutex_init (&pool->workers[i].queue.lock, NULL);
+    }
+
+    for (size_t i = 1; i < numOfThreads; i++)
+    {
+        int error = pthread_create (&pool->workers[i].thread, NULL, workerMain, &pool->workers[i]);
+        assert (error == 0);
+    }
+}
+
+// Calling thread takes part in the batch and returns when all jobs are done
+void threadPoolRun (ThreadPool_bt* pool, Job_bt job, void* arg, size_t numOfJobs)
+{
+    assert (pool != NULL);
+    assert (job  != NULL);
+
+    if (pool->numOfWorkers <= 1 || numOfJobs <= 1)
+    {
+        for (size_t i = 0; i < numOfJobs; i++)
+            job (arg, i);
+
+        return;
+    }
+
+    size_t perWorker = numOfJobs / pool->numOfWorkers + 1;
+    for (size_t w = 0; w < pool->numOfWorkers; w++)
+    {
+        TaskQueue_bt* queue = &pool->workers[w].queue;
+        reserveTasks (queue, perWorker);
+        queue->head = 0;
+        queue->tail = 0;
+    }
+
+    // Reversed, so owners start from the first jobs they got
+    for (size_t i = numOfJobs; i-- > 0;)
+    {
+        TaskQueue_bt* queue = &pool->workers[i % pool->numOfWorkers].queue;
+        queue->tasks[queue->tail++] = i;
+    }
+
+    pthread_mutex_lock (&pool->lock);
+    pool->job       = job;
+    pool->arg       = arg;
+    pool->numOfBusy = pool->numOfWorkers - 1;
+    pool->batch    += 1;
+    pthread_cond_broadcast (&pool->start);
+    pthread_mutex_unlock (&pool->lock);
+
+    runJobs (pool, 0);
+
+    pthread_mutex_lock (&pool->lock);
+    while (pool->numOfBusy > 0)
+        pthread_cond_wait (&pool->done, &pool->lock);
+    pthread_mutex_unlock (&pool->lock);
+}
+
+void threadPoolDtor (ThreadPool_bt* pool)
+{
+    assert (pool != NULL);
+
+    pthread_mutex_lock (&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast (&pool->start);
+    pthread_mutex_unlock (&pool->lock);
+
+    for (size_t i = 1; i < pool->numOfWorkers; i++)
+        pthread_join (pool->workers[i].thread, NULL);
+
+    for (size_t i = 0; i < pool->numOfWorkers; i++)
+    {
+        pthread_mutex_destroy (&pool->workers[i].queue.lock);
+        free (pool->workers[i].queue.tasks);
+    }
+
+    pthread_cond_destroy  (&pool->start);
+    pthread_cond_destroy  (&pool->done);
+    pthread_mutex_destroy (&pool->lock);
+    free (pool->workers);
+    *pool = {};
+}
@@ -0,0 +1,110 @@
+#include <cstddef>
+#include <cstdlib>
+#include <cassert>
+#include <time.h>
+
+#include "../language/common.h"
+#include "../include/BinaryTranslator.h"
+#include "../include/timeReport.h"
+
+// Every phase ends with timePhase, which takes everything since the end of
+// the previous one, so the phases cover the whole run without gaps.
+// Allocations are counted in the main arena and arenas of functions, both
+// only grow until IRdtor. Phases run between batches of the pool, so arenas
+// of functions are not changed while they are read.
+
+static const size_t StartPhasesCapacity = 32;
+
+static void arenaTotals (const BinaryTranslator* binTranslator, size_t* numOfAllocs, size_t* bytesAllocated)
+{
+    *numOfAllocs    = binTranslator->arena.numOfAllocs;
+    *bytesAllocated = binTranslator->arena.bytesAllocated;
+
+    for (size_t i = 0; i < binTranslator->funcArraySize; i++)
+    {
+        *numOfAllocs    += binTranslator->funcArray[i].ctx.arena.numOfAllocs;
+        *bytesAllocated += binTranslator->funcArray[i].ctx.arena.bytesAllocated;
+    }
+}
+
+static double secondsBetween (timespec start, timespec end)
+{
+    return (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+void timeReportCtor (BinaryTranslator* binTranslator, bool enabled)
+{
+    assert (binTranslator != NULL);
+
+    TimeReport_bt* report = &binTranslator->timeReport;
+    *report = {};
+    report->enabled = enabled;
+
+    clock_gettime (CLOCK_MONOTONIC, &report->lapStart);
+    arenaTotals (binTranslator, &report->lapAllocs, &report->lapBytes);
+}
+
+// Does nothing without --time-report, so phases are marked unconditionally
+void timePhase (BinaryTranslator* binTranslator, const char* name, size_t outBytes)
+{
+    assert (binTranslator != NULL);
+    assert (name          != NULL);
+
+    TimeReport_bt* report = &binTranslator->timeReport;
+    if (!report->enabled)
+        return;
+
+    timespec now = {};
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    size_t numOfAllocs    = 0;
+    size_t bytesAllocated = 0;
+    arenaTotals (binTranslator, &numOfAllocs, &bytesAllocated);
+
+    if (report->phasesSize >= report->phasesCapacity)
+    {
+        report->phasesCapacity = report->phasesCapacity ? report->phasesCapacity * 2 : StartPhasesCapacity;
+        report->phases = (Phase_bt*) realloc (report->phases, report->phasesCapacity * sizeof (*report->phases));
+        assert (report->phases != NULL);
+    }
+
+    report->phases[report->phasesSize++] = {name, secondsBetween (report->lapStart, now),
+                                            numOfAllocs - report->lapAllocs, bytesAllocated - report->lapBytes,
+                                            outBytes};
+
+    report->lapStart  = now;
+    report->lapAllocs = numOfAllocs;
+    report->lapBytes  = bytesAllocated;
+}
+
+void dumpTimeReport (FILE* fileptr, const TimeReport_bt* report)
+{
+    assert (fileptr != NULL);
+    assert (report  != NULL);
+
+    Phase_bt total = {"total", 0, 0, 0, 0};
+
+    fprintf (fileptr, "%-24s %12s %10s %12s %12s\n", "phase", "time, ms", "allocs", "alloc bytes", "out bytes");
+    for (size_t i = 0; i < report->phasesSize; i++)
+    {
+        const Phase_bt* phase = &report->phases[i];
+        fprintf (fileptr, "%-24s %12.3f %10lu %12lu %12lu\n", phase->name, phase->seconds * 1e3,
+                 phase->numOfAllocs, phase->bytesAllocated, phase->outBytes);
+
+        total.seconds        += phase->seconds;
+        total.numOfAllocs    += phase->numOfAllocs;
+        total.bytesAllocated += phase->bytesAllocated;
+        total.outBytes       += phase->outBytes;
+    }
+
+    fprintf (fileptr, "%-24s %12.3f %10lu %12lu %12lu\n", total.name, total.seconds * 1e3,
+             total.numOfAllocs, total.bytesAllocated, total.outBytes);
+}
+
+void timeReportDtor (TimeReport_bt* report)
+{
+    assert (report != NULL);
+
+    free (report->phases);
+    *report = {};
+}
@@ -8,151 +8,353 @@
 #include <cstdlib>
 #include <cassert>
 #include <cstring>
+#include <cstdarg>
 #include <sys/types.h>
 
 #include "../language/common.h"
 #include "../include/BinaryTranslator.h"
 #include "../include/translator.h"
+#include "../include/regAlloc.h"
+#include "../include/peephole.h"
+#include "../include/irUtils.h"
+#include "../include/threadPool.h"
+#include "../include/codeCache.h"
 
 extern Configuration Config;
 
-static size_t calcBlockOffset (BinaryTranslator* binTranslator, char* name);
-static inline void writeCmdIntoArray (BinaryTranslator* binTranslator, x86_cmd cmd);
+static inline void writeCmdIntoArray (CodeBuf_bt* buf, x86_cmd cmd);
 
-void dumpx86Buf (BinaryTranslator* binTranslator, size_t start, size_t end)
+static const size_t StartCodeCapacity   = 4096;
+static const size_t StartFixupsCapacity = 64;
+
+// Text for DebugAsm.s, fileptr is NULL without --dump asm and nothing is formatted
+static void asmPrintf (FILE* fileptr, const char* format, ...) __attribute__ ((format (printf, 2, 3)));
+
+static void asmPrintf (FILE* fileptr, const char* format, ...)
+{
+    if (fileptr == NULL)
+        return;
+
+    va_list args;
+    va_start (args, format);
+    vfprintf (fileptr, format, args);
+    va_end (args);
+}
+
+void dumpx86Buf (CodeBuf_bt* buf, size_t start, size_t end)
 {
-    printf ("dump current ip = %lu, current size = %lu\n", binTranslator->BT_ip, binTranslator->x86_arraySize);
+    printf ("dump current ip = %lu, current size = %lu\n", buf->BT_ip, buf->x86_arraySize);
 
-    if (end >= binTranslator->BT_ip)
-        end = binTranslator->BT_ip;
+    if (end >= buf->BT_ip)
+        end = buf->BT_ip;
 
     for (size_t i = start; i < end; i++)
     {
-        printf ("%02x ", binTranslator->x86_array[i]);
+        printf ("%02x ", buf->x86_array[i]);
     }
     printf ("\n");
 }
 
-static inline void writeCmdIntoArray (BinaryTranslator* binTranslator, x86_cmd cmd)
+// x86_array grows twice when there are less than size bytes after BT_ip
+static inline void reserveCode (CodeBuf_bt* buf, size_t size)
 {
-    *(uint64_t*)(binTranslator->x86_array + binTranslator->BT_ip) = cmd.code;
-    binTranslator->BT_ip += cmd.size;
+    if (buf->BT_ip + size <= buf->x86_arrayCapacity)
+        return;
+
+    size_t capacity = buf->x86_arrayCapacity ? buf->x86_arrayCapacity : StartCodeCapacity;
+    while (buf->BT_ip + size > capacity)
+        capacity *= 2;
+
+    buf->x86_array = (unsigned char*) realloc (buf->x86_array, capacity);
+    assert (buf->x86_array != NULL);
+    buf->x86_arrayCapacity = capacity;
+}
+
+static inline void writeCmdIntoArray (CodeBuf_bt* buf, x86_cmd cmd)
+{
+    reserveCode (buf, sizeof (cmd.code));
+    *(uint64_t*)(buf->x86_array + buf->BT_ip) = cmd.code;
+    buf->BT_ip += cmd.size;
 }
 
-static inline void writeImm32 (BinaryTranslator* binTranslator, int number)
+static inline void writeImm32 (CodeBuf_bt* buf, int number)
 {
+    reserveCode (buf, sizeof (int));
     for (size_t i = 0; i < sizeof(int); ++i)
     {
-        *(binTranslator->x86_array + binTranslator->BT_ip) = (unsigned char) number & 0xff;
+        *(buf->x86_array + buf->BT_ip) = (unsigned char) number & 0xff;
         number >>= 8;
-        binTranslator->BT_ip += 1;
+        buf->BT_ip += 1;
     }
 }
 
-static inline void writeImm64 (BinaryTranslator* binTranslator, uint64_t number)
+static inline void writeImm64 (CodeBuf_bt* buf, uint64_t number)
 {
+    reserveCode (buf, sizeof (uint64_t));
     for (size_t i = 0; i < sizeof(uint64_t); ++i)
     {
-        *(binTranslator->x86_array + binTranslator->BT_ip) = (unsigned char) number & 0xff;
+        *(buf->x86_array + buf->BT_ip) = (unsigned char) number & 0xff;
         number >>= 8;
-        binTranslator->BT_ip += 1;
+        buf->BT_ip += 1;
+    }
+}
+
+static inline void patchImm32 (CodeBuf_bt* buf, size_t pos, int number)
+{
+    memcpy (buf->x86_array + pos, &number, sizeof (number));
+}
+
+static inline void patchImm64 (CodeBuf_bt* buf, size_t pos, uint64_t number)
+{
+    memcpy (buf->x86_array + pos, &number, sizeof (number));
+}
+
+static inline void addFixup (CodeBuf_bt* buf, Fixup_bt fixup)
+{
+    if (buf->fixupsSize >= buf->fixupsCapacity)
+    {
+        size_t capacity = buf->fixupsCapacity ? buf->fixupsCapacity * 2 : StartFixupsCapacity;
+
+        buf->fixups = (Fixup_bt*) realloc (buf->fixups, capacity * sizeof (*buf->fixups));
+        assert (buf->fixups != NULL);
+        buf->fixupsCapacity = capacity;
     }
+
+    buf->fixups[buf->fixupsSize++] = fixup;
+}
+
+// rel32 is written as zero and filled by resolveFixups when all code is emitted
+static inline void writeFixup (CodeBuf_bt* buf, FIXUP_KIND kind, Block_bt* block, size_t runtimeOffset)
+{
+    addFixup (buf, {kind, buf->BT_ip, block, runtimeOffset});
+    writeImm32 (buf, 0);
+}
+
+static inline void writeBlockAddress (CodeBuf_bt* buf, Block_bt* block)
+{
+    writeFixup (buf, FIXUP_BLOCK, block, 0);
 }
 
-static inline void writeRelAddress (BinaryTranslator* binTranslator, size_t curPos, size_t destPos)
+static inline void writeRuntimeAddress (CodeBuf_bt* buf, size_t runtimeOffset)
 {
-    int icurPos = (int) curPos;
-    int idestPos = (int) destPos;
+    writeFixup (buf, FIXUP_RUNTIME, NULL, runtimeOffset);
+}
 
-    writeImm32(binTranslator, idestPos - icurPos - (int) sizeof(int));
+// Low three bits of register number, REX prefix carries the fourth one
+static inline uint64_t regBits (REG_NUM reg)
+{
+    return (uint64_t) reg & 7;
 }
 
-static inline void write_push_reg (BinaryTranslator* binTranslator, REG_NUM reg)
+static inline void write_push_reg (CodeBuf_bt* buf, REG_NUM reg)
 {
+    if (reg >= R8)
+    {
+        x86_cmd cmd =
+        {
+            .code = REX_B + ((PUSH_REG + regBits (reg)) << BYTE(1)),
+            .size = SIZE_REX_PREFIX + SIZE_PUSH_REG,
+        };
+        writeCmdIntoArray (buf, cmd);
+        return;
+    }
+
     x86_cmd cmd =
     {
         .code = PUSH_REG + reg,
         .size = SIZE_PUSH_REG,
     };
-    writeCmdIntoArray (binTranslator, cmd);
+    writeCmdIntoArray (buf, cmd);
 }
 
-static inline void write_pop_reg (BinaryTranslator* binTranslator, REG_NUM reg)
+static inline void write_pop_reg (CodeBuf_bt* buf, REG_NUM reg)
 {
+    if (reg >= R8)
+    {
+        x86_cmd cmd =
+        {
+            .code = REX_B + ((POP_REG + regBits (reg)) << BYTE(1)),
+            .size = SIZE_REX_PREFIX + SIZE_POP_REG,
+        };
+        writeCmdIntoArray (buf, cmd);
+        return;
+    }
+
     x86_cmd cmd =
     {
         .code = POP_REG + reg,
         .size = SIZE_POP_REG,
     };
-    writeCmdIntoArray (binTranslator, cmd);
+    writeCmdIntoArray (buf, cmd);
 }
 
-static inline void write_push_num (BinaryTranslator* binTranslator, int number)
+static inline void write_push_num (CodeBuf_bt* buf, int number)
 {
     x86_cmd cmd =
     {
         .code = PUSH_32b,
         .size = SIZE_PUSH_32b,
     };
-    writeCmdIntoArray (binTranslator, cmd);
-    writeImm32 (binTranslator, number);
+    writeCmdIntoArray (buf, cmd);
+    writeImm32 (buf, number);
+}
+
+// ModRM and displacement of [rbp - offset], reg goes to the reg field.
+// Params have negative offset, they are over return address
+static inline void write_frame_operand (CodeBuf_bt* buf, int offset, REG_NUM reg)
+{
+    if (-128 <= -offset && -offset <= 127)
+    {
+        x86_cmd cmd =
+        {
+            .code = RBP_DISP8_MASK + (regBits (reg) << 3) + ((uint64_t) (uint8_t) -offset << BYTE(1)),
+            .size = 2,
+        };
+        writeCmdIntoArray (buf, cmd);
+        return;
+    }
+
+    x86_cmd cmd =
+    {
+        .code = RBP_DISP32_MASK + (regBits (reg) << 3),
+        .size = 1,
+    };
+    writeCmdIntoArray (buf, cmd);
+    writeImm32 (buf, -offset);
+}
+
+static inline uint64_t rexR (REG_NUM reg)
+{
+    return (reg >= R8) ? (uint64_t) REX_R_MASK : 0;
 }
 
-static inline void write_mov_mem_imm (BinaryTranslator* binTranslator, size_t offset, int number)
+static inline void write_mov_mem_imm (CodeBuf_bt* buf, int offset, int number)
 {
 
     x86_cmd cmd =
     {
-        .code = MOV_MEM_IMM - ((offset - 1) << BYTE(3)),
-        .size = SIZE_MOV_MEM_IMM ,
+        .code = MOV_MEM_IMM,
+        .size = SIZE_MOV_MEM_IMM,
     };
-    writeCmdIntoArray (binTranslator, cmd);
-    writeImm32 (binTranslator, number);
+    writeCmdIntoArray (buf, cmd);
+    write_frame_operand (buf, offset, RAX);
+    writeImm32 (buf, number);
 }
 
-static inline void write_mov_mem_reg (BinaryTranslator* binTranslator, size_t offset, REG_NUM reg)
+static inline void write_mov_mem_reg (CodeBuf_bt* buf, int offset, REG_NUM reg)
 {
-    uint64_t regMasks[] = {MOV_RAX_MASK, MOV_RCX_MASK, 0, MOV_RBX_MASK};
     x86_cmd cmd =
     {
-        .code = MOV_MEM_REG + regMasks[reg] * 0x10000 - ((offset - 1) << BYTE(3)), // offset - 1 because of universal cmd
-        .size = SIZE_MOV_MEM_IMM ,
+        .code = MOV_MEM_REG + rexR (reg),
+        .size = SIZE_MOV_MEM_REG,
     };
 
-    writeCmdIntoArray(binTranslator, cmd);
+    writeCmdIntoArray(buf, cmd);
+    write_frame_operand (buf, offset, reg);
 }
 
-static inline void write_mov_reg_mem (BinaryTranslator* binTranslator, size_t offset, REG_NUM reg)
+static inline void write_mov_reg_mem (CodeBuf_bt* buf, int offset, REG_NUM reg)
 {
-    int regMasks[] = {MOV_RAX_MASK, MOV_RCX_MASK, 0, MOV_RBX_MASK};
     x86_cmd cmd =
     {
-        .code = MOV_REG_MEM + regMasks[reg] * 0x10000 - ((offset - 1) << BYTE(3)),
-        .size = SIZE_MOV_MEM_IMM ,
+        .code = MOV_REG_MEM + rexR (reg),
+        .size = SIZE_MOV_REG_MEM,
     };
 
-    writeCmdIntoArray(binTranslator, cmd);
+    writeCmdIntoArray(buf, cmd);
+    write_frame_operand (buf, offset, reg);
 }
 
-static inline void write_mov_reg_num (BinaryTranslator* binTranslator, REG_NUM reg, int number)
+static inline void write_lea_reg_mem (CodeBuf_bt* buf, int offset, REG_NUM reg)
 {
+    x86_cmd cmd =
+    {
+        .code = LEA_REG_MEM + rexR (reg),
+        .size = SIZE_LEA_REG_MEM,
+    };
+
+    writeCmdIntoArray(buf, cmd);
+    write_frame_operand (buf, offset, reg);
+}
+
+// Short form zero extends, so it is only for numbers that are the same in 64 bits
+static inline void write_mov_reg_num (CodeBuf_bt* buf, REG_NUM reg, int64_t number)
+{
+    assert (INT32_MIN <= number && number <= UINT32_MAX);
+
+    if (number < 0)
+    {
+        x86_cmd cmd =
+        {
+            .code = MOV_REG_IMM32 + ((reg >= R8) ? (uint64_t) REX_B_MASK : 0) + (regBits (reg) << BYTE(2)),
+            .size = SIZE_MOV_REG_IMM32,
+        };
+        writeCmdIntoArray (buf, cmd);
+        writeImm32 (buf, (int) number);
+        return;
+    }
+
+    if (reg >= R8)
+    {
+        x86_cmd cmd =
+        {
+            .code = REX_B + ((MOV_REG_IMM + regBits (reg)) << BYTE(1)),
+            .size = SIZE_REX_PREFIX + SIZE_MOV_REG_IMM,
+        };
+        writeCmdIntoArray (buf, cmd);
+        writeImm32 (buf, (int) number);
+        return;
+    }
+
     x86_cmd cmd =
     {
         .code = MOV_REG_IMM + reg,
         .size = SIZE_MOV_REG_IMM,
     };
 
-    writeCmdIntoArray (binTranslator, cmd);
-    writeImm32 (binTranslator, number);
+    writeCmdIntoArray (buf, cmd);
+    writeImm32 (buf, (int) number);
 }
 
-static inline void write_jmp (BinaryTranslator* binTranslator, char* destBlock)
+static inline void write_mov_reg_reg (CodeBuf_bt* buf, REG_NUM dest, REG_NUM src)
+{
+    if (dest == src)
+        return;
+
+    x86_cmd cmd =
+    {
+        .code = MOV_REG_REG + ((dest >= R8) ? (uint64_t) REX_B_MASK : 0) + rexR (src)
+                            + ((regBits (dest) + (regBits (src) << 3)) << BYTE(2)),
+        .size = SIZE_MOV_REG_REG,
+    };
+
+    writeCmdIntoArray (buf, cmd);
+}
+
+static inline void write_test_reg (CodeBuf_bt* buf, REG_NUM reg)
+{
+    x86_cmd cmd =
+    {
+        .code = TEST_REG_REG + ((regBits (reg) + (regBits (reg) << 3)) << BYTE(1)),
+        .size = SIZE_TEST_REG_REG,
+    };
+
+    if (reg >= R8)
+    {
+        cmd.code  = (REX_B | REX_R_MASK) + (cmd.code << BYTE(1));
+        cmd.size += SIZE_REX_PREFIX;
+    }
+
+    writeCmdIntoArray (buf, cmd);
+}
+
+static inline void write_jmp (CodeBuf_bt* buf, Block_bt* destBlock)
 {
     SimpleCMD(JMP_OP);
-    writeRelAddress(binTranslator, binTranslator->BT_ip, calcBlockOffset (binTranslator, destBlock));
+    writeBlockAddress (buf, destBlock);
 }
 
-static inline void write_cond_jmp (BinaryTranslator* binTranslator, char* destBlock, OPCODE_MASKS jmpMask)
+static inline void write_cond_jmp (CodeBuf_bt* buf, Block_bt* destBlock, OPCODE_MASKS jmpMask)
 {
     assert (0x83 <= jmpMask && jmpMask <= 0x8f);
 
@@ -161,26 +363,29 @@ static inline void write_cond_jmp (BinaryTranslator* binTranslator, char* destBl
         .code = COND_JMP + (jmpMask << BYTE(1)),
         .size = SIZE_COND_JMP,
     };
-    writeCmdIntoArray(binTranslator, cmd);
-    writeRelAddress(binTranslator, binTranslator->BT_ip, calcBlockOffset(binTranslator, destBlock));
+    writeCmdIntoArray(buf, cmd);
+    writeBlockAddress (buf, destBlock);
 }
 
-static inline void dumpOperatorToAsm (FILE* fileptr, BinaryTranslator* binTranslator, Op_bt* op, REG_NUM reg)
+static const char* RegNames[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                                 "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"};
+
+static const char* RegNames32[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+                                   "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+
+static inline void dumpOperatorToAsm (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, Op_bt op, REG_NUM reg)
 {
-    const char* regArr[] = {"rax", "rcx", "rdx","rbx"};
+    const char** regArr = RegNames;
 
-    switch (op->type)
+    switch (op.type)
     {
-        case Pointer_t:
-            fprintf (fileptr, "ja %s\n", op->value.block->name);
-            write_cond_jmp (binTranslator, op->value.block->name, JA_MASK);
-            break;
-
         case Var_t:
-            switch (op->value.var->location)
+        {
+            Var_bt* var = opVar (function, op);
+            switch (var->location)
             {
                 case Register:
-                    fprintf (fileptr, "mov %s, rcx\n", regArr[reg]);
+                    asmPrintf (fileptr, "mov %s, rcx\n", regArr[reg]);
                     switch (reg)
                     {
                         case RAX:
@@ -192,28 +397,34 @@ static inline void dumpOperatorToAsm (FILE* fileptr, BinaryTranslator* binTransl
                             break;
 
                         default:
-                            assert(0);
+                            write_mov_reg_reg (buf, reg, RCX);
                     }
                     break;
 
                 case Memory:
-                    fprintf (fileptr, "mov %s, [r9 - %d]\n", regArr[reg], op->value.var->offset);
-                    write_mov_reg_mem (binTranslator, op->value.var->offset, reg);
+                    asmPrintf (fileptr, "mov %s, [rbp - %d]\n", regArr[reg], var->offset);
+                    write_mov_reg_mem (buf, var->offset, reg);
                     break;
 
                 case Stack:
-                    fprintf (fileptr, "pop %s\n", regArr[reg]);
-                    write_pop_reg (binTranslator, reg);
+                    asmPrintf (fileptr, "pop %s\n", regArr[reg]);
+                    write_pop_reg (buf, reg);
+                    break;
+
+                case Allocated:
+                    asmPrintf (fileptr, "mov %s, %s\n", regArr[reg], regArr[var->reg]);
+                    write_mov_reg_reg (buf, reg, var->reg);
                     break;
 
                 default:
                     assert (0);
             }
             break;
+        }
 
         case Num_t:
-            fprintf (fileptr, "mov %s, %d\n", regArr[reg], op->value.num);
-            write_mov_reg_num(binTranslator, reg, op->value.num);
+            asmPrintf (fileptr, "mov %s, %d\n", regArr[reg], op.value.num);
+            write_mov_reg_num(buf, reg, op.value.num);
             break;
 
         default:
@@ -221,104 +432,353 @@ static inline void dumpOperatorToAsm (FILE* fileptr, BinaryTranslator* binTransl
     }
 }
 
-static void translateBaseMath (FILE* fileptr, BinaryTranslator* binTranslator, Cmd_bt cmd)
+// Returns register that already holds operand or loads it into reg
+static inline REG_NUM operandToReg (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, Op_bt op, REG_NUM reg)
 {
-    x86_cmd x86_cmd = {};
-    fprintf (fileptr, "\n ;Arithm");
-    fprintf (fileptr, "\n\t");
-    dumpOperatorToAsm(fileptr, binTranslator, cmd.operator1, RAX);
-    fprintf (fileptr, "\t");
-    dumpOperatorToAsm(fileptr, binTranslator, cmd.operator2, RBX);
-    fprintf (fileptr, "\t");
+    if (op.type == Var_t && opVar (function, op)->location == Allocated)
+        return opVar (function, op)->reg;
+
+    if (op.type == Var_t && opVar (function, op)->location == Register)
+        return RCX;
+
+    dumpOperatorToAsm (fileptr, buf, function, op, reg);
+    return reg;
+}
 
-    switch (cmd.opCode.operation)
+static inline void storeRegToVar (FILE* fileptr, CodeBuf_bt* buf, Var_bt* var, REG_NUM reg)
+{
+    switch (var->location)
     {
-        case OP_ADD:
-            fprintf (fileptr, "add rax, rbx\n");
-            x86_cmd.code = ADD_RAX_RBX;
+        case Register:
+            asmPrintf (fileptr, "mov rcx, %s\n", RegNames[reg]);
+            write_mov_reg_reg (buf, RCX, reg);
             break;
 
-        case OP_SUB:
-            fprintf (fileptr, "sub rax, rbx\n");
-            x86_cmd.code = SUB_RAX_RBX;
+        case Memory:
+            asmPrintf (fileptr, "mov [rbp - %d], %s\n", var->offset, RegNames[reg]);
+            write_mov_mem_reg (buf, var->offset, reg);
             break;
 
-        case OP_MUL:
-            fprintf (fileptr, "mul rbx\n");
-            x86_cmd.code = MUL_RBX;
+        case Stack:
+            asmPrintf (fileptr, "push %s\n", RegNames[reg]);
+            write_push_reg (buf, reg);
             break;
 
-        case OP_DIV:
-            fprintf (fileptr, "div rbx\n");
-            x86_cmd.code = DIV_RBX;
+        case Allocated:
+            asmPrintf (fileptr, "mov %s, %s\n", RegNames[var->reg], RegNames[reg]);
+            write_mov_reg_reg (buf, var->reg, reg);
             break;
 
         default:
             assert (0);
+    }
+}
+
+static inline bool isPowerOfTwo (int64_t number)
+{
+    return number > 0 && (number & (number - 1)) == 0;
+}
+
+static inline int log2Exact (int64_t number)
+{
+    int power = 0;
+    while (((int64_t) 1 << power) < number)
+        power++;
+
+    return power;
+}
+
+static inline void write_shift_imm (CodeBuf_bt* buf, OPCODES_x86 shift, int count)
+{
+    x86_cmd cmd =
+    {
+        .code = shift + ((uint64_t) count << BYTE(3)),
+        .size = SIZE_SHIFT_IMM + 1,
+    };
+    writeCmdIntoArray (buf, cmd);
+}
+
+// rax *= number, mul and imul by register are 3 cycles and the first one takes rdx
+static void translateMulByNum (FILE* fileptr, CodeBuf_bt* buf, int number)
+{
+    if (number == 1)
+        return;
+
+    if (isPowerOfTwo (number))
+    {
+        asmPrintf (fileptr, "shl rax, %d\n\t", log2Exact (number));
+        write_shift_imm (buf, SHL_RAX_IMM, log2Exact (number));
+        return;
+    }
 
+    if (number == 3 || number == 5 || number == 9)
+    {
+        asmPrintf (fileptr, "lea rax, [rax + rax * %d]\n\t", number - 1);
+        x86_cmd cmd =
+        {
+            .code = LEA_RAX_SCALED + ((uint64_t) log2Exact (number - 1) << (BYTE(3) + 6)),
+            .size = SIZE_LEA_RAX_SCALED + 1,
+        };
+        writeCmdIntoArray (buf, cmd);
+        return;
     }
 
-    x86_cmd.size = SIZE_ARITHM;
-    writeCmdIntoArray(binTranslator, x86_cmd);
+    asmPrintf (fileptr, "imul rax, rax, %d\n\t", number);
+    if (INT8_MIN <= number && number <= INT8_MAX)
+    {
+        x86_cmd cmd =
+        {
+            .code = IMUL_RAX_IMM8 + ((uint64_t) (unsigned char) number << BYTE(3)),
+            .size = SIZE_IMUL_RAX_IMM8 + 1,
+        };
+        writeCmdIntoArray (buf, cmd);
+        return;
+    }
 
-    fprintf (fileptr, "\tpush rax\n");
-    write_push_reg (binTranslator, RAX);
-    fprintf (fileptr, ";end of Arithm\n");
+    SimpleCMD(IMUL_RAX_IMM32);
+    writeImm32 (buf, number);
 }
 
-static inline void translateIf (FILE* fileptr, BinaryTranslator* binTranslator, Cmd_bt cmd)
+static inline bool isShiftDivisor (int number)
 {
-    dumpOperatorToAsm(fileptr, binTranslator, cmd.dest, RAX);
-    fprintf (fileptr, "\t xor rbx, rbx\n");
-    write_mov_reg_num(binTranslator, RBX, 0);
+    return number == 1 || number == -1 || isPowerOfTwo (number < 0 ? -(int64_t) number : number);
+}
 
-    fprintf(fileptr, "\t cmp rax, rbx\n");
-    SimpleCMD(CMP_RAX_RBX);
+// rax /= number for number = +-2^k. Negative dividend is biased by 2^k - 1
+// first, so shift rounds toward zero as idiv does
+static void translateDivByShift (FILE* fileptr, CodeBuf_bt* buf, int number)
+{
+    int64_t divisor = (number < 0) ? -(int64_t) number : number;
 
-    fprintf (fileptr, "\t");
-    dumpOperatorToAsm(fileptr, binTranslator, cmd.operator1, RAX);
+    if (divisor != 1)
+    {
+        int power = log2Exact (divisor);
+
+        asmPrintf (fileptr, "movsxd rax, eax\n\tcqo\n\tshr rdx, %d\n\tadd rax, rdx\n\tsar rax, %d\n\t", 64 - power, power);
+        SimpleCMD(MOVSXD_RAX_EAX);
+        SimpleCMD(CQO);
+        write_shift_imm (buf, SHR_RDX_IMM, 64 - power);
+        SimpleCMD(ADD_RAX_RDX);
+        write_shift_imm (buf, SAR_RAX_IMM, power);
+    }
 
-    if (cmd.operator2)
+    if (number < 0)
     {
-        fprintf (fileptr, "\t jmp %s\n", cmd.operator2->value.block->name);
-        write_jmp (binTranslator, cmd.operator2->value.block->name);
+        asmPrintf (fileptr, "neg rax\n\t");
+        SimpleCMD(NEG_RAX);
     }
 }
 
-static inline void translateEq (FILE* fileptr, BinaryTranslator* binTranslator, Cmd_bt cmd)
+// n / d = floor (n * multiplier / 2^(32 + shift)) for n >= 0 and one more
+// than that for n < 0. Hacker's Delight, 10-1
+struct DivMagic_bt
+{
+    uint32_t multiplier;
+    int      shift;
+};
+
+static DivMagic_bt divMagic (uint32_t divisor)
 {
-    switch (cmd.operator1->type)
+    assert (2 < divisor && divisor < 0x80000000u);
+
+    const uint32_t two31 = 0x80000000u;
+    uint32_t anc = two31 - 1 - two31 % divisor;     // largest dividend with remainder divisor - 1
+    uint32_t q1  = two31 / anc;
+    uint32_t r1  = two31 - q1 * anc;
+    uint32_t q2  = two31 / divisor;
+    uint32_t r2  = two31 - q2 * divisor;
+    uint32_t delta = 0;
+    int      power = 31;
+
+    do
     {
-        case Var_t:
-            switch (cmd.operator1->value.var->location)
-            {
-                case Register:
-                    fprintf (fileptr, "mov [r9 - %d], rcx\n", cmd.dest->value.var->offset);
-                    write_mov_mem_reg (binTranslator, cmd.dest->value.var->offset, RCX);
-                    break;
+        power++;
 
-                case Stack:
-                    fprintf (fileptr, "pop rax\n");
-                    write_pop_reg (binTranslator, RAX);
-                    fprintf (fileptr, "mov [r9 - %d], rax\n", cmd.dest->value.var->offset);
-                    write_mov_mem_reg(binTranslator, cmd.dest->value.var->offset, RAX);
-                    break;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc)
+        {
+            q1++;
+            r1 -= anc;
+        }
 
-                case Memory:
-                    fprintf (fileptr, "mov rax, [r9 + %d]\n", cmd.dest->value.var->offset);
-                    write_mov_mem_reg (binTranslator, cmd.dest->value.var->offset, RAX);
-                    fprintf (fileptr, "mov [r9 + %d], rax\n", cmd.operator1->value.var->offset);
-                    write_mov_mem_reg (binTranslator, cmd.operator1->value.var->offset, RAX);
-                    break;
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= divisor)
+        {
+            q2++;
+            r2 -= divisor;
+        }
 
-                default:
-                    assert (0);
-            }
+        delta = divisor - r2;
+    }
+    while (q1 < delta || (q1 == delta && r1 == 0));
+
+    return {q2 + 1, power - 32};
+}
+
+// rax /= number for the rest of constants. Dividend is 32 bit and multiplier
+// is below 2^32, so their product can't overflow imul
+static void translateDivByMagic (FILE* fileptr, CodeBuf_bt* buf, int number)
+{
+    int64_t     divisor = (number < 0) ? -(int64_t) number : number;
+    DivMagic_bt magic   = divMagic ((uint32_t) divisor);
+
+    asmPrintf (fileptr, "movsxd rax, eax\n\tmov edx, %u\n\timul rax, rdx\n\tsar rax, %d\n\tcqo\n\tsub rax, rdx\n\t",
+             magic.multiplier, 32 + magic.shift);
+    SimpleCMD(MOVSXD_RAX_EAX);
+    write_mov_reg_num (buf, RDX, magic.multiplier);
+    SimpleCMD(IMUL_RAX_RDX);
+    write_shift_imm (buf, SAR_RAX_IMM, 32 + magic.shift);
+    SimpleCMD(CQO);
+    SimpleCMD(SUB_RAX_RDX);
+
+    if (number < 0)
+    {
+        asmPrintf (fileptr, "neg rax\n\t");
+        SimpleCMD(NEG_RAX);
+    }
+}
+
+// rax /= number, the same quotient idiv gives for 32 bit numbers. Checked
+// against idiv by test/divByNum.cpp
+void translateDivByNum (FILE* fileptr, CodeBuf_bt* buf, int number)
+{
+    assert (number != 0);
+
+    if (isShiftDivisor (number))
+        translateDivByShift (fileptr, buf, number);
+    else
+        translateDivByMagic (fileptr, buf, number);
+}
+
+// Numbers are 32 bit, only the low half of rax and rbx is trusted
+static void translateDiv (FILE* fileptr, CodeBuf_bt* buf)
+{
+    asmPrintf (fileptr, "movsxd rax, eax\n\tmovsxd rbx, ebx\n\tcqo\n\tidiv rbx\n\t");
+    SimpleCMD(MOVSXD_RAX_EAX);
+    SimpleCMD(MOVSXD_RBX_EBX);
+    SimpleCMD(CQO);
+    SimpleCMD(IDIV_RBX);
+}
+
+static void translateBaseMath (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, Cmd_bt cmd)
+{
+    asmPrintf (fileptr, "\n ;Arithm");
+    asmPrintf (fileptr, "\n\t");
+
+    unsigned int operation = cmd.opCode.operation;
+    Op_bt first  = cmd.operator1;
+    Op_bt second = cmd.operator2;
+
+    // Constant factor goes second to become immediate
+    if (operation == OP_MUL && first.type == Num_t && second.type != Num_t)
+    {
+        first  = cmd.operator2;
+        second = cmd.operator1;
+    }
+
+    if (operation == OP_MUL && second.type == Num_t)
+    {
+        dumpOperatorToAsm (fileptr, buf, function, first, RAX);
+        asmPrintf (fileptr, "\t");
+        translateMulByNum (fileptr, buf, second.value.num);
+    }
+    // Division by zero is left to idiv to fault
+    else if (operation == OP_DIV && second.type == Num_t && second.value.num != 0)
+    {
+        dumpOperatorToAsm (fileptr, buf, function, first, RAX);
+        asmPrintf (fileptr, "\t");
+        translateDivByNum (fileptr, buf, second.value.num);
+    }
+    else
+    {
+        // operator2 was pushed last, so it has to be popped first
+        dumpOperatorToAsm (fileptr, buf, function, second, RBX);
+        asmPrintf (fileptr, "\t");
+        dumpOperatorToAsm (fileptr, buf, function, first, RAX);
+        asmPrintf (fileptr, "\t");
+
+        switch (operation)
+        {
+            case OP_ADD:
+                asmPrintf (fileptr, "add rax, rbx\n\t");
+                writeCmdIntoArray (buf, {.code = ADD_RAX_RBX, .size = SIZE_ARITHM});
+                break;
+
+            case OP_SUB:
+                asmPrintf (fileptr, "sub rax, rbx\n\t");
+                writeCmdIntoArray (buf, {.code = SUB_RAX_RBX, .size = SIZE_ARITHM});
+                break;
+
+            case OP_MUL:
+                asmPrintf (fileptr, "imul rax, rbx\n\t");
+                SimpleCMD(IMUL_RAX_RBX);
+                break;
+
+            case OP_DIV:
+                translateDiv (fileptr, buf);
+                break;
+
+            default:
+                assert (0);
+        }
+    }
+
+    storeRegToVar (fileptr, buf, opVar (function, cmd.dest), RAX);
+    asmPrintf (fileptr, ";end of Arithm\n");
+}
+
+// Condition is true when its low half is not zero, the same as for IF
+// folded by irOpt. Branch that is laid out next is reached by fallthrough,
+// so at most one of them needs jmp
+static inline void translateIf (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, Cmd_bt cmd,
+                                const Block_bt* nextBlock)
+{
+    REG_NUM condition = operandToReg (fileptr, buf, function, cmd.dest, RAX);
+    asmPrintf (fileptr, "\ttest %s, %s\n", RegNames32[condition], RegNames32[condition]);
+    write_test_reg (buf, condition);
+
+    Block_bt* trueBlock  = opBlock (function, cmd.operator1);
+    Block_bt* falseBlock = hasOp (cmd.operator2) ? opBlock (function, cmd.operator2) : NULL;
+
+    if (falseBlock != NULL && trueBlock == nextBlock)
+    {
+        asmPrintf (fileptr, "\tje %s\n", falseBlock->name);
+        write_cond_jmp (buf, falseBlock, JE_MASK);
+        return;
+    }
+
+    asmPrintf (fileptr, "\tjne %s\n", trueBlock->name);
+    write_cond_jmp (buf, trueBlock, JNE_MASK);
+
+    if (falseBlock != NULL && falseBlock != nextBlock)
+    {
+        asmPrintf (fileptr, "\tjmp %s\n", falseBlock->name);
+        write_jmp (buf, falseBlock);
+    }
+}
+
+static inline void translateEq (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, Cmd_bt cmd)
+{
+    Var_bt* dest = opVar (function, cmd.dest);
+
+    switch (cmd.operator1.type)
+    {
+        case Var_t:
+            storeRegToVar (fileptr, buf, dest, operandToReg (fileptr, buf, function, cmd.operator1, RAX));
             break;
 
         case Num_t:
-            fprintf (fileptr, "mov qword [r9 - %d], %d\n", cmd.dest->value.var->offset, cmd.operator1->value.num);
-            write_mov_mem_imm (binTranslator, cmd.dest->value.var->offset, cmd.operator1->value.num);
+            if (dest->location == Allocated)
+            {
+                asmPrintf (fileptr, "mov %s, %d\n", RegNames[dest->reg], cmd.operator1.value.num);
+                write_mov_reg_num (buf, dest->reg, cmd.operator1.value.num);
+                break;
+            }
+
+            asmPrintf (fileptr, "mov qword [rbp - %d], %d\n", dest->offset, cmd.operator1.value.num);
+            write_mov_mem_imm (buf, dest->offset, cmd.operator1.value.num);
             break;
 
         default:
@@ -326,21 +786,57 @@ static inline void translateEq (FILE* fileptr, BinaryTranslator* binTranslator,
     }
 }
 
-static inline void translateRet (FILE* fileptr, BinaryTranslator* binTranslator, Cmd_bt cmd)
+static inline void write_leave (FILE* fileptr, CodeBuf_bt* buf)
+{
+    asmPrintf (fileptr, "mov rsp, rbp\n");
+    SimpleCMD(MOV_RSP_RBP);
+    asmPrintf (fileptr, "pop rbp\n");
+    SimpleCMD(POP_RBP);
+}
+
+// Callee pops its arguments, caller doesn't know how many PARIN were no-ops
+static inline void translateEpilogue (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function)
 {
-    switch (cmd.operator1->type)
+    write_leave (fileptr, buf);
+
+    size_t numOfArgs = numOfParams (function);
+    if (numOfArgs == 0)
+    {
+        asmPrintf (fileptr, "ret\n");
+        SimpleCMD(RET_OP);
+        return;
+    }
+
+    asmPrintf (fileptr, "ret %lu\n", numOfArgs * 8);
+    SimpleCMD(RET_IMM16);
+    x86_cmd bytes =
+    {
+        .code = numOfArgs * 8,
+        .size = 2,
+    };
+    writeCmdIntoArray (buf, bytes);
+}
+
+static inline void translateRet (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, Cmd_bt cmd)
+{
+    switch (cmd.operator1.type)
     {
         case Var_t:
-            switch (cmd.operator1->value.var->location)
+            switch (opVar (function, cmd.operator1)->location)
             {
                 case Stack:
-                    fprintf (fileptr, "pop rcx\n");
-                    write_pop_reg (binTranslator, RCX);
+                    asmPrintf (fileptr, "pop rcx\n");
+                    write_pop_reg (buf, RCX);
                     break;
 
                 case Memory:
-                    fprintf (fileptr, "mov rcx, [r9 - %d]\n", cmd.operator1->value.var->offset);
-                    write_mov_reg_mem (binTranslator, cmd.operator1->value.var->offset, RCX);
+                    asmPrintf (fileptr, "mov rcx, [rbp - %d]\n", opVar (function, cmd.operator1)->offset);
+                    write_mov_reg_mem (buf, opVar (function, cmd.operator1)->offset, RCX);
+                    break;
+
+                case Allocated:
+                    asmPrintf (fileptr, "mov rcx, %s\n", RegNames[opVar (function, cmd.operator1)->reg]);
+                    write_mov_reg_reg (buf, RCX, opVar (function, cmd.operator1)->reg);
                     break;
 
                 default:
@@ -349,65 +845,184 @@ static inline void translateRet (FILE* fileptr, BinaryTranslator* binTranslator,
             break;
 
         case Num_t:
-            fprintf (fileptr, "mov rcx, %d\n", cmd.operator1->value.num);
-            write_mov_reg_num (binTranslator, RCX, cmd.operator1->value.num);
+            asmPrintf (fileptr, "mov rcx, %d\n", cmd.operator1.value.num);
+            write_mov_reg_num (buf, RCX, cmd.operator1.value.num);
             break;
 
         default:
             assert (0);
     }
+
+    translateEpilogue (fileptr, buf, function);
 }
 
-static inline void translateJmp (FILE* fileptr, BinaryTranslator* binTranslator, Cmd_bt cmd)
+static inline void translateJmp (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, Cmd_bt cmd,
+                                 const Block_bt* nextBlock)
 {
-    fprintf (fileptr, "jmp %s\n", cmd.operator1->value.block->name);
-    write_jmp(binTranslator, cmd.operator1->value.block->name);
+    if (opBlock (function, cmd.operator1) == nextBlock)
+    {
+        asmPrintf (fileptr, "; falls through to %s\n", nextBlock->name);
+        return;
+    }
+
+    asmPrintf (fileptr, "jmp %s\n", opBlock (function, cmd.operator1)->name);
+    write_jmp(buf, opBlock (function, cmd.operator1));
 }
 
-static inline void translateParamOut (FILE* fileptr, BinaryTranslator* binTranslator, Cmd_bt cmd)
+// Param in memory stays in the argument caller pushed, its offset points there
+// (see compactVars). Only allocated one is loaded
+static inline void translateParamOut (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, Cmd_bt cmd)
 {
-    fprintf (fileptr, "pop r10\n");
-    SimpleCMD(POP_R10);
-    fprintf (fileptr, "pop rax\n");
-    write_pop_reg (binTranslator, RAX);
-    fprintf (fileptr, "mov [r9 - %d], rax\n", cmd.dest->value.var->offset);
-    write_mov_mem_reg (binTranslator, cmd.dest->value.var->offset, RAX);
-    fprintf (fileptr, "push r10\n");
-    SimpleCMD(PUSH_R10);
+    Var_bt* dest = opVar (function, cmd.dest);
+    if (dest->location != Allocated)
+        return;
+
+    asmPrintf (fileptr, "mov %s, [rbp + %d]\n", RegNames[dest->reg], -dest->offset);
+    write_mov_reg_mem (buf, dest->offset, dest->reg);
 }
 
-static inline void translateParamIn (FILE* fileptr, BinaryTranslator* binTranslator, Cmd_bt cmd)
+static inline void translateParamIn (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, Cmd_bt cmd)
 {
-    switch (cmd.operator1->type)
+    switch (cmd.operator1.type)
     {
         case Num_t:
-            fprintf (fileptr, "push %d\n", cmd.operator1->value.num);
-            write_push_num (binTranslator, cmd.operator1->value.num);
+            asmPrintf (fileptr, "push %d\n", cmd.operator1.value.num);
+            write_push_num (buf, cmd.operator1.value.num);
             break;
 
         case Var_t:
-            if (cmd.operator1->value.var->location == Memory)
+        {
+            Var_bt* var = opVar (function, cmd.operator1);
+            if (var->location == Memory)
+            {
+                asmPrintf (fileptr, "mov rax, [rbp - %d]\n", var->offset);
+                write_mov_reg_mem (buf, var->offset, RAX);
+                asmPrintf (fileptr, "push rax\n" );
+                write_push_reg (buf, RAX);
+            }
+            else if (var->location == Allocated)
             {
-                fprintf (fileptr, "mov rax, [r9 - %d]\n", cmd.operator1->value.var->offset);
-                write_mov_reg_mem (binTranslator, cmd.operator1->value.var->offset, RAX);
-                fprintf (fileptr, "push rax\n" );
-                write_push_reg (binTranslator, RAX);
+                asmPrintf (fileptr, "push %s\n", RegNames[var->reg]);
+                write_push_reg (buf, var->reg);
             }
             break;
+        }
     }
 }
 
-static inline void translateCall (FILE* fileptr, BinaryTranslator* binTranslator, Cmd_bt cmd)
+// Allocated registers are caller saved: callee uses the same ones
+static inline void saveLiveRegs (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, uint32_t liveRegs)
 {
-    Name* name = findInTable(cmd.operator1->value.block->name, binTranslator->nameTable.data);
-    if (name)
+    for (unsigned reg = 0; reg < 16; reg++)
     {
-        fprintf (fileptr, "call %s\n", cmd.operator1->value.block->name);
-        SimpleCMD(CALL_OP);
-        writeRelAddress (binTranslator, binTranslator->BT_ip, name->position);
+        if (liveRegs & (1u << reg))
+        {
+            asmPrintf (fileptr, "mov [rbp - %lu], %s\n", regSaveOffset (function, (REG_NUM) reg), RegNames[reg]);
+            write_mov_mem_reg (buf, (int) regSaveOffset (function, (REG_NUM) reg), (REG_NUM) reg);
+        }
+    }
+}
+
+static inline void restoreLiveRegs (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, uint32_t liveRegs)
+{
+    for (unsigned reg = 0; reg < 16; reg++)
+    {
+        if (liveRegs & (1u << reg))
+        {
+            asmPrintf (fileptr, "mov %s, [rbp - %lu]\n", RegNames[reg], regSaveOffset (function, (REG_NUM) reg));
+            write_mov_reg_mem (buf, (int) regSaveOffset (function, (REG_NUM) reg), (REG_NUM) reg);
+        }
+    }
+}
+
+static inline void translateCall (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, Cmd_bt cmd, Func_bt* calleeFunc)
+{
+    saveLiveRegs (fileptr, buf, function, cmd.liveRegs);
+
+    Block_bt* callee = &calleeFunc->blockArray[0];
+
+    asmPrintf (fileptr, "call %s\n", callee->name);
+    SimpleCMD(CALL_OP);
+    writeBlockAddress (buf, callee);
+
+    if (hasOp (cmd.dest) && opVar (function, cmd.dest)->location != Register)
+        storeRegToVar (fileptr, buf, opVar (function, cmd.dest), RCX);
+
+    restoreLiveRegs (fileptr, buf, function, cmd.liveRegs);
+}
+
+// Arguments are pushed on top of the frame of this function. The frame and
+// arguments of this function are dropped and new ones are pushed under return
+// address, so callee sees the stack as after call and returns right to the
+// caller of this function. Nothing is alive after tail call, so scratch
+// registers and rcx are free
+static const REG_NUM TailCallRegs[] = {RAX, RBX, RDX, R11, RCX};
+static const size_t  NumOfTailCallRegs = sizeof (TailCallRegs) / sizeof (*TailCallRegs);
+
+static inline bool canJumpToCallee (const Func_bt* calleeFunc, Cmd_bt cmd)
+{
+    return cmd.opCode.tail && numOfParams (calleeFunc) <= NumOfTailCallRegs;
+}
+
+static inline void translateTailCall (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, Func_bt* calleeFunc)
+{
+    Block_bt* callee    = &calleeFunc->blockArray[0];
+    size_t    numOfArgs = numOfParams (calleeFunc);
+
+    for (size_t i = numOfArgs; i-- > 0;)
+    {
+        asmPrintf (fileptr, "pop %s\n", RegNames[TailCallRegs[i]]);
+        write_pop_reg (buf, TailCallRegs[i]);
+    }
+
+    write_leave (fileptr, buf);
+
+    asmPrintf (fileptr, "pop r10\n");
+    SimpleCMD(POP_R10);
+
+    size_t numOfOwnArgs = numOfParams (function);
+    if (numOfOwnArgs > 0)
+    {
+        asmPrintf (fileptr, "add rsp, %lu\n", numOfOwnArgs * 8);
+        SimpleCMD(ADD_RSP_IMM);
+        writeImm32 (buf, (int) numOfOwnArgs * 8);
+    }
+
+    for (size_t i = 0; i < numOfArgs; i++)
+    {
+        asmPrintf (fileptr, "push %s\n", RegNames[TailCallRegs[i]]);
+        write_push_reg (buf, TailCallRegs[i]);
+    }
+
+    asmPrintf (fileptr, "push r10\n");
+    SimpleCMD(PUSH_R10);
+
+    asmPrintf (fileptr, "jmp %s\n", callee->name);
+    write_jmp (buf, callee);
+}
+
+static inline void pushLiveRegs (FILE* fileptr, CodeBuf_bt* buf, uint32_t liveRegs)
+{
+    for (unsigned reg = 0; reg < 16; reg++)
+    {
+        if (liveRegs & (1u << reg))
+        {
+            asmPrintf (fileptr, "push %s\n", RegNames[reg]);
+            write_push_reg (buf, (REG_NUM) reg);
+        }
+    }
+}
+
+static inline void popLiveRegs (FILE* fileptr, CodeBuf_bt* buf, uint32_t liveRegs)
+{
+    for (unsigned reg = 16; reg-- > 0;)
+    {
+        if (liveRegs & (1u << reg))
+        {
+            asmPrintf (fileptr, "pop %s\n", RegNames[reg]);
+            write_pop_reg (buf, (REG_NUM) reg);
+        }
     }
-    else
-        fprintf (fileptr, "call %s\n", cmd.operator1->value.block->name);
 }
 
 static void myPrint (int num)
@@ -420,56 +1035,63 @@ static void myScanf (int* num)
     scanf ("%d", num);
 }
 
-static void translateOut (FILE* fileptr, BinaryTranslator* binTranslator, Cmd_bt cmd)
+static void translateOut (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, Cmd_bt cmd)
 {
-    SimpleCMD(PUSH_R9);
+    pushLiveRegs (fileptr, buf, cmd.liveRegs);
     SimpleCMD(PUSH_R10);
 
-    dumpOperatorToAsm(fileptr, binTranslator, cmd.operator1, RAX);
+    dumpOperatorToAsm (fileptr, buf, function, cmd.operator1, RAX);
     SimpleCMD(PUSH_RBP);
     SimpleCMD(PUSH_RSP);
     SimpleCMD(MOV_RDI_RAX);
-    fprintf (fileptr, "\t call printf\n");
+    asmPrintf (fileptr, "\t call printf\n");
     SimpleCMD(CALL_OP);
-
-    fprintf(stderr, "x86 array %lu\n", binTranslator->x86_arraySize);
-    writeRelAddress(binTranslator, binTranslator->BT_ip , binTranslator->x86_arraySize);
+    writeRuntimeAddress (buf, 0);
 
     SimpleCMD(POP_RSP);
     SimpleCMD(POP_RBP);
     SimpleCMD(POP_R10);
-    SimpleCMD(POP_R9);
-
-
+    popLiveRegs (fileptr, buf, cmd.liveRegs);
 }
 
-static inline void translateIn (FILE* fileptr, BinaryTranslator* binTranslator, Cmd_bt cmd)
+static inline void translateIn (FILE* fileptr, CodeBuf_bt* buf, Func_bt* function, Cmd_bt cmd)
 {
-    SimpleCMD(PUSH_R9);
+    pushLiveRegs (fileptr, buf, cmd.liveRegs);
     SimpleCMD(PUSH_R10);
     SimpleCMD(PUSH_RBP);
     SimpleCMD(PUSH_RSP);
 
-    SimpleCMD(SUB_R9_IMM);
-    writeImm32(binTranslator, cmd.dest->value.var->offset);
-
-    SimpleCMD(MOV_RDI_R9);
+    asmPrintf (fileptr, "lea rdi, [rbp - %d]\n", opVar (function, cmd.dest)->offset);
+    write_lea_reg_mem (buf, opVar (function, cmd.dest)->offset, RDI);
+    asmPrintf (fileptr, "\t call scanf\n");
     SimpleCMD(CALL_OP);
-    fprintf(stderr, "x86 array %lu\n", binTranslator->x86_arraySize);
-    writeRelAddress(binTranslator, binTranslator->BT_ip, binTranslator->x86_arraySize + Config.sizeOfPrintf);
+    writeRuntimeAddress (buf, Config.sizeOfPrintf);
 
     SimpleCMD(POP_RSP);
     SimpleCMD(POP_RBP);
     SimpleCMD(POP_R10);
-    SimpleCMD(POP_R9);
+    popLiveRegs (fileptr, buf, cmd.liveRegs);
+
+    Var_bt* dest = opVar (function, cmd.dest);
+    if (dest->location == Allocated)
+    {
+        asmPrintf (fileptr, "mov %s, [rbp - %d]\n", RegNames[dest->reg], dest->offset);
+        write_mov_reg_mem (buf, dest->offset, dest->reg);
+    }
 }
 
-static void dumpBlockToAsm (FILE* fileptr, BinaryTranslator* binTranslator, Block_bt* block)
+// nextBlock is the one emitted right after this, NULL for the last block.
+// Other functions are only read, they may be emitted at the same time
+static void dumpBlockToAsm (FILE* fileptr, const BinaryTranslator* binTranslator, CodeBuf_bt* buf, Func_bt* function,
+                            Block_bt* block, const Block_bt* nextBlock)
 {
+    size_t        blockStart = buf->BT_ip;
+    const Cmd_bt* cmds       = blockCmds (function, block);
+
     for (size_t i = 0; i < block->cmdArraySize; i++)
     {
-        fprintf (fileptr, "\t");
-        Cmd_bt cmd = block->cmdArray[i];
+        asmPrintf (fileptr, "\t");
+        Cmd_bt cmd = cmds[i];
 
         switch (cmd.opCode.operation)
         {
@@ -477,194 +1099,294 @@ static void dumpBlockToAsm (FILE* fileptr, BinaryTranslator* binTranslator, Bloc
             case OP_SUB:
             case OP_MUL:
             case OP_DIV:
-                translateBaseMath (fileptr, binTranslator, cmd);
+                translateBaseMath (fileptr, buf, function, cmd);
                 break;
 
             case OP_IF:
-                translateIf (fileptr, binTranslator, cmd);
+                translateIf (fileptr, buf, function, cmd, nextBlock);
                 break;
 
             case OP_EQ:
-                translateEq (fileptr, binTranslator, cmd);
+                translateEq (fileptr, buf, function, cmd);
                 break;
 
             case OP_RET:
-                translateRet (fileptr, binTranslator, cmd);
+                translateRet (fileptr, buf, function, cmd);
                 break;
 
             case OP_JMP:
-                translateJmp (fileptr, binTranslator, cmd);
+                translateJmp (fileptr, buf, function, cmd, nextBlock);
                 break;
 
             case OP_PAROUT:
-                translateParamOut (fileptr, binTranslator, cmd);
+                translateParamOut (fileptr, buf, function, cmd);
                 break;
 
             case OP_PARIN:
-                translateParamIn (fileptr, binTranslator, cmd);
+                translateParamIn (fileptr, buf, function, cmd);
                 break;
 
             case OP_CALL:
-                translateCall (fileptr, binTranslator, cmd);
+            {
+                Func_bt* callee = &binTranslator->funcArray[cmd.operator1.value.func];
+                if (canJumpToCallee (callee, cmd))
+                {
+                    translateTailCall (fileptr, buf, function, callee);
+                    i++;    // RET of the result is never reached
+                }
+                else
+                    translateCall (fileptr, buf, function, cmd, callee);
                 break;
+            }
             case OP_OUT:
-                translateOut (fileptr, binTranslator, cmd);
+                translateOut (fileptr, buf, function, cmd);
                 break;
             case OP_IN:
-                translateIn (fileptr, binTranslator, cmd);
+                translateIn (fileptr, buf, function, cmd);
                 break;
 
             default:
                 assert (0);
         }
     }
+
+    peepholeBlock (buf, blockStart);
 }
 
-static Name* BTtableAdd (BinaryTranslator* binTranslator, char* name)
+
+static void dumpFunctionToAsm (FILE* fileptr, const BinaryTranslator* binTranslator, CodeBuf_bt* buf, Func_bt* function)
 {
-    Name* nameInTable = findInTable (name, binTranslator->nameTable.data);
+    asmPrintf (fileptr, "%s:\n", function->blockArray[0].name);
+    function->blockArray[0].codeOffset = buf->BT_ip;
+
+    asmPrintf (fileptr, "push rbp\n");
+    SimpleCMD(PUSH_RBP);
+    asmPrintf (fileptr, "mov rbp, rsp\n");
+    SimpleCMD(MOV_RBP_RSP);
 
-    if (nameInTable == NULL)
+    if (function->frameSize > 0)
     {
-        nameInTable = tableAdd (name, binTranslator->nameTable.data);
+        asmPrintf (fileptr, "sub rsp, %lu\n", function->frameSize);
+        SimpleCMD(SUB_RSP_IMM);
+        writeImm32(buf, (int) function->frameSize);
     }
 
-    nameInTable->position = binTranslator->BT_ip;
-
-    return nameInTable;
-}
-
-static size_t calcBlockOffset (BinaryTranslator* binTranslator, char* name)
-{
-    Name* nameInTable = findInTable (name, binTranslator->nameTable.data);
+    for (size_t i = 0; i < function->blockArraySize; i++)
+    {
+        if (i > 0)
+        {
+            asmPrintf (fileptr, "%s:\n", function->blockArray[i].name);
+            function->blockArray[i].codeOffset = buf->BT_ip;
+        }
 
-    if (nameInTable)
-        return nameInTable->position;
+        const Block_bt* nextBlock = (i + 1 < function->blockArraySize) ? &function->blockArray[i + 1] : NULL;
+        dumpBlockToAsm (fileptr, binTranslator, buf, function, &function->blockArray[i], nextBlock);
+    }
 
-    return 0;
+    translateEpilogue (fileptr, buf, function);
 }
 
-void dumpBTtable (NameTable nametable)
+// Job of the pool: function goes to its own buffer and asm text, linkFunctions joins them
+static void emitFunction (void* arg, size_t index)
 {
-    for (int i = 0; i < nametable.numOfVars; i++)
+    BinaryTranslator* binTranslator = (BinaryTranslator*) arg;
+    Func_bt*          function      = &binTranslator->funcArray[index];
+    FuncCtx_bt*       ctx           = &function->ctx;
+
+    if (ctx->cached)
     {
-        fprintf (stderr, "%s offset %lu\n", nametable.data[i].name, nametable.data[i].position);
+        linkCachedCalls (binTranslator, function);
+        return;
     }
-}
-
-static void dumpFunctionToAsm (FILE* fileptr, BinaryTranslator* binTranslator, Func_bt* function)
-{
-    fprintf (fileptr, "%s:\n", function->blockArray[0].name);
-    BTtableAdd (binTranslator, function->blockArray[0].name);
-
-    fprintf (fileptr, "add r9, %lu\n", (function->varArraySize - function->numberOfTempVar)*8);
-
-    SimpleCMD(ADD_R9_IMM);
-    writeImm32(binTranslator, (function->varArraySize - function->numberOfTempVar)*8);
-    dumpBlockToAsm (fileptr, binTranslator, &function->blockArray[0]);
 
-    for (size_t i = 1; i < function->blockArraySize; i++)
+    ctx->code = {};
+    FILE* fileptr = NULL;
+    if (binTranslator->dumps & DUMP_ASM)
     {
-        fprintf (fileptr, "%s:\n", function->blockArray[i].name);
-        BTtableAdd (binTranslator, function->blockArray[i].name);
-
-        dumpBlockToAsm (fileptr, binTranslator, &function->blockArray[i]);
+        fileptr = open_memstream (&ctx->asmText, &ctx->asmTextSize);
+        assert (fileptr != NULL);
     }
 
-    fprintf (fileptr, "sub r9, %lu\n", (function->varArraySize - function->numberOfTempVar)*8);
-    SimpleCMD(SUB_R9_IMM);
+    dumpFunctionToAsm (fileptr, binTranslator, &ctx->code, function);
+    if (fileptr != NULL)
+        fclose (fileptr);
+
+    if (binTranslator->cacheDir)
+        storeCachedFunction (binTranslator, function);
+}
+
+static Block_bt* findMain (BinaryTranslator* binTranslator)
+{
+    size_t index = symMapFind (&binTranslator->funcMap, internName (&binTranslator->symbols, "main"));
+    assert (index != NotFound && "no main function");
 
-    writeImm32(binTranslator, (function->varArraySize - function->numberOfTempVar)*8);
-    fprintf (fileptr, "ret\n");
-    SimpleCMD(RET_OP);
+    return &binTranslator->funcArray[index].blockArray[0];
 }
 
 static void dumpStart (FILE* fileptr, BinaryTranslator* binTranslator)
 {
-    fprintf (fileptr, "section .text\n");
-    fprintf (fileptr, "global _start\n");
-    fprintf (fileptr, "_start:\n");
-    fprintf (fileptr, "lea r9, Buf\n");
-    SimpleCMD(MOV_R11_IMM64);
-    writeImm64(binTranslator, 0x400078 + binTranslator->x86_arraySize + Config.sizeOfPrintf - 5);
+    CodeBuf_bt* buf = &binTranslator->code;
+
+    asmPrintf (fileptr, "section .text\n");
+    asmPrintf (fileptr, "global _start\n");
+    asmPrintf (fileptr, "_start:\n");
+    asmPrintf (fileptr, "lea rsp, Stack + %lu\n", binTranslator->stackSize);
+    // Addresses depend on size of code, patchStartAddresses writes them
+    SimpleCMD(MOV_RSP_IMM64);
+    binTranslator->startPatch.stackPos = buf->BT_ip;
+    writeImm64(buf, 0);
 
     SimpleCMD(MOV_R12_IMM64);
-    writeImm64(binTranslator, 0x400078 + binTranslator->x86_arraySize + Config.sizeOfPrintf - 10); //Buf for printf has sizeof 5 bytes
-                                                                            //
+    binTranslator->startPatch.printfOutPos = buf->BT_ip;
+    writeImm64(buf, 0);
+
     SimpleCMD(MOV_R14_IMM64);
-    writeImm64(binTranslator, 0x400078 + binTranslator->x86_arraySize + Config.sizeOfPrintf + Config.sizeOfScanf - 16); //Buf for printf has sizeof 5 bytes
+    binTranslator->startPatch.scanfBufPos = buf->BT_ip;
+    writeImm64(buf, 0);
+
 
-    SimpleCMD(MOV_R9_IMM64);
-    writeImm64(binTranslator, 0x400078 + binTranslator->x86_arraySize + Config.sizeOfPrintf + Config.sizeOfScanf);
+    asmPrintf (fileptr, "\tcall main\n");
+    SimpleCMD(CALL_OP);
+    writeBlockAddress (buf, findMain (binTranslator));
 
-    fprintf (fileptr, "\tcall main\n");
+    asmPrintf (fileptr, "\tcall flush\n");
     SimpleCMD(CALL_OP);
-    writeRelAddress(binTranslator, binTranslator->BT_ip, calcBlockOffset(binTranslator, "main"));
+    writeRuntimeAddress (buf, PRINTF_FLUSH_OFFSET);
 
-    fprintf (fileptr, "mov rax, 0x3c\n");
-    fprintf (fileptr, "xor rdi, rdi\n");
-    fprintf (fileptr, "syscall\n");
+    asmPrintf (fileptr, "mov rax, 0x3c\n");
+    asmPrintf (fileptr, "xor rdi, rdi\n");
+    asmPrintf (fileptr, "syscall\n");
 
+    binTranslator->startPatch.exitPos = buf->BT_ip;
     unsigned char codeToExit[] = { 0x48, 0xc7, 0xc0, 0x3c, 0x00, 0x00, 0x00, 0x48, 0x31, 0xff, 0x0f, 0x05};
-    memcpy(binTranslator->x86_array + binTranslator->BT_ip, codeToExit, sizeof(codeToExit));
-    binTranslator->BT_ip += sizeof(codeToExit);
+    reserveCode (buf, sizeof (codeToExit));
+    memcpy(buf->x86_array + buf->BT_ip, codeToExit, sizeof(codeToExit));
+    buf->BT_ip += sizeof(codeToExit);
 }
 
-static void dumpEnd (FILE* fileptr)
+static void dumpEnd (FILE* fileptr, const BinaryTranslator* binTranslator)
 {
-    fprintf (fileptr, "section .data\n");
-    fprintf (fileptr, "Buf: times 512 db 0\n");
+    asmPrintf (fileptr, "section .data\n");
+    asmPrintf (fileptr, "OutBuf: times %d db 0\n", PRINTF_BUF_SIZE);
+    asmPrintf (fileptr, "InBuf: times %d db 0\n", SCANF_BUF_SIZE);
+    asmPrintf (fileptr, "section .bss\n");
+    asmPrintf (fileptr, "Stack: resb %lu\n", binTranslator->stackSize);
 }
 
-void dumpIRToAsm (const char* fileName, BinaryTranslator* binTranslator)
+// Functions go after _start in their order. Blocks and fixups of a function
+// are relative to its buffer, so they move by the place it got
+static void linkFunctions (FILE* fileptr, BinaryTranslator* binTranslator)
 {
-    FILE* mainFilePtr = fopen (fileName, "wb");
-    FILE* fileptr = fopen ("DebugAsm.s", "w");
-    dumpStart(fileptr, binTranslator);
+    CodeBuf_bt* buf = &binTranslator->code;
 
     for (size_t i = 0; i < binTranslator->funcArraySize; i++)
     {
-        dumpFunctionToAsm (fileptr, binTranslator, &binTranslator->funcArray[i]);
-    }
+        Func_bt*    function = &binTranslator->funcArray[i];
+        CodeBuf_bt* funcBuf  = &function->ctx.code;
+        size_t      base     = buf->BT_ip;
 
-    dumpEnd(fileptr);
+        reserveCode (buf, funcBuf->BT_ip);
+        memcpy (buf->x86_array + base, funcBuf->x86_array, funcBuf->BT_ip);
+        buf->BT_ip += funcBuf->BT_ip;
 
-    Dumpx86Buf(binTranslator, 0, binTranslator->BT_ip);
+        for (size_t b = 0; b < function->blockArraySize; b++)
+            function->blockArray[b].codeOffset += base;
 
-    fwrite(binTranslator->x86_array, sizeof(unsigned char), binTranslator->x86_arraySize, mainFilePtr);
-    fclose (mainFilePtr);
-    fclose (fileptr);
+        for (size_t f = 0; f < funcBuf->fixupsSize; f++)
+        {
+            Fixup_bt fixup = funcBuf->fixups[f];
+            fixup.pos += base;
+            addFixup (buf, fixup);
+        }
+
+        for (size_t r = 0; r < PH_RULES_COUNT; r++)
+            buf->peepholeHits[r] += funcBuf->peepholeHits[r];
+
+        if (fileptr != NULL)
+            fwrite (function->ctx.asmText, sizeof (char), function->ctx.asmTextSize, fileptr);
+
+        free (funcBuf->x86_array);
+        free (funcBuf->fixups);
+        free (function->ctx.asmText);
+        *funcBuf = {};
+        function->ctx.asmText     = NULL;
+        function->ctx.asmTextSize = 0;
+    }
 }
 
-void firstIteration (BinaryTranslator* binTranslator)
+static void resolveFixups (CodeBuf_bt* buf)
 {
-    size_t ip = 0;
-    size_t numberOfBlocks = 0;
-
-    for (size_t i = 0; i < binTranslator->funcArraySize; i++)
+    for (size_t i = 0; i < buf->fixupsSize; i++)
     {
-        for (size_t j = 0; j < binTranslator->funcArray[i].blockArraySize; j ++)
-        {
-            numberOfBlocks += binTranslator->funcArray[i].blockArraySize;
-            for (size_t k = 0; k < binTranslator->funcArray[i].blockArray[j].cmdArraySize; k++)
-            {
-                ip+=4*8;
-            }
+        Fixup_bt fixup = buf->fixups[i];
 
-            binTranslator->funcArray[i].blockArray[j].codeOffset = ip;
-        }
+        size_t destPos = (fixup.kind == FIXUP_BLOCK) ? fixup.block->codeOffset
+                                                     : buf->x86_arraySize + fixup.runtimeOffset;
+
+        patchImm32 (buf, fixup.pos, (int) destPos - (int) fixup.pos - (int) sizeof (int));
     }
+}
+
+// Runtime goes right after code, its buffers and the stack after runtime, see makeElfFile.
+// startProg patches these again when running in process
+static void patchStartAddresses (BinaryTranslator* binTranslator)
+{
+    CodeBuf_bt* buf = &binTranslator->code;
+
+    size_t runtimeEnd = 0x400078 + buf->x86_arraySize + Config.sizeOfPrintf + Config.sizeOfScanf;
+    size_t stackTop   = (runtimeEnd + PRINTF_BUF_SIZE + SCANF_BUF_SIZE + binTranslator->stackSize) & ~(size_t) 0xF;
 
-    binTranslator->x86_arraySize = ip;
+    patchImm64 (buf, binTranslator->startPatch.printfOutPos, runtimeEnd);
+    patchImm64 (buf, binTranslator->startPatch.scanfBufPos,  runtimeEnd + PRINTF_BUF_SIZE);
+    patchImm64 (buf, binTranslator->startPatch.stackPos,     stackTop);
+}
 
-    if ((sizeof(char) * ip) % 4096 != 0)
+// Functions are emitted in parallel, each into its own buffer, then linked.
+// DebugAsm.s is written with --dump asm, code goes to fileName with --dump code
+void dumpIRToAsm (const char* fileName, BinaryTranslator* binTranslator)
+{
+    FILE* fileptr = NULL;
+    if (binTranslator->dumps & DUMP_ASM)
     {
-        size_t sizeOfMem = (sizeof(char) * ip) + (4096 - (sizeof(char) * ip) % 4096);
-        binTranslator->x86_array = (unsigned char*) aligned_alloc(4096, sizeOfMem);
+        fileptr = fopen ("DebugAsm.s", "w");
+        assert (fileptr != NULL);
     }
 
-    binTranslator->BT_ip = 0;
-    binTranslator->nameTable.data = (Name*) calloc (numberOfBlocks, sizeof(Name));
-    assert (binTranslator->nameTable.data != NULL);
-    binTranslator->nameTable.numOfVars = numberOfBlocks;
+    CodeBuf_bt* buf = &binTranslator->code;
+    memset (buf->peepholeHits, 0, sizeof (buf->peepholeHits));
+    buf->BT_ip      = 0;
+    buf->fixupsSize = 0;
+
+    threadPoolRun (&binTranslator->pool, emitFunction, binTranslator, binTranslator->funcArraySize);
+
+    size_t emittedSize = 0;
+    for (size_t i = 0; i < binTranslator->funcArraySize; i++)
+        emittedSize += binTranslator->funcArray[i].ctx.code.BT_ip;
+
+    timePhase (binTranslator, "emission", emittedSize);
+
+    dumpStart(fileptr, binTranslator);
+    linkFunctions (fileptr, binTranslator);
+    dumpEnd(fileptr, binTranslator);
+
+    buf->x86_arraySize = buf->BT_ip;
+    resolveFixups (buf);
+    patchStartAddresses (binTranslator);
+
+    if (fileptr != NULL)
+        fclose (fileptr);
+
+    timePhase (binTranslator, "linking", buf->x86_arraySize);
+
+    if (binTranslator->dumps & DUMP_CODE)
+    {
+        Dumpx86Buf(buf, 0, buf->BT_ip);
+
+        FILE* mainFilePtr = fopen (fileName, "wb");
+        assert (mainFilePtr != NULL);
+        fwrite(buf->x86_array, sizeof(unsigned char), buf->x86_arraySize, mainFilePtr);
+        fclose (mainFilePtr);
+
+        timePhase (binTranslator, "code dump", buf->x86_arraySize);
+    }
 }
@@ -0,0 +1,293 @@
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <cctype>
+
+#include "../language/common.h"
+#include "../language/readerLib/functions.h"
+#include "../include/treeText.h"
+
+// Node is (<type> <value> <left> <right>), absent child is _ and absent ones
+// at the end may be left out: (V x) is (V x _ _). Text after # up to the end
+// of line is a comment. Types and values are as the frontend of
+// the language fills Node:
+//     K  key word       ST, VAR, IF, ELSE, WHILE, RET, PARAM, ARG, P, PROG
+//     F  function       FUNC, CALL or name of the function
+//     V  variable       its name
+//     N  number         decimal, may be negative
+//     O  operation      + - * / or = for assignment
+//     B  built in       IN or OUT
+// Program is a chain of PROG nodes with FUNC on the left, see bench/corpus.
+// Arguments of CALL go in the ARG chain from the last one to the first:
+// g (1, 2) is (F CALL (F g (K ARG (N 2) (K ARG (N 1))))).
+
+struct TreeText_bt
+{
+    const char* fileName;
+    char*       text;
+    size_t      pos;
+};
+
+typedef decltype (Node::opValue) OpValue_bt;
+
+struct OpName_bt
+{
+    const char* name;
+    OpValue_bt  value;
+};
+
+static const OpName_bt OpNames[] =
+{
+    {"+",   OP_ADD},
+    {"-",   OP_SUB},
+    {"*",   OP_MUL},
+    {"/",   OP_DIV},
+    {"=",   OP_EQ},
+    {"IN",  OP_IN},
+    {"OUT", OP_OUT},
+};
+
+// NodeDtor frees names of variables and functions only, key words, built ins,
+// CALL and FUNC are not freed, so they point here
+static char KeyWords[][6] = {"ST", "VAR", "IF", "ELSE", "WHILE", "RET", "PARAM", "ARG", "P", "PROG", "CALL", "FUNC", "IN", "OUT"};
+
+static void syntaxError (const TreeText_bt* tree, const char* expected)
+{
+    size_t line = 1;
+    for (size_t i = 0; i < tree->pos; i++)
+    {
+        if (tree->text[i] == '\n')
+            line++;
+    }
+
+    fprintf (stderr, "%s:%lu: %s expected\n", tree->fileName, line, expected);
+}
+
+static void skipSpaces (TreeText_bt* tree)
+{
+    while (true)
+    {
+        char c = tree->text[tree->pos];
+
+        if (isspace ((unsigned char) c))
+            tree->pos++;
+        else if (c == '#')
+        {
+            while (tree->text[tree->pos] != '\0' && tree->text[tree->pos] != '\n')
+                tree->pos++;
+        }
+        else
+            return;
+    }
+}
+
+// Word up to a space or a bracket, caller frees
+static char* readWord (TreeText_bt* tree)
+{
+    skipSpaces (tree);
+
+    size_t start = tree->pos;
+    while (tree->text[tree->pos] != '\0' && !isspace ((unsigned char) tree->text[tree->pos]) &&
+           strchr ("()#", tree->text[tree->pos]) == NULL)
+        tree->pos++;
+
+    if (tree->pos == start)
+        return NULL;
+
+    return strndup (tree->text + start, tree->pos - start);
+}
+
+static bool findOp (const char* name, OpValue_bt* value)
+{
+    for (size_t i = 0; i < sizeof (OpNames) / sizeof (*OpNames); i++)
+    {
+        if (strcmp (OpNames[i].name, name) == 0)
+        {
+            *value = OpNames[i].value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static char* findKeyWord (const char* name)
+{
+    for (size_t i = 0; i < sizeof (KeyWords) / sizeof (*KeyWords); i++)
+    {
+        if (strcmp (KeyWords[i], name) == 0)
+            return KeyWords[i];
+    }
+
+    return NULL;
+}
+
+// Takes value, false if it does not fit the type
+static bool setValue (Node* node, const char* type, char* value)
+{
+    if (type == NULL || value == NULL || type[1] != '\0')
+    {
+        free (value);
+        return false;
+    }
+
+    bool  known = true;
+    char* end   = NULL;
+
+    switch (type[0])
+    {
+        case 'K':
+            node->type = Key_t;
+            node->Name = findKeyWord (value);
+            known      = node->Name != NULL;
+            break;
+
+        case 'F':
+            node->type = Func_t;
+            node->Name = findKeyWord (value);
+            if (node->Name != NULL)
+                known = strcmp (value, "CALL") == 0 || strcmp (value, "FUNC") == 0;
+            else
+            {
+                node->Name = value;
+                return true;
+            }
+            break;
+
+        case 'V':
+            node->type        = Var_t;
+            node->var.varName = value;
+            return true;
+
+        case 'N':
+            node->type     = Num_t;
+            node->numValue = strtod (value, &end);
+            known          = *end == '\0';
+            break;
+
+        case 'O':
+            node->type = OP_t;
+            known      = findOp (value, &node->opValue) && node->opValue != OP_IN && node->opValue != OP_OUT;
+            break;
+
+        case 'B':
+            node->type = BuiltIn_t;
+            node->Name = findKeyWord (value);
+            known      = findOp (value, &node->opValue) && (node->opValue == OP_IN || node->opValue == OP_OUT);
+            break;
+
+        default:
+            known = false;
+            break;
+    }
+
+    free (value);
+    return known;
+}
+
+static bool readNode (TreeText_bt* tree, Node** node)
+{
+    skipSpaces (tree);
+    *node = NULL;
+
+    if (tree->text[tree->pos] == '_')
+    {
+        tree->pos++;
+        return true;
+    }
+
+    if (tree->text[tree->pos] != '(')
+    {
+        syntaxError (tree, "( or _");
+        return false;
+    }
+    tree->pos++;
+
+    *node = (Node*) calloc (1, sizeof (Node));
+    assert (*node != NULL);
+
+    char* type  = readWord (tree);
+    bool  known = setValue (*node, type, readWord (tree));
+    free (type);
+
+    if (!known)
+    {
+        syntaxError (tree, "type of node K, F, V, N, O or B and its value");
+        return false;
+    }
+
+    Node** children[] = {&(*node)->left, &(*node)->right};
+    for (size_t i = 0; i < sizeof (children) / sizeof (*children); i++)
+    {
+        skipSpaces (tree);
+        if (tree->text[tree->pos] == ')')
+            break;
+
+        if (!readNode (tree, children[i]))
+            return false;
+    }
+
+    skipSpaces (tree);
+    if (tree->text[tree->pos] != ')')
+    {
+        syntaxError (tree, ")");
+        return false;
+    }
+    tree->pos++;
+
+    return true;
+}
+
+// Leaves file position where it was
+bool isTreeText (FILE* fileptr)
+{
+    assert (fileptr != NULL);
+
+    long start = ftell (fileptr);
+    int  c     = fgetc (fileptr);
+    while (c == '#' || isspace (c))
+    {
+        if (c == '#')
+        {
+            while (c != EOF && c != '\n')
+                c = fgetc (fileptr);
+        }
+
+        c = fgetc (fileptr);
+    }
+
+    fseek (fileptr, start, SEEK_SET);
+    return c == '(';
+}
+
+// NULL if the text is broken, error is printed to stderr. Broken tree is not
+// freed, translator stops then anyway
+Node* readTreeText (const char* fileName)
+{
+    assert (fileName != NULL);
+
+    FILE* fileptr = fopen (fileName, "r");
+    assert (fileptr != NULL);
+
+    size_t size = fileSize (fileptr);
+    TreeText_bt tree = {.fileName = fileName, .text = (char*) calloc (size + 1, sizeof (char)), .pos = 0};
+    assert (tree.text != NULL);
+
+    size_t read = fread (tree.text, sizeof (char), size, fileptr);
+    fclose (fileptr);
+    tree.text[read] = '\0';
+
+    Node* root = NULL;
+    bool  ok   = readNode (&tree, &root);
+
+    skipSpaces (&tree);
+    if (ok && tree.text[tree.pos] != '\0')
+    {
+        syntaxError (&tree, "end of file");
+        ok = false;
+    }
+
+    free (tree.text);
+    return ok ? root : NULL;
+}
@@ -0,0 +1,161 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <climits>
+#include <sys/mman.h>
+
+#include "../language/common.h"
+#include "../include/BinaryTranslator.h"
+#include "../include/translator.h"
+
+// Checks code of translateDivByNum against division of C, which is what
+// idiv of the translator gives. The code is emitted as it is for OP_DIV,
+// wrapped into a function and run: mov rax, rdi; <division>; ret.
+// Only the low half of rax is compared, numbers are 32 bit. The high half
+// of the dividend is filled with garbage, it must not be trusted.
+
+// translator.cpp needs it to link, runtime is not called here
+Configuration Config = {};
+
+typedef int64_t (*DivFunc) (uint64_t dividend);
+
+static const unsigned char MovRaxRdi[] = {0x48, 0x89, 0xF8};
+
+static const size_t CodePageSize    = 4096;
+static const size_t NumOfRandomDivs = 20000;
+static const size_t NumOfRandomArgs = 200;
+
+struct DivCheck_test
+{
+    unsigned char* code;        // one page, rw while code is written and rx while it runs
+    uint64_t       random;      // xorshift state
+    size_t         numOfChecks;
+    size_t         numOfFails;
+};
+
+static uint64_t nextRandom (DivCheck_test* check)
+{
+    check->random ^= check->random << 13;
+    check->random ^= check->random >> 7;
+    check->random ^= check->random << 17;
+
+    return check->random;
+}
+
+static int32_t expectedQuotient (int32_t dividend, int32_t divisor)
+{
+    // INT_MIN / -1 doesn't fit 32 bits, idiv of 64 bit registers gives 2^31
+    return (int32_t) (uint32_t) (uint64_t) ((int64_t) dividend / divisor);
+}
+
+static DivFunc emitDivision (DivCheck_test* check, int32_t divisor)
+{
+    CodeBuf_bt buf = {};
+    translateDivByNum (NULL, &buf, divisor);
+
+    size_t size = sizeof (MovRaxRdi) + buf.BT_ip + sizeof (unsigned char);
+    assert (size <= CodePageSize);
+
+    int error = mprotect (check->code, CodePageSize, PROT_READ | PROT_WRITE);
+    assert (error == 0);
+
+    memcpy (check->code, MovRaxRdi, sizeof (MovRaxRdi));
+    memcpy (check->code + sizeof (MovRaxRdi), buf.x86_array, buf.BT_ip);
+    check->code[size - 1] = RET_OP;
+
+    error = mprotect (check->code, CodePageSize, PROT_READ | PROT_EXEC);
+    assert (error == 0);
+
+    free (buf.x86_array);
+    free (buf.fixups);
+
+    return (DivFunc) (void*) check->code;
+}
+
+static void checkQuotient (DivCheck_test* check, DivFunc func, int32_t dividend, int32_t divisor)
+{
+    uint64_t garbage = nextRandom (check) << 32;
+    int32_t  result  = (int32_t) (uint32_t) (uint64_t) func (garbage | (uint32_t) dividend);
+    int32_t  expected = expectedQuotient (dividend, divisor);
+
+    check->numOfChecks++;
+    if (result == expected)
+        return;
+
+    if (check->numOfFails++ < 20)
+        printf ("%d / %d: got %d, expected %d\n", dividend, divisor, result, expected);
+}
+
+static void checkDivisor (DivCheck_test* check, int32_t divisor)
+{
+    DivFunc func = emitDivision (check, divisor);
+
+    const int32_t edges[] = {INT_MIN, INT_MIN + 1, -2, -1, 0, 1, 2, INT_MAX - 1, INT_MAX};
+    for (size_t i = 0; i < sizeof (edges) / sizeof (*edges); i++)
+        checkQuotient (check, func, edges[i], divisor);
+
+    // Quotient changes right at multiples of divisor
+    int64_t magnitude = (divisor < 0) ? -(int64_t) divisor : divisor;
+    for (int64_t k = 1; k <= 3; k++)
+    {
+        for (int64_t delta = -1; delta <= 1; delta++)
+        {
+            int64_t dividends[] = {k * magnitude + delta, -k * magnitude + delta,
+                                   (INT_MAX / magnitude - k + 1) * magnitude + delta,
+                                   -(INT_MAX / magnitude - k + 1) * magnitude + delta};
+
+            for (size_t i = 0; i < sizeof (dividends) / sizeof (*dividends); i++)
+            {
+                if (INT_MIN <= dividends[i] && dividends[i] <= INT_MAX)
+                    checkQuotient (check, func, (int32_t) dividends[i], divisor);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < NumOfRandomArgs; i++)
+        checkQuotient (check, func, (int32_t) (uint32_t) nextRandom (check), divisor);
+}
+
+static void checkSigns (DivCheck_test* check, int64_t divisor)
+{
+    if (divisor != 0 && divisor <= INT_MAX)
+        checkDivisor (check, (int32_t) divisor);
+
+    if (divisor != 0 && -divisor >= INT_MIN)
+        checkDivisor (check, (int32_t) -divisor);
+}
+
+int main ()
+{
+    DivCheck_test check = {};
+    check.random = 0x9E3779B97F4A7C15;
+    check.code   = (unsigned char*) mmap (NULL, CodePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert (check.code != MAP_FAILED);
+
+    // Powers of two and their neighbours, INT_MIN and INT_MAX among them
+    for (int power = 0; power <= 31; power++)
+    {
+        int64_t twoPower = (int64_t) 1 << power;
+        for (int64_t delta = -1; delta <= 1; delta++)
+            checkSigns (&check, twoPower + delta);
+    }
+
+    for (int64_t divisor = 3; divisor <= 1000; divisor++)
+        checkSigns (&check, divisor);
+
+    for (size_t i = 0; i < NumOfRandomDivs; i++)
+    {
+        uint64_t random = nextRandom (&check);
+        int      bits   = 2 + (int) (random % 30);      // small divisors as often as large ones
+
+        checkSigns (&check, (int64_t) ((random >> 8) & (((uint64_t) 1 << bits) - 1)));
+    }
+
+    munmap (check.code, CodePageSize);
+
+    printf ("division by constants: %lu checks, %lu failed\n", check.numOfChecks, check.numOfFails);
+    return (check.numOfFails == 0) ? 0 : 1;
+}
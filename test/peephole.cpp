@@ -0,0 +1,92 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include "../language/common.h"
+#include "../include/BinaryTranslator.h"
+#include "../include/peephole.h"
+
+// Runs peepholeBlock on blocks the translator emits and compares them with
+// the expected bytes. A block is encoded again in the bytes it had, so a rule
+// that makes code longer must be skipped, not applied.
+
+// translator.cpp needs it to link, runtime is not called here
+Configuration Config = {};
+
+struct Block_test
+{
+    const char*         name;
+    const unsigned char code[32];
+    size_t              codeSize;
+    const unsigned char expected[32];
+    size_t              expectedSize;
+};
+
+static const Block_test Blocks[] =
+{
+    // Tail call of user-018: push rsi; pop rbx is 2 bytes, mov rbx, rsi is 3
+    {"push rsi; pop rbx before tail call",
+     {0x48, 0x89, 0xC6, 0x56, 0x5B, 0x58, 0x48, 0x89, 0xEC}, 9,
+     {0x48, 0x89, 0xC6, 0x56, 0x5B, 0x58, 0x48, 0x89, 0xEC}, 9},
+
+    {"push r12; pop r13",
+     {0x41, 0x54, 0x41, 0x5D}, 4,
+     {0x4D, 0x89, 0xE5}, 3},
+
+    {"push 5; pop rax",
+     {0x68, 0x05, 0x00, 0x00, 0x00, 0x58}, 6,
+     {0xB8, 0x05, 0x00, 0x00, 0x00}, 5},
+
+    // mov rax, -1 is 7 bytes
+    {"push -1; pop rax",
+     {0x68, 0xFF, 0xFF, 0xFF, 0xFF, 0x58}, 6,
+     {0x68, 0xFF, 0xFF, 0xFF, 0xFF, 0x58}, 6},
+
+    // Load with disp8 is 4 bytes, mov eax, 5 is 5
+    {"mov [rbp - 8], 5; mov rax, [rbp - 8]",
+     {0x48, 0xC7, 0x45, 0xF8, 0x05, 0x00, 0x00, 0x00, 0x48, 0x8B, 0x45, 0xF8}, 12,
+     {0x48, 0xC7, 0x45, 0xF8, 0x05, 0x00, 0x00, 0x00, 0x48, 0x8B, 0x45, 0xF8}, 12},
+};
+
+static bool checkBlock (const Block_test* block)
+{
+    CodeBuf_bt buf = {};
+    buf.x86_arrayCapacity = sizeof (block->code);
+    buf.x86_array         = (unsigned char*) calloc (buf.x86_arrayCapacity, sizeof (unsigned char));
+    assert (buf.x86_array != NULL);
+
+    memcpy (buf.x86_array, block->code, block->codeSize);
+    buf.BT_ip = block->codeSize;
+
+    peepholeBlock (&buf, 0);
+
+    bool ok = buf.BT_ip == block->expectedSize && memcmp (buf.x86_array, block->expected, buf.BT_ip) == 0;
+    if (!ok)
+    {
+        printf ("%s: got", block->name);
+        for (size_t i = 0; i < buf.BT_ip; i++)
+            printf (" %02X", buf.x86_array[i]);
+        printf ("\n");
+    }
+
+    free (buf.x86_array);
+    return ok;
+}
+
+int main ()
+{
+    size_t numOfBlocks = sizeof (Blocks) / sizeof (*Blocks);
+    size_t numOfFails  = 0;
+
+    for (size_t i = 0; i < numOfBlocks; i++)
+    {
+        if (!checkBlock (&Blocks[i]))
+            numOfFails++;
+    }
+
+    printf ("peephole: %lu blocks, %lu failed\n", numOfBlocks, numOfFails);
+    return (numOfFails == 0) ? 0 : 1;
+}